@@ -7,10 +7,10 @@
 #include "raylib/raycloud.h"
 #include "raylib/raycloudwriter.h"
 #include "raylib/rayparse.h"
+#include "raylib/raytiledcloud.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "raylib/imageread.h"
 
-#include <nabo/nabo.h>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -31,7 +31,9 @@ void usage(int exit_code = 1)
   std::cout << "                   1,1,1         - set r,g,b" << std::endl;
   std::cout << "                   branches      - red and green are lidar intensity and cylindricality respectively, greater for branches than for leaves" << std::endl;
   std::cout << "                   image planview.png - colour all points from image, stretched to fit the point bounds" << std::endl;
-  std::cout << "                         --lit   - shaded (slow on large datasets)" << std::endl;
+  std::cout << "                         --lit   - shaded" << std::endl;
+  std::cout << "                         --tile_width 100 - shape, normal, branches and lit are processed in tiles of this width (m), to bound memory use" << std::endl;
+  std::cout << "                         --halo 1         - neighbouring points are gathered from this distance (m) around each tile" << std::endl;
   // clang-format on
   exit(exit_code);
 }
@@ -95,6 +97,151 @@ void colourFromImage(const std::string &cloud_file, const std::string &image_fil
   stbi_image_free(image_data);
 }
 
+/// Colours the owned rays of a tile according to their local surface geometry, and shades them if @c lit is set.
+/// The results are placed in the tile's colours.
+void colourTile(ray::CloudTile &tile, const std::string &type, bool lit, uint8_t split_alpha)
+{
+  ray::Cloud &cloud = tile.cloud;
+  const int search_size = std::min(20, (int)cloud.ends.size() - 1);
+  if (search_size < 1)
+    return;
+  std::vector<Eigen::Vector3d> centroids;
+  std::vector<Eigen::Vector3d> dimensions;
+  std::vector<Eigen::Vector3d> normals;
+  Eigen::MatrixXi indices;
+  std::vector<Eigen::Vector3d> *cents = nullptr, *dims = nullptr, *norms = nullptr;
+  std::vector<Eigen::Matrix3d> *mats = nullptr;
+  Eigen::MatrixXi *inds = nullptr;
+  double max_distance = 0.0;
+
+  // what do we want to calculate...
+  if (type == "normal")
+    norms = &normals;
+  else if (type == "shape")
+    dims = &dimensions;
+  else if (type == "branches")
+  {
+    inds = &indices;
+    dims = &dimensions;
+  }
+  if (lit)
+  {
+    norms = &normals;
+    inds = &indices;
+    cents = &centroids;
+  }
+  cloud.getSurfels(search_size, cents, norms, dims, mats, inds, max_distance, false);
+
+  // unused neighbour slots in indices are negative
+  const int count = (int)cloud.ends.size();
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < count; i++)
+  {
+    if (!cloud.rayBounded(i) || !tile.owned[i])
+      continue;
+    ray::RGBA &colour = cloud.colours[i];
+    if (type == "shape")
+    {
+      const double sphericity = dimensions[i][0] / dimensions[i][2];
+      const double cylindricality = 1.0 - dimensions[i][1] / dimensions[i][2];
+      const double planarity = 1.0 - dimensions[i][0] / dimensions[i][1];
+      colour.red = (uint8_t)(255.0 * sphericity);
+      colour.green = (uint8_t)(255.0 * cylindricality);
+      colour.blue = (uint8_t)(255.0 * planarity);
+    }
+    else if (type == "normal")
+    {
+      colour.red = (uint8_t)(255.0 * (0.5 + 0.5 * normals[i][0]));
+      colour.green = (uint8_t)(255.0 * (0.5 + 0.5 * normals[i][1]));
+      colour.blue = (uint8_t)(255.0 * (0.5 + 0.5 * normals[i][2]));
+    }
+    // colour in order to distinguish branches.
+    // The red channel is a function of the lidar return intensiity, which is typically higher on
+    // branches than on leaves.
+    // The green channel is a measure of the cylindricality of the neighbourhood of points
+    // The resulting colour can be used to segment out branches by thresholding using
+    //  raysplit cloud.ply colour x,y,0 for a choice of x, y
+    else if (type == "branches")
+    {
+      // 1. red is median alpha value, rescaled
+      // we use the median of the neighbour points to be robust to noise
+      std::vector<uint8_t> cols;
+      cols.push_back(colour.alpha);
+      for (int j = 0; j < std::min(4, search_size) && indices(j, i) >= 0; j++)
+      {
+        cols.push_back(cloud.colours[indices(j, i)].alpha);
+      }
+      if (cols.size() == 1)
+        colour.red = colour.alpha;
+      else
+        colour.red = (uint8_t)ray::median(cols);
+
+      // we also compensate for a change in intensity with scale
+      double range = (cloud.ends[i] - cloud.starts[i]).norm();
+      double half_range = 100.0;
+      double red = (double)colour.red / (1.0 + range / half_range);
+      double scale = 2.0;
+      colour.red = (uint8_t)std::max(0, std::min(127 + ((int)(0.5 + red * scale) - (int)(split_alpha * scale)), 255));
+
+      // 2. green is cylindricality
+      Eigen::Vector3d mean = cloud.ends[i];  // centroid
+      int num = 1;
+      for (int j = 0; j < search_size && indices(j, i) >= 0; j++)
+      {
+        mean += cloud.ends[indices(j, i)];
+        num++;
+      }
+      mean /= (double)num;
+      // get teh scatter matrix of the neighbourhood of points
+      Eigen::Matrix3d scatter = (cloud.ends[i] - mean) * (cloud.ends[i] - mean).transpose();
+      for (int j = 0; j < search_size && indices(j, i) >= 0; j++)
+      {
+        Eigen::Vector3d v = cloud.ends[indices(j, i)] - mean;
+        scatter += v * v.transpose();
+      }
+      scatter /= (double)num;
+      // if you divide sqrt(area) by the trace, you get a dimensionless value that
+      // is large for disks and spheres, but small for lines/cylinders. So 1 minus this
+      // value gives a measure of cylindricality
+      double cylind = 1.0 - 3.0 * std::sqrt(areaMeasure(scatter) / 3.0) / scatter.trace();
+      // the above measure is smoother in parameter space than previous methods,
+      // and avoids the need to do an Eigendecomposition.
+      colour.green = (uint8_t)std::max(0.0, 255.0 * std::min(cylind, 1.0));
+
+      // 3. blue is nothing
+      colour.blue = 0;
+    }
+    if (lit)
+    {
+      double sum_x = 0, sum_y = 0, sum_xy = 0, sum_xx = 0, n = 0;
+      for (int j = 0; j < search_size && indices(j, i) >= 0; j++)
+      {
+        int id = indices(j, i);
+        Eigen::Vector3d flat = cloud.ends[id] - centroids[i];
+        double y = flat.dot(normals[i]);
+        flat -= y * normals[i];
+        double x = flat.squaredNorm();
+        sum_x += x;
+        sum_y += y;
+        sum_xy += x * y;
+        sum_xx += x * x;
+        n++;
+      }
+      const double den = n * sum_xx - sum_x * sum_x;
+      const double curvature = std::abs(den) < 1e-8 ? 0.0 : (n * sum_xy - sum_x * sum_y) / den;
+
+      const Eigen::Vector3d light_dir = Eigen::Vector3d(0.2, 0.4, 1.0).normalized();
+      const double curve_scale = 4.0;
+      const double scale1 = 0.5 + 0.5 * normals[i].dot(light_dir);
+      const double scale2 = 0.5 - 0.5 * curvature / curve_scale;
+      const double s = 0.25 + 0.75 * ray::clamped((scale1 + scale2) / 2.0, 0.0, 1.0);
+      colour.red = (uint8_t)((double)colour.red * s);
+      colour.green = (uint8_t)((double)colour.green * s);
+      colour.blue = (uint8_t)((double)colour.blue * s);
+    }
+  }
+}
+
 // Colours the ray cloud based on the specified arguments
 int rayColour(int argc, char *argv[])
 {
@@ -104,10 +251,14 @@ int rayColour(int argc, char *argv[])
   ray::Vector3dArgument col(0.0, 1.0);
   ray::DoubleArgument alpha(0.0, 1.0);
   ray::TextArgument alpha_text("alpha"), image_text("image");
-  const bool standard_format = ray::parseCommandLine(argc, argv, { &cloud_file, &colour_type }, { &lit });
-  const bool flat_colour = ray::parseCommandLine(argc, argv, { &cloud_file, &col }, { &lit });
-  const bool flat_alpha = ray::parseCommandLine(argc, argv, { &cloud_file, &alpha_text, &alpha }, { &lit });
-  const bool image_format = ray::parseCommandLine(argc, argv, { &cloud_file, &image_text, &image_file }, { &lit });
+  ray::DoubleArgument tile_width(0.01, 100000.0, 100.0), halo(0.0, 1000.0, 1.0);
+  ray::OptionalKeyValueArgument tile_width_option("tile_width", 't', &tile_width);
+  ray::OptionalKeyValueArgument halo_option("halo", 'h', &halo);
+  const std::vector<ray::OptionalArgument *> options = { &lit, &tile_width_option, &halo_option };
+  const bool standard_format = ray::parseCommandLine(argc, argv, { &cloud_file, &colour_type }, options);
+  const bool flat_colour = ray::parseCommandLine(argc, argv, { &cloud_file, &col }, options);
+  const bool flat_alpha = ray::parseCommandLine(argc, argv, { &cloud_file, &alpha_text, &alpha }, options);
+  const bool image_format = ray::parseCommandLine(argc, argv, { &cloud_file, &image_text, &image_file }, options);
   if (!standard_format && !flat_colour && !flat_alpha && !image_format)
     usage();
 
@@ -118,8 +269,10 @@ int rayColour(int argc, char *argv[])
 
   if (type != "shape" && type != "normal" && type != "branches")  // chunk loading possible for simple cases
   {
+    // when lit, the colours are written to a temporary file, which is then shaded tile by tile
+    const std::string colour_file = lit.isSet() ? cloud_file.nameStub() + "_unlit.tmp" : out_file;
     ray::CloudWriter writer;
-    if (!writer.begin(out_file))
+    if (!writer.begin(colour_file))
       usage();
 
     auto colour_rays = [flat_colour, flat_alpha, &type, &col, &alpha, &writer, &split_alpha](
@@ -186,184 +339,60 @@ int rayColour(int argc, char *argv[])
     writer.end();
     if (!lit.isSet())
       return 0;
-    in_file = out_file;  // when lit we have to load again, from the saved output file
+    in_file = colour_file;
     std::cout << "reopening file for lighting..." << std::endl;
   }
 
-  // The remainder cannot currently be done with chunk loading
-  ray::Cloud cloud;
-  if (!cloud.load(in_file))
+  // The remainder needs the local surface geometry, so the cloud is processed one halo-padded tile at a time
+  ray::TiledCloud tiles(tile_width.value(), halo.value());
+  if (!tiles.load(in_file, cloud_file.nameStub()))
     usage();
-
-  // what I need is the normal, curvature, eigenvalues, per point.
-  struct Data
-  {
-    Eigen::Vector3d normal;
-    Eigen::Vector3d dimensions;
-    double curvature;
-  };
-  std::vector<Data> data(cloud.ends.size());
-  const int search_size = std::min(20, (int)cloud.ends.size() - 1);
-  std::vector<Eigen::Vector3d> centroids;
-  std::vector<Eigen::Vector3d> dimensions;
-  std::vector<Eigen::Vector3d> normals;
-  Eigen::MatrixXi indices;
-  std::vector<Eigen::Vector3d> *cents = nullptr, *dims = nullptr, *norms = nullptr;
-  std::vector<Eigen::Matrix3d> *mats = nullptr;
-  Eigen::MatrixXi *inds = nullptr;
-  double max_distance = 0.0;
-
-  // what do we want to calculate...
-  bool calc_surfels = true;
-  if (type == "normal")
-    norms = &normals;
-  else if (type == "shape")
-    dims = &dimensions;
-  else if (type == "branches")
-  {
-    inds = &indices;
-    dims = &dimensions;
-  }
-  else
-    calc_surfels = lit.isSet();
-  if (lit.isSet())
-  {
-    norms = &normals;
-    inds = &indices;
-    cents = &centroids;
-  }
-
-  if (calc_surfels)
-    cloud.getSurfels(search_size, cents, norms, dims, mats, inds, max_distance, false);
-  if (type == "shape")
-  {
-    for (int i = 0; i < (int)cloud.ends.size(); i++)
-    {
-      if (!cloud.rayBounded(i))
-        continue;
-      const double sphericity = dimensions[i][0] / dimensions[i][2];
-      const double cylindricality = 1.0 - dimensions[i][1] / dimensions[i][2];
-      const double planarity = 1.0 - dimensions[i][0] / dimensions[i][1];
-      cloud.colours[i].red = (uint8_t)(255.0 * sphericity);
-      cloud.colours[i].green = (uint8_t)(255.0 * cylindricality);
-      cloud.colours[i].blue = (uint8_t)(255.0 * planarity);
-    }
-  }
-  else if (type == "normal")
-  {
-    for (int i = 0; i < (int)cloud.ends.size(); i++)
-    {
-      if (!cloud.rayBounded(i))
-        continue;
-      cloud.colours[i].red = (uint8_t)(255.0 * (0.5 + 0.5 * normals[i][0]));
-      cloud.colours[i].green = (uint8_t)(255.0 * (0.5 + 0.5 * normals[i][1]));
-      cloud.colours[i].blue = (uint8_t)(255.0 * (0.5 + 0.5 * normals[i][2]));
-    }
-  }
-  // colour in order to distinguish branches.
-  // The red channel is a function of the lidar return intensiity, which is typically higher on
-  // branches than on leaves.
-  // The green channel is a measure of the cylindricality of the neighbourhood of points
-  // The resulting colour can be used to segment out branches by thresholding using
-  //  raysplit cloud.ply colour x,y,0 for a choice of x, y
-  else if (type == "branches")
-  {
-    std::vector<uint8_t> cols;
-    for (int i = 0; i < (int)cloud.ends.size(); i++)
+  ray::RayValueFile<ray::RGBA> tile_colours;
+  if (!tile_colours.open(cloud_file.nameStub() + "_colours.tmp", tiles.rayCount()))
+    usage();
+  std::vector<uint64_t> ids;
+  std::vector<ray::RGBA> owned_colours;
+  bool values_ok = true;
+  auto colour_tile = [&](ray::CloudTile &tile) {
+    colourTile(tile, type, lit.isSet(), split_alpha);
+    ids.clear();
+    owned_colours.clear();
+    for (size_t i = 0; i < tile.ids.size(); i++)
     {
-      // 1. red is median alpha value, rescaled
-      // we use the median of the neighbour points to be robust to noise
-      cols.clear();
-      cols.push_back(cloud.colours[i].alpha);
-      for (int j = 0; j < 4 && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
-      {
-        cols.push_back(cloud.colours[indices(j, i)].alpha);
-      }
-      if (cols.size() == 1)
-        cloud.colours[i].red = cloud.colours[i].alpha;
-      else
-        cloud.colours[i].red = (uint8_t)ray::median(cols);
-
-      // we also compensate for a change in intensity with scale
-      double range = (cloud.ends[i] - cloud.starts[i]).norm();
-      double half_range = 100.0;
-      double red = (double)cloud.colours[i].red / (1.0 + range / half_range);
-      double scale = 2.0;
-      cloud.colours[i].red =
-        (uint8_t)std::max(0, std::min(127 + ((int)(0.5 + red * scale) - (int)(split_alpha * scale)), 255));
-
-      // 2. green is cylindricality
-      Eigen::Vector3d mean = cloud.ends[i];  // centroid
-      int num = 1;
-      for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
+      if (tile.owned[i])
       {
-        mean += cloud.ends[indices(j, i)];
-        num++;
+        ids.push_back(tile.ids[i]);
+        owned_colours.push_back(tile.cloud.colours[i]);
       }
-      mean /= (double)num;
-      // get teh scatter matrix of the neighbourhood of points
-      Eigen::Matrix3d scatter = (cloud.ends[i] - mean) * (cloud.ends[i] - mean).transpose();
-      for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
-      {
-        Eigen::Vector3d v = cloud.ends[indices(j, i)] - mean;
-        scatter += v * v.transpose();
-      }
-      scatter /= (double)num;
-      // if you divide sqrt(area) by the trace, you get a dimensionless value that
-      // is large for disks and spheres, but small for lines/cylinders. So 1 minus this
-      // value gives a measure of cylindricality
-      double cylind = 1.0 - 3.0 * std::sqrt(areaMeasure(scatter) / 3.0) / scatter.trace();
-      // the above measure is smoother in parameter space than previous methods,
-      // and avoids the need to do an Eigendecomposition.
-      cloud.colours[i].green = (uint8_t)std::max(0.0, 255.0 * std::min(cylind, 1.0));
-
-      // 3. blue is nothing
-      cloud.colours[i].blue = 0;
     }
-  }
-  if (lit.isSet())
-  {
-    std::vector<double> curvatures(cloud.ends.size());
-    for (int i = 0; i < (int)cloud.ends.size(); i++)
+    values_ok = values_ok && tile_colours.write(ids, owned_colours);
+  };
+  if (!tiles.forEachTile(colour_tile) || !values_ok)
+    usage();
+
+  ray::CloudWriter writer;
+  if (!writer.begin(out_file))
+    usage();
+  auto apply_colours = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                           std::vector<double> &times, std::vector<ray::RGBA> &colours) {
+    if (!tile_colours.read(colours.size(), owned_colours))
     {
-      if (!cloud.rayBounded(i))
-        continue;
-      double sum_x = 0, sum_y = 0, sum_xy = 0, sum_xx = 0, sum_yy = 0, n = 0;
-      for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
-      {
-        int id = indices(j, i);
-        Eigen::Vector3d flat = cloud.ends[id] - centroids[i];
-        double y = flat.dot(normals[i]);
-        flat -= y * normals[i];
-        double x = flat.squaredNorm();
-        sum_x += x;
-        sum_y += y;
-        sum_xy += x * y;
-        sum_xx += x * x;
-        sum_yy += y * y;
-        n++;
-      }
-      const double den = n * sum_xx - sum_x * sum_x;
-      if (abs(den) < 1e-8)
-        curvatures[i] = 0.0;
-      else
-        curvatures[i] = (n * sum_xy - sum_x * sum_y) / den;
+      values_ok = false;
+      return;
     }
-    Eigen::Vector3d light_dir = Eigen::Vector3d(0.2, 0.4, 1.0).normalized();
-    double curve_scale = 4.0;
-    for (int i = 0; i < (int)cloud.ends.size(); i++)
+    for (size_t i = 0; i < colours.size(); i++)
     {
-      if (!cloud.rayBounded(i))
-        continue;
-      const double scale1 = 0.5 + 0.5 * normals[i].dot(light_dir);
-      const double scale2 = 0.5 - 0.5 * curvatures[i] / curve_scale;
-      const double s = 0.25 + 0.75 * ray::clamped((scale1 + scale2) / 2.0, 0.0, 1.0);
-      cloud.colours[i].red = (uint8_t)((double)cloud.colours[i].red * s);
-      cloud.colours[i].green = (uint8_t)((double)cloud.colours[i].green * s);
-      cloud.colours[i].blue = (uint8_t)((double)cloud.colours[i].blue * s);
+      if (colours[i].alpha > 0)
+        colours[i] = owned_colours[i];
     }
-  }
-  cloud.save(out_file);
+    writer.writeChunk(starts, ends, times, colours);
+  };
+  if (!ray::Cloud::read(in_file, apply_colours) || !values_ok)
+    usage();
+  writer.end();
+  tile_colours.close();
+  if (in_file != cloud_file.name())
+    std::remove(in_file.c_str());
 
   return 0;
 }
@@ -371,4 +400,4 @@ int rayColour(int argc, char *argv[])
 int main(int argc, char *argv[])
 {
   return ray::runWithMemoryCheck(rayColour, argc, argv);
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -4,17 +4,20 @@
 //
 // Author: Thomas Lowe
 #include "raylib/raycloud.h"
+#include "raylib/raycloudwriter.h"
 #include "raylib/raymerger.h"
 #include "raylib/raymesh.h"
 #include "raylib/rayparse.h"
 #include "raylib/rayply.h"
 #include "raylib/rayprogressthread.h"
 #include "raylib/raythreads.h"
+#include "raylib/raytiledcloud.h"
 
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <memory>
 
 void usage(int exit_code = 1)
 {
@@ -29,34 +32,212 @@ void usage(int exit_code = 1)
   std::cout << "           oldest - keeps the oldest geometry when there is a difference in later ray clouds." << std::endl;
   std::cout << "           newest - uses the newest geometry when there is a difference in newer ray clouds." << std::endl;
   std::cout << "           order  - conflicts are resolved in argument order, with the first taking priority." << std::endl;
+  std::cout << "raycombine time raycloud1 raycloud2 ... raycloudN  - merge time-sorted clouds into one time-sorted _combined.ply cloud" << std::endl;
   std::cout << "raycombine basecloud min raycloud1 raycloud2 20 rays - 3-way merge, choses the changed geometry (from basecloud) at any differences. " << std::endl;
   std::cout << "                                                       For merge conflicts it uses the specified merge type." << std::endl;
   std::cout << "        --output raycloud_combined.ply               - optionally specify the output file name." << std::endl;
+  std::cout << "        --tile_width 50 - combine in tiles of this width (m), to bound memory use on large clouds. Not for 3-way merges" << std::endl;
+  std::cout << "        --halo 2        - rays are gathered from this distance (m) around each tile. It should exceed the" << std::endl;
+  std::cout << "                          point neighbourhood size and the ray grid voxel size, for the same result as untiled." << std::endl;
+  std::cout << "                          Neighbourhoods are wider where points are sparse, such as far from the scanner" << std::endl;
+  std::cout << "        --update        - raycloud1 is a previously combined cloud. Only the tiles that the other clouds reach" << std::endl;
+  std::cout << "                          are combined again, the rest of raycloud1 is copied through. Implies --tile_width" << std::endl;
   // clang-format on
   exit(exit_code);
 }
 
+/// The output is written to this temporary file, which replaces @c file_name once it is complete. The inputs are read
+/// while the output is written, so this keeps an input that is also the output intact until it has been read
+std::string temporaryName(const std::string &file_name)
+{
+  const std::string extension = ".ply";
+  const bool has_extension = file_name.size() > extension.size() &&
+                             file_name.compare(file_name.size() - extension.size(), extension.size(), extension) == 0;
+  return (has_extension ? file_name.substr(0, file_name.size() - extension.size()) : file_name) + "~.ply";
+}
+
+/// Replace @c file_name with its completed temporary file
+bool replaceWithTemporary(const std::string &file_name)
+{
+  if (std::rename(temporaryName(file_name).c_str(), file_name.c_str()) != 0)
+  {
+    std::cerr << "Error: cannot rename " << temporaryName(file_name) << " to " << file_name << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/// Combine the clouds one tile at a time, so that memory use is bounded by the tile size rather than the total size of
+/// the clouds. All clouds are tiled over their combined bound, and each tile is merged with the rays ending in its
+/// halo and the rays passing through it. The transient marks of all tiles are combined per ray, then each cloud is
+/// split in its original ray order into the combined and differences files.
+/// Tiles with rays from only one cloud have nothing to combine, so are skipped. When @c update is set, the first cloud
+/// is a previous combined result, and is only binned into the tiles that the other clouds reach. So updating a large
+/// combined cloud with a new scan costs one pass over it, plus the work in the area of the new scan.
+bool combineInTiles(const std::vector<ray::FileArgument> &cloud_files, const ray::MergerConfig &config,
+                    const std::string &combined_file, const std::string &differences_file, double tile_width,
+                    double halo, bool update)
+{
+  const size_t num_clouds = cloud_files.size();
+  std::vector<ray::Cloud::Info> infos(num_clouds);
+  ray::Cuboid bound(Eigen::Vector3d(1e10, 1e10, 1e10), Eigen::Vector3d(-1e10, -1e10, -1e10));
+  for (size_t c = 0; c < num_clouds; c++)
+  {
+    if (!ray::Cloud::getInfo(cloud_files[c].name(), infos[c]))
+      return false;
+    bound.min_bound_ = ray::minVector(bound.min_bound_, infos[c].rays_bound.min_bound_);
+    bound.max_bound_ = ray::maxVector(bound.max_bound_, infos[c].rays_bound.max_bound_);
+  }
+  // estimate the voxel size of each cloud once over the whole cloud, as the untiled merge does, and grid each tile
+  // within the grid bound of the whole cloud
+  std::vector<double> voxel_sizes(num_clouds, config.voxel_size);
+  std::vector<ray::Cuboid> grid_bounds(num_clouds, bound);
+  for (size_t c = 0; c < num_clouds; c++)
+  {
+    grid_bounds[c] = infos[c].bounded_rays_bound;
+    if (config.voxel_size <= 0.0 && infos[c].num_bounded > 0)
+    {
+      voxel_sizes[c] =
+        4.0 * ray::Cloud::estimatePointSpacing(cloud_files[c].name(), infos[c].ends_bound, infos[c].num_bounded);
+    }
+  }
+
+  // each cloud is tiled separately, sharing the memory budget
+  std::vector<std::unique_ptr<ray::TiledCloud>> tiles(num_clouds);
+  std::vector<ray::RayValueFile<uint8_t>> transient_files(num_clouds);
+  std::vector<uint8_t> update_mask;
+  for (size_t k = 0; k < num_clouds; k++)
+  {
+    // when updating, the first cloud is loaded last, into the tiles that the others occupy
+    const size_t c = update ? (k + 1) % num_clouds : k;
+    tiles[c].reset(new ray::TiledCloud(tile_width, halo, std::max<size_t>(10000000 / num_clouds, 1)));
+    tiles[c]->setTilingBound(bound);
+    if (update && c == 0)
+      tiles[c]->setTileMask(update_mask);
+    const std::string temp_stub = cloud_files[0].nameStub() + "_combine" + std::to_string(c);
+    if (!tiles[c]->load(cloud_files[c].name(), temp_stub, true, true))
+      return false;
+    if (!transient_files[c].open(temp_stub + "_transients.tmp", tiles[c]->rayCount()))
+      return false;
+    if (update && c != 0)
+    {
+      const std::vector<uint8_t> occupied = tiles[c]->occupiedTiles();
+      update_mask.resize(occupied.size(), 0);
+      for (size_t i = 0; i < occupied.size(); i++) update_mask[i] |= occupied[i];
+    }
+  }
+
+  ray::Merger merger(config);
+  std::vector<ray::CloudTile> cloud_tiles(num_clouds);
+  std::vector<ray::Cloud> clouds(num_clouds);
+  std::vector<std::vector<uint8_t>> owned(num_clouds), marks;
+  std::vector<uint64_t> marked_ids;
+  const Eigen::Vector2i &dims = tiles[0]->tileDims();
+  for (int y = 0; y < dims[1]; y++)
+  {
+    for (int x = 0; x < dims[0]; x++)
+    {
+      int num_occupied = 0;
+      for (size_t c = 0; c < num_clouds; c++)
+      {
+        if (!tiles[c]->extractTile(Eigen::Vector2i(x, y), cloud_tiles[c]))
+          return false;
+        num_occupied += cloud_tiles[c].ids.empty() ? 0 : 1;
+      }
+      if (num_occupied < 2)
+        continue;
+      for (size_t c = 0; c < num_clouds; c++)
+      {
+        std::swap(clouds[c], cloud_tiles[c].cloud);
+        std::swap(owned[c], cloud_tiles[c].owned);
+      }
+      merger.mergeMultipleTile(clouds, owned, voxel_sizes, grid_bounds, marks);
+      for (size_t c = 0; c < num_clouds; c++)
+      {
+        marked_ids.clear();
+        for (size_t i = 0; i < marks[c].size(); i++)
+        {
+          if (marks[c][i])
+            marked_ids.push_back(cloud_tiles[c].ids[i]);
+        }
+        if (!transient_files[c].write(marked_ids, std::vector<uint8_t>(marked_ids.size(), 1)))
+          return false;
+      }
+    }
+  }
+
+  ray::CloudWriter combined_writer, differences_writer;
+  if (!combined_writer.begin(temporaryName(combined_file)) ||
+      !differences_writer.begin(temporaryName(differences_file)))
+    return false;
+  ray::Cloud combined_chunk, differences_chunk;
+  std::vector<uint8_t> transient;
+  size_t num_transients = 0, num_fixed = 0;
+  bool values_ok = true;
+  for (size_t c = 0; c < num_clouds; c++)
+  {
+    auto split_rays = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                          std::vector<double> &times, std::vector<ray::RGBA> &colours) {
+      if (!transient_files[c].read(ends.size(), transient))
+      {
+        values_ok = false;
+        return;
+      }
+      combined_chunk.clear();
+      differences_chunk.clear();
+      for (size_t i = 0; i < ends.size(); i++)
+      {
+        ray::Cloud &chunk = transient[i] ? differences_chunk : combined_chunk;
+        chunk.addRay(starts[i], ends[i], times[i], colours[i]);
+      }
+      num_transients += differences_chunk.rayCount();
+      num_fixed += combined_chunk.rayCount();
+      combined_writer.writeChunk(combined_chunk);
+      differences_writer.writeChunk(differences_chunk);
+    };
+    if (!ray::Cloud::read(cloud_files[c].name(), split_rays) || !values_ok)
+    {
+      std::remove(temporaryName(combined_file).c_str());
+      std::remove(temporaryName(differences_file).c_str());
+      return false;
+    }
+    transient_files[c].close();
+  }
+  combined_writer.end();
+  differences_writer.end();
+  if (!replaceWithTemporary(combined_file) || !replaceWithTemporary(differences_file))
+    return false;
+  std::cout << num_transients << " transients, " << num_fixed << " fixed rays." << std::endl;
+  return true;
+}
+
 // Combines multiple clouds together
 int rayCombine(int argc, char *argv[])
 {
   ray::KeyChoice merge_type({ "min", "max", "oldest", "newest", "order" });
   ray::FileArgumentList cloud_files(2);
   ray::DoubleArgument num_rays(0.0, 100.0);
-  ray::TextArgument rays_text("rays"), all_text("all");
+  ray::TextArgument rays_text("rays"), all_text("all"), time_text("time");
 
   // Below: false = allow unusual file extensions, for auto-merging, which occurs on non-standard temporary file names
   ray::FileArgument base_cloud(false), cloud_1(false), cloud_2(false), output_file(false);
   ray::OptionalKeyValueArgument output("output", 'o', &output_file);
+  ray::DoubleArgument tile_width(0.1, 100000.0, 50.0), halo(0.0, 1000.0, 2.0);
+  ray::OptionalKeyValueArgument tile_width_option("tile_width", 't', &tile_width);
+  ray::OptionalKeyValueArgument halo_option("halo", 'h', &halo);
+  ray::OptionalFlagArgument update("update", 'u');
 
   // three-way merge option
-  bool standard_format = ray::parseCommandLine(argc, argv, { &merge_type, &cloud_files, &num_rays, &rays_text }, { &output });
+  bool standard_format = ray::parseCommandLine(argc, argv, { &merge_type, &cloud_files, &num_rays, &rays_text },
+                                               { &output, &tile_width_option, &halo_option, &update });
   bool concatenate_all = ray::parseCommandLine(argc, argv, { &all_text, &cloud_files }, { &output });
   bool concatenate = false;
+  bool time_order = ray::parseCommandLine(argc, argv, { &time_text, &cloud_files }, { &output });
   bool threeway = ray::parseCommandLine(
     argc, argv, { &base_cloud, &merge_type, &cloud_1, &cloud_2, &num_rays, &rays_text }, { &output });
   bool threeway_concatenate =
     ray::parseCommandLine(argc, argv, { &base_cloud, &all_text, &cloud_1, &cloud_2 }, { &output });
-  if (!standard_format && !concatenate_all && !threeway && !threeway_concatenate)
+  if (!standard_format && !concatenate_all && !time_order && !threeway && !threeway_concatenate)
   {
     concatenate = ray::parseCommandLine(argc, argv, { &cloud_files }, { &output }); // a bit more ambiguous, so only try if the other formats failed
     if (!concatenate)
@@ -68,6 +249,32 @@ int rayCombine(int argc, char *argv[])
   // we know there is at least one file, as we specified a minimum number in FileArgumentList
   std::string file_stub =
     (threeway || threeway_concatenate) ? base_cloud.nameStub() : cloud_files.files()[0].nameStub();
+  const bool tiled = standard_format && (tile_width_option.isSet() || update.isSet());
+  const std::string combined_file = output.isSet() ? output_file.name() : file_stub + "_combined.ply";
+
+  // concatenation is streamed, so the clouds are never held in memory
+  if (concatenate || concatenate_all || time_order)
+  {
+    std::vector<std::string> file_names;
+    for (const auto &file : cloud_files.files())
+      file_names.push_back(file.name());
+    ray::CloudWriter writer;
+    if (!writer.begin(temporaryName(combined_file)))
+      usage();
+    auto write_chunk = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                           std::vector<double> &times, std::vector<ray::RGBA> &colours) {
+      writer.writeChunk(starts, ends, times, colours);
+    };
+    if (time_order ? !ray::Cloud::readTimeOrdered(file_names, write_chunk) : !ray::Cloud::read(file_names, write_chunk))
+    {
+      std::remove(temporaryName(combined_file).c_str());
+      usage();
+    }
+    writer.end();
+    if (!replaceWithTemporary(combined_file))
+      usage();
+    return 0;
+  }
 
   std::vector<ray::Cloud> clouds;
   if (threeway || threeway_concatenate)
@@ -78,7 +285,7 @@ int rayCombine(int argc, char *argv[])
     if (!clouds[1].load(cloud_2.name(), false))
       usage();
   }
-  else
+  else if (!tiled)
   {
     clouds.resize(cloud_files.files().size());
     for (int i = 0; i < (int)cloud_files.files().size(); i++)
@@ -112,16 +319,22 @@ int rayCombine(int argc, char *argv[])
   {
     config.merge_type = ray::MergeType::Maximum;
   }
-  if (concatenate || threeway_concatenate || concatenate_all)
+  if (threeway_concatenate)
   {
     config.merge_type = ray::MergeType::All;
   }
 
+  if (tiled)
+  {
+    if (!combineInTiles(cloud_files.files(), config, combined_file, file_stub + "_differences.ply", tile_width.value(),
+                        halo.value(), update.isSet()))
+      usage();
+    return 0;
+  }
+
   ray::Merger merger(config);
   ray::Progress progress;
   ray::ProgressThread progress_thread(progress);
-  ray::Cloud concatenated_cloud;
-  const ray::Cloud *fixed_cloud = &merger.fixedCloud();
 
   if (threeway || threeway_concatenate)
   {
@@ -130,17 +343,6 @@ int rayCombine(int argc, char *argv[])
       usage();
     merger.mergeThreeWay(base_cloud, clouds[0], clouds[1], &progress);
   }
-  else if (concatenate || concatenate_all)
-  {
-    fixed_cloud = &concatenated_cloud;
-    for (auto &cloud : clouds)
-    {
-      concatenated_cloud.starts.insert(concatenated_cloud.starts.end(), cloud.starts.begin(), cloud.starts.end());
-      concatenated_cloud.ends.insert(concatenated_cloud.ends.end(), cloud.ends.begin(), cloud.ends.end());
-      concatenated_cloud.times.insert(concatenated_cloud.times.end(), cloud.times.begin(), cloud.times.end());
-      concatenated_cloud.colours.insert(concatenated_cloud.colours.end(), cloud.colours.begin(), cloud.colours.end());
-    }
-  }
   else
   {
     merger.mergeMultiple(clouds, &progress);
@@ -151,10 +353,7 @@ int rayCombine(int argc, char *argv[])
 
   progress_thread.join();
 
-  if (output.isSet())
-    fixed_cloud->save(output_file.name());
-  else
-    fixed_cloud->save(file_stub + "_combined.ply");
+  merger.fixedCloud().save(combined_file);
   return 0;
 }
 
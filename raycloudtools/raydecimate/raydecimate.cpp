@@ -7,11 +7,15 @@
 #include "raylib/raycloudwriter.h"
 #include "raylib/rayparse.h"
 #include "raylib/rayply.h"
+#include "raylib/raytiledcloud.h"
 
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <vector>
 
 void usage(int exit_code = 1)
 {
@@ -20,10 +24,140 @@ void usage(int exit_code = 1)
   std::cout << "usage:" << std::endl;
   std::cout << "raydecimate raycloud 3 cm   - reduces to one end point every 3 cm" << std::endl;
   std::cout << "raydecimate raycloud 4 rays - reduces to every fourth ray" << std::endl;
+  std::cout << "                   --max_memory 8 - for spatial decimation, limit memory use to approximately this many GB," << std::endl;
+  std::cout << "                                    by decimating the cloud in tiles sized to its densest areas. Tiles are" << std::endl;
+  std::cout << "                                    at least 4 voxels wide, so a denser area can exceed the limit" << std::endl;
   // clang-format off
   exit(exit_code);
 }
 
+/// The widest tile width for which no tile of the cloud, with its halo of @c voxel_width , holds more than
+/// @c max_tile_rays rays. The end points are counted in a horizontal grid of cells, aligned with the tiles of
+/// @c TiledCloud , and each tile's count is bounded by the cells that it and its halo overlap. Tiles are at least
+/// 4 voxels wide, so the width is clamped there when even such tiles exceed the budget.
+bool tileWidthForBudget(const ray::FileArgument &cloud_file, const ray::Cloud::Info &info, double voxel_width,
+                        double max_tile_rays, double &tile_width)
+{
+  const Eigen::Vector3d &min_bound = info.rays_bound.min_bound_;
+  const Eigen::Vector3d extent = info.rays_bound.max_bound_ - min_bound;
+  // the cells are at least a voxel wide, so a halo reaches at most one cell beyond its tile
+  const int max_cells = 1024;
+  const double cell_width = std::max({ voxel_width, extent[0] / max_cells, extent[1] / max_cells });
+  const int dims[2] = { std::max(1, static_cast<int>(std::ceil(extent[0] / cell_width))),
+                        std::max(1, static_cast<int>(std::ceil(extent[1] / cell_width))) };
+  // per-cell ray counts, as a summed area table with a zero first row and column
+  std::vector<size_t> sums(static_cast<size_t>(dims[0] + 1) * (dims[1] + 1), 0);
+  const auto sum = [&](int x, int y) -> size_t & { return sums[static_cast<size_t>(x) + (dims[0] + 1) * y]; };
+  auto count_rays = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends, std::vector<double> &,
+                        std::vector<ray::RGBA> &) {
+    for (const auto &end : ends)
+    {
+      const int x = std::min(std::max(static_cast<int>((end[0] - min_bound[0]) / cell_width), 0), dims[0] - 1);
+      const int y = std::min(std::max(static_cast<int>((end[1] - min_bound[1]) / cell_width), 0), dims[1] - 1);
+      sum(x + 1, y + 1)++;
+    }
+  };
+  if (!ray::Cloud::read(cloud_file.name(), count_rays))
+    return false;
+  for (int y = 1; y <= dims[1]; y++)
+  {
+    for (int x = 1; x <= dims[0]; x++) sum(x, y) += sum(x - 1, y) + sum(x, y - 1) - sum(x - 1, y - 1);
+  }
+
+  // the largest number of rays in a tile of k cells width, with its halo of up to one cell on each side
+  const auto max_tile_count = [&](int k) {
+    size_t max_count = 0;
+    for (int y = 0; y < dims[1]; y += k)
+    {
+      for (int x = 0; x < dims[0]; x += k)
+      {
+        const int x0 = std::max(x - 1, 0), y0 = std::max(y - 1, 0);
+        const int x1 = std::min(x + k + 1, dims[0]), y1 = std::min(y + k + 1, dims[1]);
+        max_count = std::max(max_count, sum(x1, y1) - sum(x0, y1) - sum(x1, y0) + sum(x0, y0));
+      }
+    }
+    return max_count;
+  };
+  const int min_k = std::max(1, static_cast<int>(std::ceil(4.0 * voxel_width / cell_width)));
+  int best_k = 0;
+  for (int k = min_k; k <= std::max(dims[0], dims[1]); k++)
+  {
+    if (static_cast<double>(max_tile_count(k)) <= max_tile_rays)
+      best_k = k;
+  }
+  if (best_k == 0)
+  {
+    std::cout << "warning: the densest tiles of " << min_k * cell_width
+              << " m width exceed the memory limit, decimating with them anyway" << std::endl;
+    best_k = min_k;
+  }
+  tile_width = best_k * cell_width;
+  return true;
+}
+
+/// Spatial decimation in bounded memory. The rays are spilled into tiles, each tile is decimated with its own voxel
+/// set, and the chosen rays are then written in their original order. Each voxel is decimated only by the tile
+/// containing its centre, so the result is the same as decimating the whole cloud with a single voxel set.
+bool decimateInTiles(const ray::FileArgument &cloud_file, double voxel_width, double max_memory_gb,
+                     ray::CloudWriter &writer)
+{
+  ray::Cloud::Info info;
+  if (!ray::Cloud::getInfo(cloud_file.name(), info))
+    return false;
+  // approximate memory per ray, covering the tile buffers and the tile being decimated
+  const double bytes_per_ray = 200.0;
+  const double max_rays = max_memory_gb * 1e9 / bytes_per_ray;
+  // half the memory is for the tile buffers, half for the current tile, which is sized to the densest part of the cloud
+  double tile_width = 0.0;
+  if (!tileWidthForBudget(cloud_file, info, voxel_width, 0.5 * max_rays, tile_width))
+    return false;
+
+  // a halo of one voxel width ensures that every ray in a voxel is present in the tile containing the voxel centre
+  ray::TiledCloud tiles(tile_width, voxel_width, static_cast<size_t>(0.5 * max_rays));
+  if (!tiles.load(cloud_file.name(), cloud_file.nameStub(), true))
+    return false;
+  ray::RayValueFile<uint8_t> keep;
+  if (!keep.open(cloud_file.nameStub() + "_keep.tmp", tiles.rayCount()))
+    return false;
+
+  std::vector<uint64_t> ids;
+  std::vector<uint8_t> flags;
+  bool values_ok = true;
+  auto decimate_tile = [&](ray::CloudTile &tile) {
+    ray::VoxelSet voxel_set;
+    ids.clear();
+    for (size_t i = 0; i < tile.cloud.ends.size(); i++)
+    {
+      const Eigen::Vector3i voxel = ray::voxelIndex(tile.cloud.ends[i], voxel_width);
+      const Eigen::Vector3d centre = (voxel.cast<double>() + Eigen::Vector3d(0.5, 0.5, 0.5)) * voxel_width;
+      if (tiles.tileIndex(centre) == tile.index && voxel_set.insert(voxel))
+        ids.push_back(tile.ids[i]);
+    }
+    flags.assign(ids.size(), 1);
+    values_ok = values_ok && keep.write(ids, flags);
+  };
+  if (!tiles.forEachTile(decimate_tile) || !values_ok)
+    return false;
+
+  ray::Cloud chunk;
+  auto write_kept = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                        std::vector<double> &times, std::vector<ray::RGBA> &colours) {
+    if (!keep.read(ends.size(), flags))
+    {
+      values_ok = false;
+      return;
+    }
+    chunk.clear();
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+      if (flags[i])
+        chunk.addRay(starts[i], ends[i], times[i], colours[i]);
+    }
+    writer.writeChunk(chunk);
+  };
+  return ray::Cloud::read(cloud_file.name(), write_kept) && values_ok;
+}
+
 // Decimates the ray cloud, spatially or in time
 int rayDecimate(int argc, char *argv[])
 {
@@ -31,7 +165,9 @@ int rayDecimate(int argc, char *argv[])
   ray::IntArgument num_rays(1, 100);
   ray::DoubleArgument vox_width(0.01, 100.0);
   ray::ValueKeyChoice quantity({ &vox_width, &num_rays }, { "cm", "rays" });
-  if (!ray::parseCommandLine(argc, argv, { &cloud_file, &quantity }))
+  ray::DoubleArgument max_memory(0.001, 100000.0);
+  ray::OptionalKeyValueArgument max_memory_option("max_memory", 'm', &max_memory);
+  if (!ray::parseCommandLine(argc, argv, { &cloud_file, &quantity }, { &max_memory_option }))
     usage();
   const bool spatial_decimation = quantity.selectedKey() == "cm";
 
@@ -39,12 +175,21 @@ int rayDecimate(int argc, char *argv[])
   if (!writer.begin(cloud_file.nameStub() + "_decimated.ply"))
     usage();
 
+  if (spatial_decimation && max_memory_option.isSet())
+  {
+    if (!decimateInTiles(cloud_file, 0.01 * vox_width.value(), max_memory.value(), writer))
+      usage();
+    writer.end();
+    return 0;
+  }
+
   // By maintaining these buffers below, we avoid almost all memory fragmentation
   ray::Cloud chunk;
   std::vector<int64_t> subsample;
   // voxel set is global, however its size is proportional to the decimated cloud size,
-  // so we expect it to fit within RAM limits
-  std::set<Eigen::Vector3i, ray::Vector3iLess> voxel_set;
+  // so we expect it to fit within RAM limits. Otherwise use --max_memory.
+  // It is sharded by voxel hash, so that each thread decimates its own shard of the voxels
+  std::vector<ray::VoxelSet> voxel_set;
 
   auto decimate = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
                       std::vector<double> &times, std::vector<ray::RGBA> &colours) {
@@ -54,6 +199,7 @@ int rayDecimate(int argc, char *argv[])
       subsample.clear();
       voxelSubsample(ends, width, subsample, voxel_set);
       chunk.resize(subsample.size());
+#pragma omp parallel for schedule(static)
       for (int64_t i = 0; i < (int64_t)subsample.size(); i++)
       {
         int64_t id = subsample[i];
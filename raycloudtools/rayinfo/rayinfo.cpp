@@ -37,20 +37,6 @@ std::string getTime(double unix_time)
   return std::string(time_buf);
 }
 
-/// @brief class to provide an ordering of 2D voxels
-class RAYLIB_EXPORT Vector2iLess
-{
-public:
-  bool operator()(const Eigen::Vector2i &a, const Eigen::Vector2i &b) const
-  {
-    if (a[0] != b[0])
-    {
-      return a[0] < b[0];
-    }
-    return a[1] < b[1];
-  }
-};
-
 int rayInfo(int argc, char *argv[])
 {
   ray::FileArgument cloud;
@@ -62,7 +48,6 @@ int rayInfo(int argc, char *argv[])
   ray::Cloud::Info info;
   ray::Cloud::getInfo(cloud.name(), info);
 
-  std::set<Eigen::Vector2i, Vector2iLess> vox_set; 
 
   int out_of_order = 0;
   int time_jumps = 0;
@@ -77,6 +62,10 @@ int rayInfo(int argc, char *argv[])
   ray::RGBA min_col(255, 255, 255, 255), max_col(0, 0, 0, 0);
   int num_pixels_covered = 0;
   const double voxel_width = 0.5;
+  // the set of covered pixels is a horizontal slice of voxels, a bitset when the bounds are reasonable
+  const Eigen::Vector3i min_pixel = ray::voxelIndex(info.ends_bound.min_bound_, voxel_width);
+  const Eigen::Vector3i max_pixel = ray::voxelIndex(info.ends_bound.max_bound_, voxel_width);
+  ray::VoxelSet vox_set(Eigen::Vector3i(min_pixel[0], min_pixel[1], 0), Eigen::Vector3i(max_pixel[0], max_pixel[1], 0));
   /// This lambda function does most of the work in acquiring general information on the ray cloud
   auto get_info = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
                          std::vector<double> &times, std::vector<ray::RGBA> &colours) {
@@ -85,10 +74,10 @@ int rayInfo(int argc, char *argv[])
       // estimate the area of land covered by points
       if (colours[i].alpha > 0)
       {
-        Eigen::Vector2i voxel(int(std::floor(ends[i][0] / voxel_width)), int(std::floor(ends[i][1] / voxel_width)));
-        if (vox_set.find(voxel) == vox_set.end())
+        const Eigen::Vector3i voxel(int(std::floor(ends[i][0] / voxel_width)),
+                                    int(std::floor(ends[i][1] / voxel_width)), 0);
+        if (vox_set.insert(voxel))
         {
-          vox_set.insert(voxel);
           num_pixels_covered++;
         }
       }
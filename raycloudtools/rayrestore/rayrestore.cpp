@@ -6,11 +6,16 @@
 #include "raylib/raycloud.h"
 #include "raylib/raycloudwriter.h"
 #include "raylib/rayparse.h"
+#include "raylib/rayply.h"
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
 
 void usage(int exit_code = 1)
 {
@@ -19,23 +24,415 @@ void usage(int exit_code = 1)
   std::cout << "usage:" << std::endl;
   std::cout << " rayrestore decimated_cloud 10 cm full_cloud   - decimated_cloud is a 10 cm decimation of full_cloud" << std::endl;
   std::cout << " rayrestore decimated_cloud 10 rays full_cloud - decimated_cloud is an 'every tenth ray' decimation of full_cloud" << std::endl;
+  std::cout << "                             --stream  - merge the two clouds as time-sorted streams, so neither needs to fit in memory." << std::endl;
+  std::cout << "                                         Unsorted inputs are sorted to temporary files first" << std::endl;
   std::cout << "Note: this tool does not work with raysmooth or temporal translations." << std::endl;
   // clang-format on
   exit(exit_code);
 }
 
+const double time_eps = 1e-7;  // small enough to account for 200,000 rays per second,
+                               // but large enough to ignore file format/compression errors
+
+/// Find the rigid transformation from the triangle @c full_ps to the triangle @c dec_ps
+ray::Pose estimateTransform(Eigen::Vector3d full_ps[3], Eigen::Vector3d dec_ps[3])
+{
+  Eigen::Vector3d mid_full(0, 0, 0), mid_dec(0, 0, 0);
+  for (int i = 0; i < 3; i++)
+  {
+    mid_full += full_ps[i] / 3.0;
+    mid_dec += dec_ps[i] / 3.0;
+  }
+  for (int i = 1; i < 3; i++)
+  {
+    const double non_rigid_threshold = 0.01;
+    full_ps[i] -= full_ps[0];
+    dec_ps[i] -= dec_ps[0];
+    if (std::abs(full_ps[i].norm() - dec_ps[i].norm()) > non_rigid_threshold)
+    {
+      std::cout << "warning, matched points aren't a similar distance apart: " << full_ps[i].norm() << ", "
+                << dec_ps[i].norm() << " a non-rigid transform may have been applied. Results will be approximate."
+                << std::endl;
+    }
+  }
+
+  // how to get rotation from two triangles? do it in two stages:
+  const Eigen::Quaterniond quat = Eigen::Quaterniond::FromTwoVectors(full_ps[1], dec_ps[1]);
+  const Eigen::Vector3d normal1 = dec_ps[1].cross(dec_ps[2]);
+  const Eigen::Vector3d normal2 = full_ps[1].cross(full_ps[2]);
+  const Eigen::Quaterniond quat2 = Eigen::Quaterniond::FromTwoVectors(quat * normal2, normal1);
+  const Eigen::Quaterniond rotation = quat2 * quat;
+  const Eigen::Vector3d translation = mid_dec - rotation * mid_full;
+  ray::Pose transform;
+  transform.position = translation;
+  transform.rotation = rotation;
+
+  // set transformation to identity, if it is very close. This makes the typical case more accurate
+  const double rot_mag_sqr = ray::sqr(rotation.x()) + ray::sqr(rotation.y()) + ray::sqr(rotation.z());
+  const double rotation_changed_threshold = 1e-8;
+  const double translation_changed_threshold = 1e-8;
+  if (rot_mag_sqr > ray::sqr(rotation_changed_threshold) ||
+      translation.squaredNorm() > ray::sqr(translation_changed_threshold))
+  {
+    std::cout << "transformation detected" << std::endl;
+    std::cout << "translation: " << translation.transpose() << ", rotation quat: " << rotation.w() << ", "
+              << rotation.x() << ", " << rotation.y() << ", " << rotation.z() << std::endl;
+  }
+  else
+  {
+    std::cout << "no detected transformation of cloud" << std::endl;
+  }
+  return transform;
+}
+
+/// Pull-based reader of a ray cloud file, one ray at a time
+class RayStream
+{
+public:
+  bool open(const std::string &file_name)
+  {
+    file_name_ = file_name;
+    index_ = 0;
+    ends_.clear();
+    failed_ = false;
+    if (!ray::readRayCloudChunkStart(file_name, in_, layout_))
+      return false;
+    return fill();
+  }
+  bool valid() const { return index_ < ends_.size(); }
+  /// whether the stream ended on a read error rather than at the end of the file
+  bool failed() const { return failed_; }
+  const Eigen::Vector3d &start() const { return starts_[index_]; }
+  const Eigen::Vector3d &end() const { return ends_[index_]; }
+  double time() const { return times_[index_]; }
+  ray::RGBA colour() const { return colours_[index_]; }
+  void next()
+  {
+    if (++index_ == ends_.size())
+      fill();
+  }
+
+private:
+  bool fill()
+  {
+    const size_t chunk_size = 100000;
+    index_ = 0;
+    // a chunk can be empty when all of its rays are NaN
+    while (ray::readRayCloudChunk(in_, layout_, chunk_size, starts_, ends_, times_, colours_) && ends_.empty())
+      ;
+    // readRayCloudChunk also returns false on a read error, so only the end of the file is a successful end
+    if (ends_.empty() && (in_.bad() || !in_.eof()))
+    {
+      std::cerr << "Error: cannot read " << file_name_ << std::endl;
+      failed_ = true;
+    }
+    return !failed_;
+  }
+  std::string file_name_;
+  std::ifstream in_;
+  ray::PlyLayout layout_;
+  std::vector<Eigen::Vector3d> starts_, ends_;
+  std::vector<double> times_;
+  std::vector<ray::RGBA> colours_;
+  size_t index_;
+  bool failed_;
+};
+
+/// Merge-join the time-sorted decimation of the full cloud @c full_name with the time-sorted modified cloud
+/// @c decimated_name. Every ray of either cloud is passed to exactly one of the three callbacks
+bool joinByTime(const std::string &full_name, const std::string &decimated_name,
+                std::function<void(const RayStream &full, const RayStream &decimated)> matched,
+                std::function<void(const RayStream &full)> removed, std::function<void(const RayStream &decimated)> added,
+                size_t &num_full_coincident, size_t &num_decimated_coincident)
+{
+  RayStream full, decimated;
+  if (!full.open(full_name) || !decimated.open(decimated_name))
+    return false;
+  num_full_coincident = num_decimated_coincident = 0;
+  double last_full_time = std::numeric_limits<double>::lowest();
+  double last_decimated_time = std::numeric_limits<double>::lowest();
+  auto next_decimated = [&]() {
+    if (decimated.time() <= last_decimated_time)
+      num_decimated_coincident++;
+    last_decimated_time = decimated.time();
+    decimated.next();
+  };
+  for (; full.valid(); full.next())
+  {
+    if (full.time() <= last_full_time)
+      num_full_coincident++;
+    last_full_time = full.time();
+    // rays added into the decimated cloud
+    while (decimated.valid() && decimated.time() < full.time() - time_eps)
+    {
+      added(decimated);
+      next_decimated();
+    }
+    // matching points
+    if (decimated.valid() && std::abs(decimated.time() - full.time()) <= time_eps)
+    {
+      matched(full, decimated);
+      next_decimated();
+    }
+    // rays removed from the full decimated cloud
+    else
+    {
+      removed(full);
+    }
+  }
+  // finish adding the additional points
+  for (; decimated.valid(); next_decimated()) added(decimated);
+  return !full.failed() && !decimated.failed();
+}
+
+/// Streamed restore. The decimated representatives of the full cloud are spilled to a file, and it is joined with the
+/// modified cloud by time, so neither cloud is held in memory. Only the occupied voxels (for spatial decimation) or
+/// the removed ray times (for ray decimation) are kept.
+bool restoreStreamed(const ray::FileArgument &cloud_file, const ray::FileArgument &full_cloud_file,
+                     bool spatial_decimation, double voxel_width, int ray_step)
+{
+  const std::string temp_stub = full_cloud_file.nameStub() + "_restore";
+  const std::string full_decimated_name = temp_stub + "_full.ply";
+  std::vector<std::string> temp_names = { full_decimated_name };
+  auto remove_temp_files = [&]() {
+    for (const auto &name : temp_names) std::remove(name.c_str());
+  };
+
+  // decimate the full cloud into a file, noting whether it is time ordered
+  const size_t step = static_cast<size_t>(ray_step);
+  std::vector<int64_t> subsample;
+  ray::VoxelSet voxel_set;
+  ray::CloudWriter full_decimated_writer;
+  if (!full_decimated_writer.begin(full_decimated_name))
+    return false;
+  ray::Cloud chunk;
+  bool full_sorted = true;
+  double last_time = std::numeric_limits<double>::lowest();
+  auto add_representative = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                std::vector<double> &times, std::vector<ray::RGBA> &colours, size_t id) {
+    chunk.addRay(starts[id], ends[id], times[id], colours[id]);
+    full_sorted = full_sorted && times[id] >= last_time;
+    last_time = times[id];
+  };
+  auto decimate = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                      std::vector<double> &times, std::vector<ray::RGBA> &colours) {
+    chunk.clear();
+    if (spatial_decimation)
+    {
+      subsample.clear();
+      voxelSubsample(ends, voxel_width, subsample, voxel_set);
+      for (auto &id : subsample) add_representative(starts, ends, times, colours, static_cast<size_t>(id));
+    }
+    else
+    {
+      for (size_t i = 0; i < ends.size(); i += step) add_representative(starts, ends, times, colours, i);
+    }
+    full_decimated_writer.writeChunk(chunk);
+  };
+  const bool read_full = ray::Cloud::read(full_cloud_file.name(), decimate);
+  full_decimated_writer.end();
+  if (!read_full)
+  {
+    remove_temp_files();
+    return false;
+  }
+
+  // the modified cloud is read as a stream, so it must be a time-sorted ply file
+  bool decimated_sorted = true;
+  last_time = std::numeric_limits<double>::lowest();
+  auto check_sorted = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &, std::vector<double> &times,
+                          std::vector<ray::RGBA> &) {
+    for (auto &time : times)
+    {
+      decimated_sorted = decimated_sorted && time >= last_time;
+      last_time = time;
+    }
+  };
+  if (!ray::Cloud::read(cloud_file.name(), check_sorted))
+  {
+    remove_temp_files();
+    return false;
+  }
+  auto time_key = [](const Eigen::Vector3d &, const Eigen::Vector3d &, double time) { return ray::timeSortKey(time); };
+  std::string full_name = full_decimated_name;
+  std::string decimated_name = cloud_file.name();
+  if (!full_sorted)
+  {
+    std::cout << "sorting the decimated full cloud by time" << std::endl;
+    full_name = temp_stub + "_full_sorted.ply";
+    temp_names.push_back(full_name);
+    if (!ray::Cloud::sortFile(full_decimated_name, full_name, time_key))
+    {
+      remove_temp_files();
+      return false;
+    }
+  }
+  if (!decimated_sorted || cloud_file.nameExt() != "ply")
+  {
+    std::cout << "sorting the modified cloud by time" << std::endl;
+    decimated_name = temp_stub + "_decimated_sorted.ply";
+    temp_names.push_back(decimated_name);
+    if (!ray::Cloud::sortFile(cloud_file.name(), decimated_name, time_key))
+    {
+      remove_temp_files();
+      return false;
+    }
+  }
+
+  // Now find matching points by time. We assume that accurate time is a unique identifier per point
+  std::cout << "finding matching points" << std::endl;
+  const std::string added_name = temp_stub + "_added.ply";
+  temp_names.push_back(added_name);
+  ray::CloudWriter added_writer;
+  if (!added_writer.begin(added_name))
+  {
+    remove_temp_files();
+    return false;
+  }
+  chunk.clear();
+  size_t num_pairs = 0, num_removed = 0, num_added = 0;
+  std::vector<double> removed_times;  // in time order, used for ray decimation
+  auto count_pair = [&](const RayStream &, const RayStream &) { num_pairs++; };
+  auto remove_ray = [&](const RayStream &full) {
+    num_removed++;
+    if (spatial_decimation)
+      voxel_set.erase(ray::voxelIndex(full.end(), voxel_width));
+    else
+      removed_times.push_back(full.time());
+  };
+  auto add_ray = [&](const RayStream &decimated) {
+    chunk.addRay(decimated.start(), decimated.end(), decimated.time(), decimated.colour());
+    num_added++;
+    if (chunk.rayCount() == 100000)
+    {
+      added_writer.writeChunk(chunk);
+      chunk.clear();
+    }
+  };
+  size_t num_full_coincident, num_decimated_coincident;
+  const bool joined = joinByTime(full_name, decimated_name, count_pair, remove_ray, add_ray, num_full_coincident,
+                                 num_decimated_coincident);
+  added_writer.writeChunk(chunk);
+  added_writer.end();
+  if (!joined)
+  {
+    remove_temp_files();
+    return false;
+  }
+  if (num_decimated_coincident > 0)
+  {
+    std::cout << "WARNING: " << num_decimated_coincident
+              << " times are coincident in decimated cloud. Rayrestore requires unique time stamps" << std::endl;
+    std::cout << "results are unlikely to be valid" << std::endl;
+  }
+  if (num_full_coincident > 0)
+  {
+    std::cout << "WARNING: " << num_full_coincident
+              << " times are coincident in full cloud. Rayrestore requires unique time stamps" << std::endl;
+    std::cout << "results are unlikely to be valid" << std::endl;
+  }
+  std::cout << "number of matched pairs: " << num_pairs << ", number of removed rays: " << num_removed
+            << ", number added: " << num_added << std::endl;
+
+  // Now find the Euclidan transformation from three pairs at different time points. A second join retrieves them
+  std::cout << "looking for a Euclidean transformation" << std::endl;
+  ray::Pose transform;
+  transform.position.setZero();
+  transform.rotation = Eigen::Quaterniond::Identity();
+  // only estimate a transform if there are a sufficient number of pairs
+  if (num_pairs >= 6)
+  {
+    const size_t pair_ids[3] = { 0, num_pairs / 3, 2 * num_pairs / 3 };
+    Eigen::Vector3d full_ps[3];  // a triangle in the full decimated cloud
+    Eigen::Vector3d dec_ps[3];   // a triangle in the decimated cloud
+    size_t pair_index = 0;
+    auto pick_pair = [&](const RayStream &full, const RayStream &decimated) {
+      for (int i = 0; i < 3; i++)
+      {
+        if (pair_ids[i] == pair_index)
+        {
+          full_ps[i] = full.end();
+          dec_ps[i] = decimated.end();
+        }
+      }
+      pair_index++;
+    };
+    if (!joinByTime(full_name, decimated_name, pick_pair, [](const RayStream &) {}, [](const RayStream &) {},
+                    num_full_coincident, num_decimated_coincident))
+    {
+      remove_temp_files();
+      return false;
+    }
+    transform = estimateTransform(full_ps, dec_ps);
+  }
+
+  // now apply the estimated transformation, re-chunkloading the full cloud
+  ray::CloudWriter writer;
+  if (!writer.begin(full_cloud_file.nameStub() + "_restored.ply"))
+  {
+    remove_temp_files();
+    return false;
+  }
+  auto is_removed = [&](double time) {
+    auto it = std::lower_bound(removed_times.begin(), removed_times.end(), time - time_eps);
+    return it != removed_times.end() && *it <= time + time_eps;
+  };
+  auto transfer = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                      std::vector<double> &times, std::vector<ray::RGBA> &colours) {
+    chunk.clear();
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+      bool keep;
+      if (spatial_decimation)
+      {
+        keep = voxel_set.contains(ray::voxelIndex(ends[i], voxel_width));
+      }
+      else
+      {
+        // each ray follows the closest representative within its chunk
+        const size_t num_representatives = (ends.size() + step - 1) / step;
+        const size_t closest_index = std::min((i + step / 2) / step, num_representatives - 1);
+        keep = !is_removed(times[closest_index * step]);
+      }
+      if (keep)
+        chunk.addRay(transform * starts[i], transform * ends[i], times[i], colours[i]);
+    }
+    writer.writeChunk(chunk);
+  };
+  bool success = ray::Cloud::read(full_cloud_file.name(), transfer);
+
+  std::cout << "added " << num_added << " extra points that are in the modified cloud" << std::endl;
+  auto append = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                    std::vector<double> &times, std::vector<ray::RGBA> &colours) {
+    writer.writeChunk(starts, ends, times, colours);
+  };
+  if (success && num_added > 0)
+    success = ray::Cloud::read(added_name, append);
+  writer.end();
+  remove_temp_files();
+  return success;
+}
+
 int rayRestore(int argc, char *argv[])
 {
   ray::FileArgument cloud_file, full_cloud_file;
   ray::DoubleArgument vox_width(0.1, 100.0);
   ray::IntArgument num_rays(1, 100);
   ray::ValueKeyChoice quantity({ &vox_width, &num_rays }, { "cm", "rays" });
-  if (!ray::parseCommandLine(argc, argv, { &cloud_file, &quantity, &full_cloud_file }))
+  ray::OptionalFlagArgument stream("stream", 's');
+  if (!ray::parseCommandLine(argc, argv, { &cloud_file, &quantity, &full_cloud_file }, { &stream }))
     usage();
   const bool spatial_decimation = quantity.selectedKey() == "cm";
   const double voxel_width = 0.01 * vox_width.value();
   const int ray_step = num_rays.value();
 
+  if (stream.isSet())
+  {
+    if (!restoreStreamed(cloud_file, full_cloud_file, spatial_decimation, voxel_width, ray_step))
+      usage();
+    return 0;
+  }
+
   // This function uses chunk loading to avoid the full resolution cloud being in memory
 
   // Firstly, load the decimated cloud. We assume that this can fit in RAM
@@ -45,7 +442,7 @@ int rayRestore(int argc, char *argv[])
 
   ray::Cloud full_decimated;       // we need a decimated version of the full cloud, to compare to
   std::vector<int64_t> subsample;  // single buffer minimises memory allocations
-  std::set<Eigen::Vector3i, ray::Vector3iLess> voxel_set;
+  ray::VoxelSet voxel_set;
   full_decimated.reserve(decimated_cloud.ends.size());  // good guess at memory required
 
   // decimation functions
@@ -127,8 +524,6 @@ int rayRestore(int argc, char *argv[])
   std::vector<size_t> added_ray_indices;  // new rays added to the decimated_cloud
   added_ray_indices.reserve(decimated_cloud.ends.size());
   int j = 0;
-  const double time_eps = 1e-7;  // small enough to account for 200,000 rays per second,
-                                 // but large enough to ignore file format/compression errors
   int num_removed_rays = 0;
   for (size_t i = 0; i < full_decimated_nodes.size(); i++)
   {
@@ -149,10 +544,7 @@ int rayRestore(int argc, char *argv[])
     {
       if (spatial_decimation)
       {
-        Eigen::Vector3d ps = full_decimated.ends[full_decimated_nodes[i].index];
-        Eigen::Vector3i place(int(std::floor(ps[0] / voxel_width)), int(std::floor(ps[1] / voxel_width)),
-                              int(std::floor(ps[2] / voxel_width)));
-        voxel_set.erase(place);
+        voxel_set.erase(ray::voxelIndex(full_decimated.ends[full_decimated_nodes[i].index], voxel_width));
       }
       num_removed_rays++;
     }
@@ -181,52 +573,12 @@ int rayRestore(int argc, char *argv[])
     const int js[3] = { pairs[0][1], pairs[pairs.size() / 3][1], pairs[2 * pairs.size() / 3][1] };
     Eigen::Vector3d full_ps[3];  // a triangle in the full_decimated cloud
     Eigen::Vector3d dec_ps[3];   // a triangle in the decimated_cloud
-    Eigen::Vector3d mid_full(0, 0, 0), mid_dec(0, 0, 0);
     for (int i = 0; i < 3; i++)
     {
       full_ps[i] = full_decimated.ends[is[i]];
       dec_ps[i] = decimated_cloud.ends[js[i]];
-      mid_full += full_ps[i] / 3.0;
-      mid_dec += dec_ps[i] / 3.0;
-    }
-    for (int i = 1; i < 3; i++)
-    {
-      const double non_rigid_threshold = 0.01;
-      full_ps[i] -= full_ps[0];
-      dec_ps[i] -= dec_ps[0];
-      if (std::abs(full_ps[i].norm() - dec_ps[i].norm()) > non_rigid_threshold)
-      {
-        std::cout << "warning, matched points aren't a similar distance apart: " << full_ps[i].norm() << ", "
-                  << dec_ps[i].norm() << " a non-rigid transform may have been applied. Results will be approximate."
-                  << std::endl;
-      }
-    }
-
-    // how to get rotation from two triangles? do it in two stages:
-    const Eigen::Quaterniond quat = Eigen::Quaterniond::FromTwoVectors(full_ps[1], dec_ps[1]);
-    const Eigen::Vector3d normal1 = dec_ps[1].cross(dec_ps[2]);
-    const Eigen::Vector3d normal2 = full_ps[1].cross(full_ps[2]);
-    const Eigen::Quaterniond quat2 = Eigen::Quaterniond::FromTwoVectors(quat * normal2, normal1);
-    const Eigen::Quaterniond rotation = quat2 * quat;
-    const Eigen::Vector3d translation = mid_dec - rotation * mid_full;
-    transform.position = translation;
-    transform.rotation = rotation;
-
-    // set transformation to identity, if it is very close. This makes the typical case more accurate
-    const double rot_mag_sqr = ray::sqr(rotation.x()) + ray::sqr(rotation.y()) + ray::sqr(rotation.z());
-    const double rotation_changed_threshold = 1e-8;
-    const double translation_changed_threshold = 1e-8;
-    if (rot_mag_sqr > ray::sqr(rotation_changed_threshold) ||
-        translation.squaredNorm() > ray::sqr(translation_changed_threshold))
-    {
-      std::cout << "transformation detected" << std::endl;
-      std::cout << "translation: " << translation.transpose() << ", rotation quat: " << rotation.w() << ", "
-                << rotation.x() << ", " << rotation.y() << ", " << rotation.z() << std::endl;
-    }
-    else
-    {
-      std::cout << "no detected transformation of cloud" << std::endl;
     }
+    transform = estimateTransform(full_ps, dec_ps);
   }
 
   // now apply the estimated transformation. We need to chunk save the _restored file, using the
@@ -243,9 +595,7 @@ int rayRestore(int argc, char *argv[])
     {
       for (size_t i = 0; i < ends.size(); i++)
       {
-        Eigen::Vector3i place(int(std::floor(ends[i][0] / voxel_width)), int(std::floor(ends[i][1] / voxel_width)),
-                              int(std::floor(ends[i][2] / voxel_width)));
-        if (voxel_set.find(place) != voxel_set.end())
+        if (voxel_set.contains(ray::voxelIndex(ends[i], voxel_width)))
           chunk.addRay(transform * starts[i], transform * ends[i], times[i], colours[i]);
       }
     }
@@ -4,9 +4,9 @@
 //
 // Author: Thomas Lowe
 #include "raylib/raycloud.h"
+#include "raylib/raycloudwriter.h"
 #include "raylib/rayparse.h"
-
-#include <nabo/nabo.h>
+#include "raylib/raytiledcloud.h"
 
 #include <cstdio>
 #include <cstdlib>
@@ -19,53 +19,109 @@ void usage(int exit_code = 1)
   std::cout << "Smooth a ray cloud. Nearby off-surface points are moved onto the nearest surface." << std::endl;
   std::cout << "usage:" << std::endl;
   std::cout << "raysmooth raycloud" << std::endl;
+  std::cout << "                   --neighbours 16  - number of neighbouring points that define the local surface" << std::endl;
+  std::cout << "                   --tile_width 100 - the cloud is smoothed in tiles of this width (m), to bound memory use" << std::endl;
+  std::cout << "                   --halo 1         - neighbouring points are gathered from this distance (m) around each tile" << std::endl;
   // clang-format on
   exit(exit_code);
 }
 
-int raySmooth(int argc, char *argv[])
+/// Smooth the owned rays of a single tile, giving the new end point of each owned ray in @c smoothed_ends
+void smoothTile(const ray::CloudTile &tile, int num_neighbours, std::vector<uint64_t> &ids,
+                std::vector<Eigen::Vector3d> &smoothed_ends)
 {
-  ray::FileArgument cloud_file;
-  if (!ray::parseCommandLine(argc, argv, { &cloud_file }))
-    usage();
-
-  ray::Cloud cloud;
-  if (!cloud.load(cloud_file.name()))
-    usage();
-
   // Method:
   // 1. generate normals and neighbour indices
   // 2. pull point along normal direction so as to match neighbours, weighted by normal similarity
-
-  const int num_neighbours = 16;
+  const ray::Cloud &cloud = tile.cloud;
   std::vector<Eigen::Vector3d> normals;
   Eigen::MatrixXi neighbour_indices;
   cloud.getSurfels(num_neighbours, nullptr, &normals, nullptr, nullptr, &neighbour_indices);
 
-  std::vector<Eigen::Vector3d> centroids(cloud.ends.size());
-  for (size_t i = 0; i < cloud.ends.size(); i++)
+  std::vector<Eigen::Vector3d> ends(cloud.ends.size());
+  const int count = static_cast<int>(cloud.ends.size());
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < count; i++)
   {
-    if (!cloud.rayBounded(i))
+    if (!cloud.rayBounded(i) || !tile.owned[i])
       continue;
     double total_weight = 0.2;  // more averaging if it uses less of the central position, but 0 risks a divide by 0
     Eigen::Vector3d weighted_sum = cloud.ends[i] * total_weight;
-    for (int j = 0; j < num_neighbours && neighbour_indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
+    // unused neighbour slots are negative, including those of rejected back-facing neighbours
+    for (int j = 0; j < num_neighbours && neighbour_indices(j, i) >= 0; j++)
     {
       int k = neighbour_indices(j, i);
       double weight = std::max(0.0, 1.0 - (normals[k] - normals[i]).squaredNorm());
       weighted_sum += cloud.ends[k] * weight;
       total_weight += weight;
     }
-    centroids[i] = weighted_sum / total_weight;
+    const Eigen::Vector3d centroid = weighted_sum / total_weight;
+    ends[i] = cloud.ends[i] + normals[i] * (centroid - cloud.ends[i]).dot(normals[i]);
   }
+
+  ids.clear();
+  smoothed_ends.clear();
   for (size_t i = 0; i < cloud.ends.size(); i++)
   {
-    if (!cloud.rayBounded(i))
-      continue;
-    cloud.ends[i] += normals[i] * (centroids[i] - cloud.ends[i]).dot(normals[i]);
+    if (tile.owned[i])
+    {
+      ids.push_back(tile.ids[i]);
+      smoothed_ends.push_back(ends[i]);
+    }
   }
+}
 
-  cloud.save(cloud_file.nameStub() + "_smooth.ply");
+int raySmooth(int argc, char *argv[])
+{
+  ray::FileArgument cloud_file;
+  ray::IntArgument neighbours(2, 200, 16);
+  ray::DoubleArgument tile_width(0.01, 100000.0, 100.0), halo(0.0, 1000.0, 1.0);
+  ray::OptionalKeyValueArgument neighbours_option("neighbours", 'n', &neighbours);
+  ray::OptionalKeyValueArgument tile_width_option("tile_width", 't', &tile_width);
+  ray::OptionalKeyValueArgument halo_option("halo", 'h', &halo);
+  if (!ray::parseCommandLine(argc, argv, { &cloud_file }, { &neighbours_option, &tile_width_option, &halo_option }))
+    usage();
+
+  // Bin the cloud into halo-padded tiles, so that each tile can be smoothed independently in bounded memory
+  ray::TiledCloud tiles(tile_width.value(), halo.value());
+  if (!tiles.load(cloud_file.name(), cloud_file.nameStub()))
+    usage();
+
+  // the smoothed end points are stored per ray, so they can be written back in the original ray order
+  ray::RayValueFile<Eigen::Vector3d> smoothed;
+  if (!smoothed.open(cloud_file.nameStub() + "_smooth_ends.tmp", tiles.rayCount()))
+    usage();
+  std::vector<uint64_t> ids;
+  std::vector<Eigen::Vector3d> smoothed_ends;
+  bool values_ok = true;
+  auto smooth = [&](ray::CloudTile &tile) {
+    smoothTile(tile, neighbours.value(), ids, smoothed_ends);
+    values_ok = values_ok && smoothed.write(ids, smoothed_ends);
+  };
+  if (!tiles.forEachTile(smooth) || !values_ok)
+    usage();
+
+  ray::CloudWriter writer;
+  if (!writer.begin(cloud_file.nameStub() + "_smooth.ply"))
+    usage();
+  auto apply_smoothing = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                             std::vector<double> &times, std::vector<ray::RGBA> &colours) {
+    if (!smoothed.read(ends.size(), smoothed_ends))
+    {
+      values_ok = false;
+      return;
+    }
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+      if (colours[i].alpha > 0)
+        ends[i] = smoothed_ends[i];
+    }
+    writer.writeChunk(starts, ends, times, colours);
+  };
+  if (!ray::Cloud::read(cloud_file.name(), apply_smoothing) || !values_ok)
+    usage();
+  writer.end();
+  smoothed.close();
 
   return 0;
 }
@@ -73,4 +129,4 @@ int raySmooth(int argc, char *argv[])
 int main(int argc, char *argv[])
 {
   return ray::runWithMemoryCheck(raySmooth, argc, argv);
-}
\ No newline at end of file
+}
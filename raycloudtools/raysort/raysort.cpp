@@ -0,0 +1,77 @@
+// Copyright (c) 2026
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raylib/raycloud.h"
+#include "raylib/rayparse.h"
+#include "raylib/rayply.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+
+void usage(int exit_code = 1)
+{
+  // clang-format off
+  std::cout << "Sort the rays of a ray cloud, in bounded memory" << std::endl;
+  std::cout << "usage:" << std::endl;
+  std::cout << "raysort raycloud time   - sort the rays by time, into raycloud_sorted.ply" << std::endl;
+  std::cout << "raysort raycloud morton - sort the rays spatially, by the Morton (Z-order) code of their end points." << std::endl;
+  std::cout << "                          This places nearby rays together in the file, for faster chunked processing" << std::endl;
+  std::cout << "          --max_memory 8 - limit memory use to approximately this many GB. Larger clouds are sorted in" << std::endl;
+  std::cout << "                           runs that are spilled to temporary files, then merged" << std::endl;
+  // clang-format on
+  exit(exit_code);
+}
+
+/// Sort the cloud within the memory limit, by time or by the Morton code of the ray end points
+bool sortCloud(const ray::FileArgument &cloud_file, bool spatial, double max_memory_gb)
+{
+  ray::Cloud::Info info;
+  if (!ray::Cloud::getInfo(cloud_file.name(), info))
+    return false;
+  // Morton codes are over the bound of the cloud, at 21 bits per axis
+  const Eigen::Vector3d min_bound = info.rays_bound.min_bound_;
+  const double extent = (info.rays_bound.max_bound_ - min_bound).maxCoeff();
+  const double cell_width = std::max(extent, 1e-10) / double((1 << 21) - 1);
+  std::function<uint64_t(const Eigen::Vector3d &, const Eigen::Vector3d &, double)> key;
+  if (spatial)
+  {
+    key = [&](const Eigen::Vector3d &, const Eigen::Vector3d &end, double) {
+      const Eigen::Vector3d index = ((end - min_bound) / cell_width).array().max(0.0).min(double((1 << 21) - 1));
+      return ray::mortonCode(index.cast<int>());
+    };
+  }
+  else
+  {
+    key = [](const Eigen::Vector3d &, const Eigen::Vector3d &, double time) { return ray::timeSortKey(time); };
+  }
+
+  // approximate memory per ray, for the run and its sorted copy
+  const double bytes_per_ray = 160.0;
+  const size_t max_run_rays = static_cast<size_t>(max_memory_gb * 1e9 / bytes_per_ray);
+  return ray::Cloud::sortFile(cloud_file.name(), cloud_file.nameStub() + "_sorted.ply", key, max_run_rays);
+}
+
+// Sorts the rays of a ray cloud by time or spatially
+int raySort(int argc, char *argv[])
+{
+  ray::FileArgument cloud_file;
+  ray::KeyChoice sort_type({ "time", "morton" });
+  ray::DoubleArgument max_memory(0.0001, 100000.0, 8.0);
+  ray::OptionalKeyValueArgument max_memory_option("max_memory", 'm', &max_memory);
+  if (!ray::parseCommandLine(argc, argv, { &cloud_file, &sort_type }, { &max_memory_option }))
+    usage();
+
+  if (!sortCloud(cloud_file, sort_type.selectedKey() == "morton", max_memory.value()))
+    usage();
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  return ray::runWithMemoryCheck(raySort, argc, argv);
+}
@@ -22,10 +22,11 @@ void usage(int exit_code = 1)
   std::cout << "Split a ray cloud relative to the supplied triangle mesh, generating two cropped ray clouds" << std::endl;
   std::cout << "usage:" << std::endl;
   std::cout << "raysplit raycloud plane 10,0,0           - splits around plane at 10 m along x axis" << std::endl;
-  std::cout << "                  colour                 - splits by colour, one cloud per colour" << std::endl;
+  std::cout << "                  colour                 - splits by colour, one cloud per colour, up to 5000 colours" << std::endl;
   std::cout << "                  colour 0.5,0,0         - splits by colour, around half red component" << std::endl;
   std::cout << "                  single_colour 255,0,0  - splits out a single colour, in 0-255 units" << std::endl;
-  std::cout << "                  seg_colour             - splits to one cloud per colour, converting _segmented.ply colours to their index suffix" << std::endl;
+  std::cout << "                  seg_colour             - splits to one cloud per colour, converting _segmented.ply colours to their index suffix." << std::endl;
+  std::cout << "                                           Up to 1,000,000 colours, so large segmented forests can be split" << std::endl;
   std::cout << "                  alpha 0.0              - splits out unbounded rays, which have zero intensity" << std::endl;
   std::cout << "                  file distance 0.2      - splits raycloud at 0.2m from the (ply mesh or trees) file surface" << std::endl;
   std::cout << "                  raydir 0,0,0.8         - splits based on ray direction, here around nearly vertical rays" << std::endl;
@@ -105,16 +106,10 @@ int raySplit(int argc, char *argv[])
     else if (mesh_file.nameExt() == "txt") // assume a tree file
     {
       ray::ForestStructure forest;
-      forest.load(mesh_file.name());
-      ray::Cloud cloud;  // because forest splitCloud currently not chunk loaded
-      if (!cloud.load(rc_name))
+      if (!forest.load(mesh_file.name()) || !forest.splitCloud(rc_name, mesh_offset.value(), in_name, out_name))
       {
         usage();
       }
-      ray::Cloud inside, outside;
-      forest.splitCloud(cloud, mesh_offset.value(), inside, outside);
-      inside.save(in_name);
-      outside.save(out_name);
     }
   }
   else if (time_percent)
@@ -137,8 +132,8 @@ int raySplit(int argc, char *argv[])
 
     // now split based on this
     const double time_thresh = min_time + (max_time - min_time) * time.value() / 100.0;
-    res = ray::split(rc_name, in_name, out_name,
-                     [&](const ray::Cloud &cloud, int i) -> bool { return cloud.times[i] > time_thresh; });
+    res = ray::splitIf(rc_name, in_name, out_name,
+                       [&](const ray::Cloud &cloud, int i) -> bool { return cloud.times[i] > time_thresh; });
   }
   else if (box_format)
   {
@@ -170,14 +165,14 @@ int raySplit(int argc, char *argv[])
     const std::string &parameter = choice.selectedKey();
     if (parameter == "time")
     {
-      res = ray::split(rc_name, in_name, out_name,
-                       [&](const ray::Cloud &cloud, int i) -> bool { return cloud.times[i] > time.value(); });
+      res = ray::splitIf(rc_name, in_name, out_name,
+                         [&](const ray::Cloud &cloud, int i) -> bool { return cloud.times[i] > time.value(); });
     }
     else if (parameter == "alpha")
     {
       uint8_t c = uint8_t(255.0 * alpha.value());
-      res = ray::split(rc_name, in_name, out_name,
-                       [&](const ray::Cloud &cloud, int i) -> bool { return cloud.colours[i].alpha > c; });
+      res = ray::splitIf(rc_name, in_name, out_name,
+                         [&](const ray::Cloud &cloud, int i) -> bool { return cloud.colours[i].alpha > c; });
     }
     else if (parameter == "plane")
     {
@@ -186,7 +181,7 @@ int raySplit(int argc, char *argv[])
     else if (parameter == "raydir")
     {
       Eigen::Vector3d vec = raydir.value() / raydir.value().squaredNorm();
-      res = ray::split(rc_name, in_name, out_name, [&](const ray::Cloud &cloud, int i) -> bool {
+      res = ray::splitIf(rc_name, in_name, out_name, [&](const ray::Cloud &cloud, int i) -> bool {
         Eigen::Vector3d ray_dir = (cloud.ends[i] - cloud.starts[i]).normalized();
         return ray_dir.dot(vec) > 1.0;
       });
@@ -194,7 +189,7 @@ int raySplit(int argc, char *argv[])
     else if (parameter == "colour")
     {
       Eigen::Vector3d vec = colour.value() / colour.value().squaredNorm();
-      res = ray::split(rc_name, in_name, out_name, [&](const ray::Cloud &cloud, int i) -> bool {
+      res = ray::splitIf(rc_name, in_name, out_name, [&](const ray::Cloud &cloud, int i) -> bool {
         Eigen::Vector3d col((double)cloud.colours[i].red / 255.0, (double)cloud.colours[i].green / 255.0,
                             (double)cloud.colours[i].blue / 255.0);
         return col.dot(vec) > 1.0;
@@ -206,14 +201,14 @@ int raySplit(int argc, char *argv[])
       col.red = (uint8_t)single_colour.value()[0];
       col.green = (uint8_t)single_colour.value()[1];
       col.blue = (uint8_t)single_colour.value()[2];
-      res = ray::split(rc_name, in_name, out_name, [&](const ray::Cloud &cloud, int i) -> bool {
+      res = ray::splitIf(rc_name, in_name, out_name, [&](const ray::Cloud &cloud, int i) -> bool {
         return !(cloud.colours[i].red == col.red && cloud.colours[i].green == col.green &&
                  cloud.colours[i].blue == col.blue);
       });
     }
     else if (parameter == "range")
     {
-      res = ray::split(rc_name, in_name, out_name, [&](const ray::Cloud &cloud, int i) -> bool {
+      res = ray::splitIf(rc_name, in_name, out_name, [&](const ray::Cloud &cloud, int i) -> bool {
         return (cloud.starts[i] - cloud.ends[i]).norm() > range.value();
       });
     }
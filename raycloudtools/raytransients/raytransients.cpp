@@ -4,6 +4,7 @@
 //
 // Author: Thomas Lowe
 #include "raylib/raycloud.h"
+#include "raylib/raycloudwriter.h"
 #include "raylib/raymerger.h"
 #include "raylib/raymesh.h"
 #include "raylib/rayparse.h"
@@ -11,12 +12,14 @@
 #include "raylib/rayprogress.h"
 #include "raylib/rayprogressthread.h"
 #include "raylib/raythreads.h"
+#include "raylib/raytiledcloud.h"
 
 #include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <limits>
 #include <thread>
 
 void usage(int exit_code = 1)
@@ -30,10 +33,249 @@ void usage(int exit_code = 1)
   std::cout << "              oldest - keeps the oldest geometry when there is a difference over time." << std::endl;
   std::cout << "              newest - uses the newest geometry when there is a difference over time." << std::endl;
   std::cout << " --colour     - also colours the clouds, to help tweak numRays. blue: opacity, green: pass throughs." << std::endl;
+  std::cout << " --tile_width 50 - filter in tiles of this width (m), to bound memory use on large clouds" << std::endl;
+  std::cout << " --halo 2        - rays are gathered from this distance (m) around each tile. It should exceed the" << std::endl;
+  std::cout << "                   point neighbourhood size and the ray grid voxel size, for the same result as untiled" << std::endl;
+  std::cout << " --window 60     - filter a time-sorted cloud in windows of this many seconds, so that transients are only" << std::endl;
+  std::cout << "                   relative to nearby times and memory use is bounded by the window length" << std::endl;
+  std::cout << " --overlap 10    - each window also sees the rays within this many seconds before and after it" << std::endl;
   // clang-format on
   exit(exit_code);
 }
 
+/// Filter the transients one tile at a time, so that memory use is bounded by the tile size rather than the cloud
+/// size. Each tile is filtered with the rays ending in its halo and the rays passing through it. The transient marks
+/// of all tiles are combined per ray, then the cloud is split in its original ray order.
+bool transientsInTiles(const ray::FileArgument &cloud_file, ray::MergerConfig config, double tile_width, double halo)
+{
+  ray::Cloud::Info info;
+  if (!ray::Cloud::getInfo(cloud_file.name(), info))
+    return false;
+  // estimate the voxel size once for the whole cloud, as the untiled filter does, so all tiles share one ray grid
+  if (config.voxel_size <= 0.0 && info.num_bounded > 0)
+  {
+    config.voxel_size = 4.0 * ray::Cloud::estimatePointSpacing(cloud_file.name(), info.ends_bound, info.num_bounded);
+  }
+
+  ray::Merger filter(config);
+  // The untiled filter grids the rays from the lower bound of the cloud's ellipsoids. That bound needs the ellipsoids
+  // of every tile, so it takes a first pass over the tiles, after which all tiles are gridded on the same lattice
+  const double max_double = std::numeric_limits<double>::max();
+  Eigen::Vector3d grid_origin(max_double, max_double, max_double);
+  {
+    ray::TiledCloud tiles(tile_width, halo);
+    if (!tiles.load(cloud_file.name(), cloud_file.nameStub(), true, true))
+      return false;
+    auto bound_tile = [&](ray::CloudTile &tile) {
+      grid_origin = ray::minVector(grid_origin, filter.tileGridOrigin(tile.cloud, tile.owned));
+    };
+    if (!tiles.forEachTile(bound_tile))
+      return false;
+  }
+
+  ray::TiledCloud tiles(tile_width, halo);
+  if (!tiles.load(cloud_file.name(), cloud_file.nameStub(), true, true))
+    return false;
+
+  // rays can be marked transient by the tile they pass through, so the marks are kept for the whole cloud, as bits
+  std::vector<bool> transient(tiles.rayCount(), false);
+  ray::RayValueFile<ray::RGBA> filter_colours;
+  if (config.colour_cloud && !filter_colours.open(cloud_file.nameStub() + "_transient_colours.tmp", tiles.rayCount()))
+    return false;
+
+  std::vector<uint8_t> marks;
+  std::vector<ray::RGBA> colours, owned_colours;
+  std::vector<uint64_t> owned_ids;
+  bool values_ok = true;
+  auto filter_tile = [&](ray::CloudTile &tile) {
+    filter.filterTile(tile.cloud, tile.owned, marks, colours, &grid_origin);
+    owned_ids.clear();
+    owned_colours.clear();
+    for (size_t i = 0; i < marks.size(); i++)
+    {
+      if (marks[i])
+        transient[tile.ids[i]] = true;
+      if (tile.owned[i])
+      {
+        owned_ids.push_back(tile.ids[i]);
+        owned_colours.push_back(colours[i]);
+      }
+    }
+    if (config.colour_cloud)
+      values_ok = values_ok && filter_colours.write(owned_ids, owned_colours);
+  };
+  if (!tiles.forEachTile(filter_tile) || !values_ok)
+    return false;
+
+  ray::CloudWriter transient_writer, fixed_writer;
+  if (!transient_writer.begin(cloud_file.nameStub() + "_transient.ply") ||
+      !fixed_writer.begin(cloud_file.nameStub() + "_fixed.ply"))
+    return false;
+  ray::Cloud transient_chunk, fixed_chunk;
+  size_t id = 0;
+  auto split_rays = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                        std::vector<double> &times, std::vector<ray::RGBA> &ray_colours) {
+    if (config.colour_cloud && !filter_colours.read(ends.size(), colours))
+    {
+      values_ok = false;
+      return;
+    }
+    transient_chunk.clear();
+    fixed_chunk.clear();
+    for (size_t i = 0; i < ends.size(); i++, id++)
+    {
+      ray::Cloud &chunk = transient[id] ? transient_chunk : fixed_chunk;
+      chunk.addRay(starts[i], ends[i], times[i], config.colour_cloud ? colours[i] : ray_colours[i]);
+    }
+    transient_writer.writeChunk(transient_chunk);
+    fixed_writer.writeChunk(fixed_chunk);
+  };
+  if (!ray::Cloud::read(cloud_file.name(), split_rays) || !values_ok)
+    return false;
+  transient_writer.end();
+  fixed_writer.end();
+  return true;
+}
+
+/// Filter the transients of a time-sorted cloud in a sliding window of @c window seconds, each seeing @c overlap seconds
+/// of rays either side of it. Rays are written out as soon as no later window can mark them, so memory use is
+/// proportional to the window length rather than the scan length.
+bool transientsInTimeWindows(const ray::FileArgument &cloud_file, ray::MergerConfig config, double window,
+                             double overlap)
+{
+  ray::Cloud::Info info;
+  if (!ray::Cloud::getInfo(cloud_file.name(), info))
+    return false;
+  // one voxel size for the whole scan, so that the windows share a ray grid
+  if (config.voxel_size <= 0.0 && info.num_bounded > 0)
+  {
+    config.voxel_size = 4.0 * ray::Cloud::estimatePointSpacing(cloud_file.name(), info.ends_bound, info.num_bounded);
+  }
+
+  ray::CloudWriter transient_writer, fixed_writer;
+  if (!transient_writer.begin(cloud_file.nameStub() + "_transient.ply") ||
+      !fixed_writer.begin(cloud_file.nameStub() + "_fixed.ply"))
+    return false;
+
+  // the buffered rays, starting at the earliest ray that can still be marked by a window
+  ray::Cloud buffer;
+  std::vector<uint8_t> buffer_marks;
+  std::vector<ray::RGBA> buffer_colours;
+  size_t num_processed = 0;  // the number of buffered rays that have been filtered as part of their own window
+  double window_start = std::numeric_limits<double>::lowest();
+
+  ray::Merger filter(config);
+  ray::Cloud window_cloud, transient_chunk, fixed_chunk;
+  std::vector<uint8_t> owned, marks;
+  std::vector<ray::RGBA> colours;
+
+  // filter the window starting at window_start, then write out the rays that no later window covers
+  auto process_window = [&](bool last_window) {
+    const double window_end = window_start + window;
+    size_t num_rays = buffer.rayCount();
+    if (!last_window)
+    {
+      num_rays = std::lower_bound(buffer.times.begin(), buffer.times.end(), window_end + overlap) - buffer.times.begin();
+    }
+    window_cloud.clear();
+    owned.clear();
+    bool any_owned = false;
+    for (size_t i = 0; i < num_rays; i++)
+    {
+      window_cloud.addRay(buffer, i);
+      owned.push_back(buffer.times[i] >= window_start && buffer.times[i] < window_end);
+      any_owned |= owned.back() != 0;
+    }
+    if (any_owned)
+    {
+      filter.filterTile(window_cloud, owned, marks, colours);
+      for (size_t i = 0; i < num_rays; i++)
+      {
+        buffer_marks[i] |= marks[i];
+        if (owned[i])
+        {
+          buffer_colours[i] = colours[i];
+          num_processed = i + 1;
+        }
+      }
+    }
+
+    // the next window sees rays from window_end - overlap onwards, so the rays before that are final
+    size_t num_final = buffer.rayCount();
+    if (!last_window)
+    {
+      num_final = std::lower_bound(buffer.times.begin(), buffer.times.end(), window_end - overlap) - buffer.times.begin();
+      num_final = std::min(num_final, num_processed);
+    }
+    transient_chunk.clear();
+    fixed_chunk.clear();
+    for (size_t i = 0; i < num_final; i++)
+    {
+      ray::Cloud &chunk = buffer_marks[i] ? transient_chunk : fixed_chunk;
+      chunk.addRay(buffer.starts[i], buffer.ends[i], buffer.times[i],
+                   config.colour_cloud ? buffer_colours[i] : buffer.colours[i]);
+    }
+    transient_writer.writeChunk(transient_chunk);
+    fixed_writer.writeChunk(fixed_chunk);
+    buffer.starts.erase(buffer.starts.begin(), buffer.starts.begin() + num_final);
+    buffer.ends.erase(buffer.ends.begin(), buffer.ends.begin() + num_final);
+    buffer.times.erase(buffer.times.begin(), buffer.times.begin() + num_final);
+    buffer.colours.erase(buffer.colours.begin(), buffer.colours.begin() + num_final);
+    buffer_marks.erase(buffer_marks.begin(), buffer_marks.begin() + num_final);
+    buffer_colours.erase(buffer_colours.begin(), buffer_colours.begin() + num_final);
+    num_processed -= num_final;
+
+    // the next window starts at the next unprocessed ray, skipping any empty windows
+    window_start = window_end;
+    if (num_processed < buffer.rayCount() && buffer.times[num_processed] >= window_start + window)
+    {
+      window_start += window * std::floor((buffer.times[num_processed] - window_start) / window);
+    }
+  };
+
+  bool sorted = true;
+  auto add_rays = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                      std::vector<double> &times, std::vector<ray::RGBA> &ray_colours) {
+    for (size_t i = 0; i < ends.size() && sorted; i++)
+    {
+      if (buffer.rayCount() > 0 && times[i] < buffer.times.back())
+      {
+        std::cerr << "Error: the --window option requires a cloud that is sorted by time" << std::endl;
+        sorted = false;
+        return;
+      }
+      if (window_start == std::numeric_limits<double>::lowest())
+      {
+        window_start = times[i];
+      }
+      buffer.addRay(starts[i], ends[i], times[i], ray_colours[i]);
+      buffer_marks.push_back(0);
+      buffer_colours.push_back(ray_colours[i]);
+      // a window is complete once a ray beyond its overlap has arrived
+      while (buffer.times.back() >= window_start + window + overlap)
+      {
+        process_window(false);
+      }
+    }
+  };
+  if (!ray::Cloud::read(cloud_file.name(), add_rays) || !sorted)
+  {
+    // don't leave a partial result behind
+    transient_writer.end();
+    fixed_writer.end();
+    std::remove(transient_writer.fileName().c_str());
+    std::remove(fixed_writer.fileName().c_str());
+    return false;
+  }
+  while (buffer.rayCount() > 0)
+  {
+    process_window(num_processed == buffer.rayCount() || buffer.times.back() < window_start + window);
+  }
+  transient_writer.end();
+  fixed_writer.end();
+  return true;
+}
+
 int rayTransients(int argc, char *argv[])
 {
   ray::KeyChoice merge_type({ "min", "max", "oldest", "newest" });
@@ -41,12 +283,20 @@ int rayTransients(int argc, char *argv[])
   ray::DoubleArgument num_rays(0.1, 100.0);
   ray::TextArgument text("rays");
   ray::OptionalFlagArgument colour("colour", 'c');
-  if (!ray::parseCommandLine(argc, argv, { &merge_type, &cloud_file, &num_rays, &text }, { &colour }))
+  ray::DoubleArgument tile_width(0.1, 100000.0, 50.0), halo(0.0, 1000.0, 2.0);
+  ray::OptionalKeyValueArgument tile_width_option("tile_width", 't', &tile_width);
+  ray::OptionalKeyValueArgument halo_option("halo", 'h', &halo);
+  ray::DoubleArgument window(0.001, 1e10, 60.0), overlap(0.0, 1e10, 10.0);
+  ray::OptionalKeyValueArgument window_option("window", 'w', &window);
+  ray::OptionalKeyValueArgument overlap_option("overlap", 'o', &overlap);
+  if (!ray::parseCommandLine(argc, argv, { &merge_type, &cloud_file, &num_rays, &text },
+                             { &colour, &tile_width_option, &halo_option, &window_option, &overlap_option }))
     usage();
-
-  ray::Cloud cloud;
-  if (!cloud.load(cloud_file.name()))
+  if (tile_width_option.isSet() && window_option.isSet())
+  {
+    std::cerr << "Error: --tile_width and --window cannot be used together" << std::endl;
     usage();
+  }
 
   ray::Threads::init();
   ray::MergerConfig config;
@@ -73,6 +323,23 @@ int rayTransients(int argc, char *argv[])
     config.merge_type = ray::MergeType::Maximum;
   }
 
+  if (window_option.isSet())
+  {
+    if (!transientsInTimeWindows(cloud_file, config, window.value(), overlap.value()))
+      usage();
+    return 0;
+  }
+  if (tile_width_option.isSet())
+  {
+    if (!transientsInTiles(cloud_file, config, tile_width.value(), halo.value()))
+      usage();
+    return 0;
+  }
+
+  ray::Cloud cloud;
+  if (!cloud.load(cloud_file.name()))
+    usage();
+
   ray::Merger filter(config);
   ray::Progress progress;
   ray::ProgressThread progress_thread(progress);
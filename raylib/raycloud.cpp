@@ -5,14 +5,23 @@
 // Author: Thomas Lowe
 #include "raycloud.h"
 
+#include "raycloudwriter.h"
 #include "raylaz.h"
 #include "rayply.h"
 #include "rayprogress.h"
 
 #include <nabo/nabo.h>
 
+#if RAYLIB_WITH_TBB
+#include <tbb/parallel_for.h>
+#endif  // RAYLIB_WITH_TBB
+
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
+#include <fstream>
 #include <limits>
+#include <queue>
 #include <set>
 // #define OUTPUT_CLOUD_MOMENTS // useful for setting up unit tests comparisons
 
@@ -26,10 +35,10 @@ void Cloud::clear()
   colours.clear();
 }
 
-void Cloud::save(const std::string &file_name) const
+bool Cloud::save(const std::string &file_name) const
 {
   std::string name = file_name;
-  writePlyRayCloud(name, starts, ends, times, colours);
+  return writePlyRayCloud(name, starts, ends, times, colours);
 }
 
 bool Cloud::load(const std::string &file_name, bool check_extension, int min_num_rays)
@@ -157,7 +166,7 @@ void Cloud::removeUnboundedRays()
   colours.resize(valids.size());
 }
 
-void Cloud::decimate(double voxel_width, std::set<Eigen::Vector3i, Vector3iLess> &voxel_set)
+void Cloud::decimate(double voxel_width, VoxelSet &voxel_set)
 {
   std::vector<int64_t> subsample;
   voxelSubsample(ends, voxel_width, subsample, voxel_set);
@@ -238,7 +247,8 @@ void Cloud::getSurfels(int search_size, std::vector<Eigen::Vector3d> *centroids,
       }
     }
   }
-  for (int i = 0; i < (int)ray_ids.size(); i++)
+  // each surfel only writes to its own column of indices and its own ray's outputs, so can be solved in parallel
+  const auto solve_surfel = [&](int i)
   {
     int ray_id = ray_ids[i];
     Eigen::Vector3d centroid;
@@ -295,7 +305,17 @@ void Cloud::getSurfels(int search_size, std::vector<Eigen::Vector3d> *centroids,
     }
     if (mats)
       (*mats)[ray_id] = eigen_solver.eigenvectors();
+  };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for<int>(0, (int)ray_ids.size(), solve_surfel);
+#else   // RAYLIB_WITH_TBB
+  const int count = (int)ray_ids.size();
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < count; i++)
+  {
+    solve_surfel(i);
   }
+#endif  // RAYLIB_WITH_TBB
 }
 
 // starts are required to get the normal the right way around
@@ -313,7 +333,7 @@ bool RAYLIB_EXPORT Cloud::getInfo(const std::string &file_name, Info &info)
   Eigen::Vector3d min_v(min_s, min_s, min_s);
   Eigen::Vector3d max_v(max_s, max_s, max_s);
   Cuboid unbounded(min_v, max_v);
-  info.ends_bound = info.starts_bound = info.rays_bound = unbounded;
+  info.ends_bound = info.starts_bound = info.rays_bound = info.bounded_rays_bound = unbounded;
   info.num_rays = info.num_bounded = 0;
   info.min_time = min_s;
   info.max_time = max_s;
@@ -328,6 +348,10 @@ bool RAYLIB_EXPORT Cloud::getInfo(const std::string &file_name, Info &info)
       {
         info.ends_bound.min_bound_ = minVector(info.ends_bound.min_bound_, ends[i]);
         info.ends_bound.max_bound_ = maxVector(info.ends_bound.max_bound_, ends[i]);
+        info.bounded_rays_bound.min_bound_ =
+          minVector(info.bounded_rays_bound.min_bound_, minVector(starts[i], ends[i]));
+        info.bounded_rays_bound.max_bound_ =
+          maxVector(info.bounded_rays_bound.max_bound_, maxVector(starts[i], ends[i]));
         info.num_bounded++;
         info.centroid += ends[i];
       }
@@ -368,8 +392,8 @@ double Cloud::estimatePointSpacing(const std::string &file_name, const Cuboid &b
   voxel_width *=
     5.0;  // we want to use a larger width because this process only works when the width is an overestimation
   std::cout << "initial voxel width estimate: " << voxel_width << std::endl;
-  double num_voxels = 0;
-  std::set<Eigen::Vector3i, Vector3iLess> test_set;
+  // the bounds are known, so the voxel set can be a bitset
+  VoxelSet test_set(voxelIndex(bounds.min_bound_, voxel_width), voxelIndex(bounds.max_bound_, voxel_width));
 
   auto estimate_size = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends, std::vector<double> &,
                            std::vector<ray::RGBA> &colours) {
@@ -378,20 +402,13 @@ double Cloud::estimatePointSpacing(const std::string &file_name, const Cuboid &b
       if (colours[i].alpha == 0)
         continue;
 
-      const Eigen::Vector3d &point = ends[i];
-      Eigen::Vector3i place(int(std::floor(point[0] / voxel_width)), int(std::floor(point[1] / voxel_width)),
-                            int(std::floor(point[2] / voxel_width)));
-      if (test_set.find(place) == test_set.end())
-      {
-        test_set.insert(place);
-        num_voxels++;
-      }
+      test_set.insert(voxelIndex(ends[i], voxel_width));
     }
   };
   if (!readPly(file_name, true, estimate_size, 0))
     return 0;
 
-  double points_per_voxel = (double)num_points / num_voxels;
+  double points_per_voxel = (double)num_points / (double)test_set.size();
   double width = voxel_width / pow(points_per_voxel, 1.0 / cloud_exponent);
   std::cout << "estimated point spacing: " << width << std::endl;
   return width;
@@ -415,23 +432,15 @@ double Cloud::estimatePointSpacing() const
   voxel_width *=
     5.0;  // we want to use a larger width because this process only works when the width is an overestimation
   std::cout << "initial voxel width estimate: " << voxel_width << std::endl;
-  double num_voxels = 0;
-  std::set<Eigen::Vector3i, Vector3iLess> test_set;
+  VoxelSet test_set(voxelIndex(min_bound, voxel_width), voxelIndex(max_bound, voxel_width));
   for (unsigned int i = 0; i < ends.size(); i++)
   {
     if (rayBounded(i))
     {
-      const Eigen::Vector3d &point = ends[i];
-      Eigen::Vector3i place(int(std::floor(point[0] / voxel_width)), int(std::floor(point[1] / voxel_width)),
-                            int(std::floor(point[2] / voxel_width)));
-      if (test_set.find(place) == test_set.end())
-      {
-        test_set.insert(place);
-        num_voxels++;
-      }
+      test_set.insert(voxelIndex(ends[i], voxel_width));
     }
   }
-  double points_per_voxel = (double)num_points / num_voxels;
+  double points_per_voxel = (double)num_points / (double)test_set.size();
   double width = voxel_width / pow(points_per_voxel, 1.0 / cloud_exponent);
   std::cout << "estimated point spacing: " << width << std::endl;
   return width;
@@ -532,4 +541,253 @@ bool Cloud::read(const std::string &file_name,
   return readPly(file_name, true, apply, 0);
 }
 
+bool Cloud::read(const std::vector<std::string> &file_names,
+                 std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                    std::vector<double> &times, std::vector<RGBA> &colours)>
+                   apply)
+{
+  for (const auto &file_name : file_names)
+  {
+    if (!read(file_name, apply))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool Cloud::readTimeOrdered(const std::vector<std::string> &file_names,
+                            std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                               std::vector<double> &times, std::vector<RGBA> &colours)>
+                              apply,
+                            size_t chunk_size)
+{
+  return readMerged(
+    file_names, [](const Eigen::Vector3d &, const Eigen::Vector3d &, double time) { return timeSortKey(time); }, apply,
+    chunk_size);
+}
+
+bool Cloud::readMerged(const std::vector<std::string> &file_names,
+                       std::function<uint64_t(const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time)> key,
+                       std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                          std::vector<double> &times, std::vector<RGBA> &colours)>
+                         apply,
+                       size_t chunk_size)
+{
+  // beyond this many files, groups of files are merged into temporary files first, then those are merged. This bounds
+  // the number of open files, and the memory of the per-file buffers
+  const size_t max_fan_in = 64;
+  if (file_names.size() > max_fan_in)
+  {
+    const std::string merge_stub = file_names[0].substr(0, file_names[0].rfind('.')) + "_merge";
+    std::vector<std::string> merged_names;
+    bool success = true;
+    for (size_t first = 0; first < file_names.size() && success; first += max_fan_in)
+    {
+      const std::vector<std::string> group(file_names.begin() + first,
+                                           file_names.begin() + std::min(file_names.size(), first + max_fan_in));
+      merged_names.push_back(merge_stub + std::to_string(merged_names.size()) + ".ply");
+      CloudWriter writer;
+      auto write_chunk = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                             std::vector<double> &times, std::vector<RGBA> &colours) {
+        writer.writeChunk(starts, ends, times, colours);
+      };
+      success = writer.begin(merged_names.back()) && readMerged(group, key, write_chunk, chunk_size);
+      writer.end();
+    }
+    // the groups are in file order, so rays with equal keys stay in file order
+    success = success && readMerged(merged_names, key, apply, chunk_size);
+    for (const auto &merged_name : merged_names)
+    {
+      std::remove(merged_name.c_str());
+    }
+    return success;
+  }
+
+  struct Input
+  {
+    std::ifstream in;
+    PlyLayout layout;
+    Cloud rays;  // the buffered part of the file
+    std::vector<uint64_t> keys;
+    size_t next = 0;
+    uint64_t last_key = 0;
+    bool warned = false;
+  };
+  // the buffers of all the inputs share the chunk size
+  const size_t buffer_size = std::max<size_t>(1024, chunk_size / std::max<size_t>(1, file_names.size()));
+  std::vector<Input> inputs(file_names.size());
+  bool read_failed = false;
+  // refills the buffer of input i, returning false at the end of its file or on a read error, which sets read_failed
+  const auto refill = [&](size_t i) {
+    Input &input = inputs[i];
+    input.next = 0;
+    while (readRayCloudChunk(input.in, input.layout, buffer_size, input.rays.starts, input.rays.ends, input.rays.times,
+                             input.rays.colours))
+    {
+      if (input.rays.rayCount() > 0)
+      {
+        input.keys.resize(input.rays.rayCount());
+        for (size_t i = 0; i < input.keys.size(); i++)
+        {
+          input.keys[i] = key(input.rays.starts[i], input.rays.ends[i], input.rays.times[i]);
+        }
+        return true;
+      }
+    }
+    // readRayCloudChunk also returns false on a read error, so only the end of the file is a successful end
+    if (input.in.bad() || !input.in.eof())
+    {
+      std::cerr << "Error: cannot read " << file_names[i] << std::endl;
+      read_failed = true;
+    }
+    return false;
+  };
+
+  // a min-heap of the next ray key of each input, with the input index breaking ties
+  using Entry = std::pair<uint64_t, size_t>;
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+  for (size_t i = 0; i < inputs.size(); i++)
+  {
+    if (!readRayCloudChunkStart(file_names[i], inputs[i].in, inputs[i].layout))
+    {
+      return false;
+    }
+    if (refill(i))
+    {
+      queue.push(Entry(inputs[i].keys[0], i));
+    }
+    else if (read_failed)
+    {
+      return false;
+    }
+  }
+
+  Cloud chunk;
+  while (!queue.empty())
+  {
+    const size_t i = queue.top().second;
+    queue.pop();
+    Input &input = inputs[i];
+    // take the run of rays from this input that precede the next ray of any other input
+    do
+    {
+      const uint64_t ray_key = input.keys[input.next];
+      if (ray_key < input.last_key && !input.warned)
+      {
+        std::cout << "warning: " << file_names[i] << " is not sorted, so the merged rays won't be either" << std::endl;
+        input.warned = true;
+      }
+      input.last_key = ray_key;
+      chunk.addRay(input.rays, input.next++);
+      if (chunk.rayCount() == chunk_size)
+      {
+        apply(chunk.starts, chunk.ends, chunk.times, chunk.colours);
+        chunk.clear();
+      }
+    } while (input.next < input.rays.rayCount() &&
+             (queue.empty() || Entry(input.keys[input.next], i) < queue.top()));
+
+    if (input.next < input.rays.rayCount() || refill(i))
+    {
+      queue.push(Entry(input.keys[input.next], i));
+    }
+    else if (read_failed)
+    {
+      return false;
+    }
+  }
+  if (chunk.rayCount() > 0)
+  {
+    apply(chunk.starts, chunk.ends, chunk.times, chunk.colours);
+  }
+  return true;
+}
+
+bool Cloud::sortFile(const std::string &file_name, const std::string &sorted_name,
+                     std::function<uint64_t(const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time)> key,
+                     size_t max_run_rays)
+{
+  max_run_rays = std::max<size_t>(1, max_run_rays);
+  const std::string run_stub = sorted_name.substr(0, sorted_name.rfind('.')) + "_run";
+  std::vector<std::string> run_names;
+  std::vector<std::pair<uint64_t, size_t>> order;
+  Cloud run, sorted;
+  bool runs_saved = true;
+  // sort the rays of the run by key, with the ray index breaking ties, returning whether the run was saved
+  auto write_run = [&](const std::string &run_name) -> bool {
+    order.resize(run.rayCount());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+      order[i] = std::make_pair(key(run.starts[i], run.ends[i], run.times[i]), i);
+    }
+    std::sort(order.begin(), order.end());
+    sorted.clear();
+    sorted.reserve(order.size());
+    for (const auto &entry : order)
+    {
+      sorted.addRay(run, entry.second);
+    }
+    run.clear();
+    return sorted.save(run_name);
+  };
+  auto add_rays = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                      std::vector<double> &times, std::vector<RGBA> &colours) {
+    for (size_t i = 0; i < ends.size() && runs_saved; i++)
+    {
+      run.addRay(starts[i], ends[i], times[i], colours[i]);
+      if (run.rayCount() == max_run_rays)
+      {
+        run_names.push_back(run_stub + std::to_string(run_names.size()) + ".ply");
+        runs_saved = write_run(run_names.back());
+      }
+    }
+  };
+  // removes the spilled runs, once merged or on failure
+  auto remove_runs = [&]() {
+    for (const auto &run_name : run_names)
+    {
+      std::remove(run_name.c_str());
+    }
+  };
+  if (!read(file_name, add_rays) || !runs_saved)
+  {
+    remove_runs();
+    return false;
+  }
+
+  // the whole cloud fitted in memory
+  if (run_names.empty())
+  {
+    return write_run(sorted_name);
+  }
+
+  if (run.rayCount() > 0)
+  {
+    run_names.push_back(run_stub + std::to_string(run_names.size()) + ".ply");
+    if (!write_run(run_names.back()))
+    {
+      remove_runs();
+      return false;
+    }
+  }
+  sorted.clear();
+  CloudWriter writer;
+  if (!writer.begin(sorted_name))
+  {
+    remove_runs();
+    return false;
+  }
+  bool chunks_written = true;
+  auto write_chunk = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                         std::vector<double> &times, std::vector<RGBA> &colours) {
+    chunks_written = writer.writeChunk(starts, ends, times, colours) && chunks_written;
+  };
+  const bool success = readMerged(run_names, key, write_chunk, std::min<size_t>(1000000, max_run_rays));
+  writer.end();
+  remove_runs();
+  return success && chunks_written;
+}
+
 }  // namespace ray
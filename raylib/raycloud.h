@@ -54,7 +54,8 @@ public:
   /// the number of rays
   inline size_t rayCount() const { return ends.size(); }
 
-  void save(const std::string &file_name) const;
+  /// save the ray cloud to @c file_name , returning false if it could not be written
+  bool save(const std::string &file_name) const;
   /// load a ray cloud file. @c check_extension checks the file extension before proceeding
   bool load(const std::string &file_name, bool check_extension = true, int min_num_rays = 4);
 
@@ -66,7 +67,7 @@ public:
   /// apply a Euclidean transform and time shift to the ray cloud
   void transform(const Pose &pose, double time_delta);
   /// spatial decimation of the ray cloud, into one end point per voxel of width @c voxel_width
-  void decimate(double voxel_width, std::set<Eigen::Vector3i, Vector3iLess> &voxel_set);
+  void decimate(double voxel_width, VoxelSet &voxel_set);
   /// add a new ray to the ray cloud
   void addRay(const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time, const RGBA &colour);
   /// add a new ray to the ray cloud, from another cloud
@@ -125,6 +126,7 @@ public:
     Cuboid ends_bound;    // just the end points (not including for unbounded rays)
     Cuboid starts_bound;  // all start points
     Cuboid rays_bound;    // all ray extents
+    Cuboid bounded_rays_bound;  // the extents of the bounded rays, as calcMinBound and calcMaxBound
 
     int num_bounded;
     int num_rays;
@@ -142,6 +144,40 @@ public:
                                       std::vector<double> &times, std::vector<RGBA> &colours)>
                      apply);
 
+  /// Reads the ray cloud files @c file_names in turn, as one ray cloud, and calls the function for each chunk of rays
+  static bool read(const std::vector<std::string> &file_names,
+                   std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                      std::vector<double> &times, std::vector<RGBA> &colours)>
+                     apply);
+
+  /// Reads the time-sorted ray cloud files @c file_names together as one time-sorted ray cloud, calling the function
+  /// for each chunk of up to @c chunk_size rays. Rays with equal times are taken in file order. Each file is read a
+  /// part at a time, into a buffer of its share of @c chunk_size rays, but at least 1024 rays. Above 64 files, groups
+  /// of files are first merged into temporary files, so at most 64 files are open and buffered at once
+  static bool readTimeOrdered(const std::vector<std::string> &file_names,
+                              std::function<void(std::vector<Eigen::Vector3d> &starts,
+                                                 std::vector<Eigen::Vector3d> &ends, std::vector<double> &times,
+                                                 std::vector<RGBA> &colours)>
+                                apply,
+                              size_t chunk_size = 1000000);
+
+  /// As @c readTimeOrdered , for files that are each sorted by the ray value @c key rather than by time
+  static bool readMerged(const std::vector<std::string> &file_names,
+                         std::function<uint64_t(const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time)>
+                           key,
+                         std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                            std::vector<double> &times, std::vector<RGBA> &colours)>
+                           apply,
+                         size_t chunk_size = 1000000);
+
+  /// Sort the rays of the file @c file_name by the ray value @c key into the file @c sorted_name, keeping the file
+  /// order of rays with equal keys. This is an external merge sort, runs of up to @c max_run_rays are sorted in memory
+  /// and, when there is more than one run, spilled to temporary files then merged
+  static bool sortFile(const std::string &file_name, const std::string &sorted_name,
+                       std::function<uint64_t(const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time)>
+                         key,
+                       size_t max_run_rays = 10000000);
+
 private:
   bool loadPLY(const std::string &file, int min_num_rays);
   // Convert the set of neighbouring indices into a eigen solution, which is an ellipsoid of best fit.
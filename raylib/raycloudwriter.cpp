@@ -35,10 +35,149 @@ void CloudWriter::end()
   ofs_.close();
 }
 
+void CloudWriter::suspend()
+{
+  if (!ofs_.is_open())
+  {
+    return;
+  }
+  ray::writeRayCloudChunkEnd(ofs_);
+  ofs_.close();
+  // release the buffer, as a suspended writer may not be used again for some time
+  RayPlyBuffer().swap(buffer_);
+}
+
+bool CloudWriter::resume()
+{
+  if (file_name_.empty())
+  {
+    std::cerr << "Error: cloud writer resume called before begin" << std::endl;
+    return false;
+  }
+  ofs_.open(file_name_, std::ios::binary | std::ios::in | std::ios::out);
+  if (ofs_.fail())
+  {
+    std::cerr << "Error: cannot reopen " << file_name_ << " for writing." << std::endl;
+    return false;
+  }
+  ofs_.seekp(0, std::ios::end);
+  return true;
+}
+
 bool CloudWriter::writeChunk(const Cloud &chunk)
 {
   return writeRayCloudChunk(ofs_, buffer_, chunk.starts, chunk.ends, chunk.times, chunk.colours, has_warned_);
 }
 
+CloudWriterPool::CloudWriterPool(size_t max_open_files, size_t max_buffered_rays)
+  : max_open_files_(std::max<size_t>(1, max_open_files))
+  , max_buffered_rays_(max_buffered_rays)
+  , num_buffered_rays_(0)
+  , success_(true)
+{
+  // a file whose buffer reaches this size is written straight away, keeping the writes reasonably large
+  max_file_buffer_ = std::max<size_t>(1024, max_buffered_rays_ / max_open_files_);
+}
+
+CloudWriterPool::~CloudWriterPool()
+{
+  end();
+}
+
+void CloudWriterPool::create(int64_t id, const std::string &file_name)
+{
+  files_[id].file_name = file_name;
+}
+
+void CloudWriterPool::addRay(int64_t id, const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time,
+                             const RGBA &colour)
+{
+  File &file = files_[id];
+  file.rays.addRay(start, end, time, colour);
+  num_buffered_rays_++;
+  if (file.rays.ends.size() >= max_file_buffer_)
+  {
+    success_ &= write(id, file);
+  }
+}
+
+bool CloudWriterPool::write(int64_t id, File &file)
+{
+  if (file.open)
+  {
+    lru_.splice(lru_.begin(), lru_, file.lru_position);
+  }
+  else
+  {
+    if (lru_.size() >= max_open_files_)
+    {
+      File &least_used = files_[lru_.back()];
+      least_used.writer.suspend();
+      least_used.open = false;
+      lru_.pop_back();
+    }
+    if (!(file.begun ? file.writer.resume() : file.writer.begin(file.file_name)))
+    {
+      return false;
+    }
+    file.begun = true;
+    file.open = true;
+    lru_.push_front(id);
+    file.lru_position = lru_.begin();
+  }
+  const bool success = file.writer.writeChunk(file.rays);
+  num_buffered_rays_ -= file.rays.ends.size();
+  file.rays = Cloud();
+  return success;
+}
+
+bool CloudWriterPool::flush()
+{
+  if (num_buffered_rays_ > max_buffered_rays_)
+  {
+    // open files first, to reduce the number of files reopened
+    for (auto &id : std::vector<int64_t>(lru_.begin(), lru_.end()))
+    {
+      File &file = files_[id];
+      if (!file.rays.ends.empty())
+      {
+        success_ &= write(id, file);
+      }
+    }
+    for (auto &file : files_)
+    {
+      if (!file.second.rays.ends.empty())
+      {
+        success_ &= write(file.first, file.second);
+      }
+    }
+  }
+  return success_;
+}
+
+bool CloudWriterPool::end()
+{
+  for (auto &file : files_)
+  {
+    if (!file.second.rays.ends.empty())
+    {
+      success_ &= write(file.first, file.second);
+    }
+  }
+  for (auto &file : files_)
+  {
+    // reopening suspended files is only needed to report them in the same way as open files
+    if (file.second.begun && (file.second.open || file.second.writer.resume()))
+    {
+      file.second.writer.end();
+    }
+  }
+  files_.clear();
+  lru_.clear();
+  num_buffered_rays_ = 0;
+  const bool success = success_;
+  success_ = true;
+  return success;
+}
 
 }  // namespace ray
@@ -7,8 +7,12 @@
 #define RAYLIB_RAYCLOUDWRITER_H
 
 #include "raylib/raylibconfig.h"
+#include "raycloud.h"
 #include "rayply.h"
 
+#include <list>
+#include <unordered_map>
+
 namespace ray
 {
 /// This helper class is for writing a ray cloud to a file, one chunk at a time
@@ -32,6 +36,12 @@ public:
   /// finish writing, and adjust the vertex count at the start.
   void end();
 
+  /// close the file, leaving it valid, so that it can be continued later by @c resume()
+  void suspend();
+
+  /// reopen a file that was closed by @c suspend() or @c end(), to append further rays
+  bool resume();
+
   /// return the stored file name
   const std::string &fileName() { return file_name_; }
 
@@ -46,6 +56,57 @@ private:
   bool has_warned_;
 };
 
+/// Writes rays to a large number of ray cloud files in a single pass, such as when splitting a cloud into many cells.
+/// Rays are buffered per file, and the buffers are written through a limited pool of open files. When a file is
+/// needed and the pool is full, the least recently used file is suspended. This avoids operating system limits on
+/// the number of open files, without needing a separate pass over the input for each group of output files.
+class RAYLIB_EXPORT CloudWriterPool
+{
+public:
+  /// At most @c max_open_files are open at once, and at most roughly @c max_buffered_rays are held in memory
+  CloudWriterPool(size_t max_open_files = 256, size_t max_buffered_rays = 16000000);
+  ~CloudWriterPool();
+
+  /// whether the file with identifier @c id has been created
+  inline bool has(int64_t id) const { return files_.find(id) != files_.end(); }
+
+  /// create a new output file, with identifier @c id
+  void create(int64_t id, const std::string &file_name);
+
+  /// add a ray to the file with identifier @c id, which must already be created
+  void addRay(int64_t id, const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time, const RGBA &colour);
+
+  /// write out the buffered rays if they exceed the buffer limit, typically called after each input chunk
+  bool flush();
+
+  /// write out all buffered rays and finish all of the files
+  bool end();
+
+  /// the number of files created
+  inline size_t size() const { return files_.size(); }
+
+private:
+  struct File
+  {
+    CloudWriter writer;
+    Cloud rays;
+    std::string file_name;
+    bool begun = false;
+    bool open = false;
+    std::list<int64_t>::iterator lru_position;
+  };
+  bool write(int64_t id, File &file);
+
+  size_t max_open_files_;
+  size_t max_buffered_rays_;
+  size_t max_file_buffer_;
+  size_t num_buffered_rays_;
+  bool success_;
+  std::unordered_map<int64_t, File> files_;
+  /// identifiers of the open files, most recently used at the front
+  std::list<int64_t> lru_;
+};
+
 }  // namespace ray
 
 #endif  // RAYLIB_RAYCLOUDWRITER_H
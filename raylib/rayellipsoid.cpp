@@ -7,9 +7,12 @@
 
 #include "raycloud.h"
 #include "rayprogress.h"
+#include "rayvoxelset.h"
 
 #include <nabo/nabo.h>
 
+#include <algorithm>
+#include <limits>
 #include <memory>
 
 #if RAYLIB_WITH_TBB
@@ -18,15 +21,21 @@
 
 namespace ray
 {
-void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max,
-                        const Cloud &cloud, Progress *progress)
+namespace
+{
+/// Number of points whose neighbours are searched at once, which bounds the memory of the neighbour lists
+const size_t kNeighbourBlockSize = 1 << 18;
+
+/// Fit an ellipsoid to the neighbourhood of each bounded ray end in @c cloud. For each ray @c i with enough bounded
+/// neighbours, @c func(i, centroid, eigen_mat, extents) is called, in parallel.
+template <class Func>
+void fitEllipsoids(const Cloud &cloud, Progress *progress, Func func)
 {
-  ellipsoids->clear();
-  ellipsoids->resize(cloud.rayCount());
   const int search_size = std::min(16, (int)cloud.rayCount() - 1);
-  const double max_double = std::numeric_limits<double>::max();
-  Eigen::Vector3d ellipsoids_min(max_double, max_double, max_double);
-  Eigen::Vector3d ellipsoids_max(-max_double, -max_double, -max_double);
+  if (search_size <= 0)
+  {
+    return;
+  }
   Nabo::Parameters params("bucketSize", 8);
 
   if (progress)
@@ -41,133 +50,385 @@ void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bou
   }
   std::unique_ptr<Nabo::NNSearchD> nns(Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 3));
 
-  // Run the search
-  Eigen::MatrixXi indices;
-  Eigen::MatrixXd dists2;
-  indices.resize(search_size, cloud.rayCount());
-  dists2.resize(search_size, cloud.rayCount());
-
   if (progress)
   {
     progress->increment();
-  }
-  nns->knn(points_p, indices, dists2, search_size, kNearestNeighbourEpsilon, 0);
-  nns.reset(nullptr);
-
-  if (progress)
-  {
     progress->increment();
     progress->end();
     progress->begin("generateEllipsoids", cloud.ends.size());
   }
-  const auto generate_ellipsoid = [&](size_t i)  //
+
+  // Run the search in blocks of points, so the neighbour lists are not stored for the whole cloud at once
+  Eigen::MatrixXi indices;
+  Eigen::MatrixXd dists2;
+  for (size_t block_start = 0; block_start < cloud.rayCount(); block_start += kNeighbourBlockSize)
   {
-    Ellipsoid &ellipsoid = (*ellipsoids)[i];
-    ellipsoid.clear();
-    ellipsoid.transient = false;
-    ellipsoid.opacity = 1.0;
+    const size_t block_size = std::min(kNeighbourBlockSize, cloud.rayCount() - block_start);
+    const Eigen::MatrixXd block_points = points_p.middleCols(block_start, block_size);
+    indices.resize(search_size, block_size);
+    dists2.resize(search_size, block_size);
+    nns->knn(block_points, indices, dists2, search_size, kNearestNeighbourEpsilon, 0);
 
-    // Increment progress here as we have multiple exit points
-    if (progress)
+    const auto fit_ellipsoid = [&](size_t k)  //
     {
-      progress->increment();
-    }
+      const size_t i = block_start + k;
+      // Increment progress here as we have multiple exit points
+      if (progress)
+      {
+        progress->increment();
+      }
+
+      if (!cloud.rayBounded(i))
+      {
+        return;
+      }
+
+      Eigen::Matrix3d scatter;
+      scatter.setZero();
+      Eigen::Vector3d centroid(0, 0, 0);
+      double num_neighbours = 0;
+      for (int j = 0; j < search_size && indices(j, k) != Nabo::NNSearchD::InvalidIndex; ++j)
+      {
+        int index = indices(j, k);
+        if (cloud.rayBounded(index))
+        {
+          centroid += cloud.ends[index];
+          num_neighbours++;
+        }
+      }
+      if (num_neighbours < 4)
+      {
+        return;
+      }
+      centroid /= num_neighbours;
+      for (int j = 0; j < search_size && indices(j, k) != Nabo::NNSearchD::InvalidIndex; j++)
+      {
+        int index = indices(j, k);
+        if (cloud.rayBounded(index))
+        {
+          Eigen::Vector3d offset = cloud.ends[index] - centroid;
+          scatter += offset * offset.transpose();
+        }
+      }
+      scatter /= num_neighbours;
+
+      Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigen_solver(scatter.transpose());
+      ASSERT(eigen_solver.info() == Eigen::ComputationInfo::Success);
+
+      Eigen::Vector3d eigen_value = eigen_solver.eigenvalues();
+      Eigen::Matrix3d eigen_vector = eigen_solver.eigenvectors();
 
-    if (!cloud.rayBounded(i))
+      double scale = 1.7;  // this scale roughly matches the dimensions of a uniformly dense ellipsoid
+      eigen_value[0] = scale * sqrt(std::max(1e-10, eigen_value[0]));
+      eigen_value[1] = scale * sqrt(std::max(1e-10, eigen_value[1]));
+      eigen_value[2] = scale * sqrt(std::max(1e-10, eigen_value[2]));
+      Eigen::Matrix3f eigen_mat;
+      eigen_mat.row(0) = (eigen_vector.col(0) / eigen_value[0]).cast<float>();
+      eigen_mat.row(1) = (eigen_vector.col(1) / eigen_value[1]).cast<float>();
+      eigen_mat.row(2) = (eigen_vector.col(2) / eigen_value[2]).cast<float>();
+      func(i, centroid, eigen_mat, ellipsoidExtents(eigen_vector, eigen_value));
+    };
+
+#if RAYLIB_WITH_TBB
+    tbb::parallel_for<size_t>(0, block_size, fit_ellipsoid);
+#else   // RAYLIB_WITH_TBB
+    const int count = static_cast<int>(block_size);
+    #pragma omp parallel for schedule(static)
+    for (int k = 0; k < count; ++k)
     {
-      return;
+      fit_ellipsoid(k);
     }
+#endif  // RAYLIB_WITH_TBB
+  }
+}
+
+/// The largest float no greater than @c value
+inline float roundDown(double value)
+{
+  const float rounded = static_cast<float>(value);
+  return rounded > value ? std::nextafter(rounded, -std::numeric_limits<float>::max()) : rounded;
+}
+
+/// The smallest float no less than @c value
+inline float roundUp(double value)
+{
+  const float rounded = static_cast<float>(value);
+  return rounded < value ? std::nextafter(rounded, std::numeric_limits<float>::max()) : rounded;
+}
 
-    Eigen::Matrix3d scatter;
-    scatter.setZero();
-    Eigen::Vector3d centroid(0, 0, 0);
-    double num_neighbours = 0;
-    for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; ++j)
+/// Expand @c bounds_min and @c bounds_max to contain the box of half-width @c extents around @c pos
+inline void expandBounds(const Eigen::Vector3d &pos, const Eigen::Vector3f &extents, Eigen::Vector3d &bounds_min,
+                         Eigen::Vector3d &bounds_max)
+{
+  bounds_min = minVector(bounds_min, Eigen::Vector3d(pos - extents.cast<double>()));
+  bounds_max = maxVector(bounds_max, Eigen::Vector3d(pos + extents.cast<double>()));
+}
+}  // namespace
+
+void intersectEllipsoidBatch(const Eigen::Vector3d &pos, const Eigen::Matrix3f &eigen_mat, const Cloud &cloud,
+                             const std::vector<unsigned> &ray_ids, std::vector<IntersectResult> &results)
+{
+  // The arithmetic follows intersectEllipsoid, but with the ray relative to the ellipsoid centre, and on Eigen arrays
+  // of a packet of rays, which are vectorised.
+  const int kPacketSize = 32;
+  using Packet = Eigen::Array<float, kPacketSize, 1>;
+  Packet start_x, start_y, start_z, dir_x, dir_y, dir_z;
+  const float pass_distance = 0.05f;
+
+  results.resize(ray_ids.size());
+  for (size_t packet_start = 0; packet_start < ray_ids.size(); packet_start += kPacketSize)
+  {
+    const int count = static_cast<int>(std::min(ray_ids.size() - packet_start, static_cast<size_t>(kPacketSize)));
+    for (int k = 0; k < count; k++)
     {
-      int index = indices(j, i);
-      if (cloud.rayBounded(index))
-      {
-        centroid += cloud.ends[index];
-        num_neighbours++;
-      }
+      const unsigned ray_id = ray_ids[packet_start + k];
+      const Eigen::Vector3d start = cloud.starts[ray_id] - pos;
+      const Eigen::Vector3d dir = cloud.ends[ray_id] - cloud.starts[ray_id];
+      start_x[k] = static_cast<float>(start[0]);
+      start_y[k] = static_cast<float>(start[1]);
+      start_z[k] = static_cast<float>(start[2]);
+      dir_x[k] = static_cast<float>(dir[0]);
+      dir_y[k] = static_cast<float>(dir[1]);
+      dir_z[k] = static_cast<float>(dir[2]);
     }
-    if (num_neighbours < 4)
+    // pad a partial packet with unit rays, whose results are not used
+    for (int k = count; k < kPacketSize; k++)
     {
-      return;
+      start_x[k] = start_y[k] = start_z[k] = dir_y[k] = dir_z[k] = 0.0f;
+      dir_x[k] = 1.0f;
     }
-    centroid /= num_neighbours;
-    for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
+
+    // the ray and the vector to the ellipsoid centre, in the ellipsoid's unit sphere space
+    const Packet ray_x = eigen_mat(0, 0) * dir_x + eigen_mat(0, 1) * dir_y + eigen_mat(0, 2) * dir_z;
+    const Packet ray_y = eigen_mat(1, 0) * dir_x + eigen_mat(1, 1) * dir_y + eigen_mat(1, 2) * dir_z;
+    const Packet ray_z = eigen_mat(2, 0) * dir_x + eigen_mat(2, 1) * dir_y + eigen_mat(2, 2) * dir_z;
+    const Packet to_x = -(eigen_mat(0, 0) * start_x + eigen_mat(0, 1) * start_y + eigen_mat(0, 2) * start_z);
+    const Packet to_y = -(eigen_mat(1, 0) * start_x + eigen_mat(1, 1) * start_y + eigen_mat(1, 2) * start_z);
+    const Packet to_z = -(eigen_mat(2, 0) * start_x + eigen_mat(2, 1) * start_y + eigen_mat(2, 2) * start_z);
+    const Packet ray_length_sqr = ray_x.square() + ray_y.square() + ray_z.square();
+
+    Packet d = (to_x * ray_x + to_y * ray_y + to_z * ray_z) / ray_length_sqr;
+    const Packet dist2 = (to_x - ray_x * d).square() + (to_y - ray_y * d).square() + (to_z - ray_z * d).square();
+
+    const Packet along_dist = (1.0f - dist2).max(0.0f).sqrt();
+    const Packet ray_length = ray_length_sqr.sqrt();
+    d *= ray_length;
+    const Packet ratio = pass_distance / (dir_x.square() + dir_y.square() + dir_z.square()).sqrt();
+    // misses if it passes outside the ellipsoid, doesn't reach it or starts beyond it, and it must pass some way
+    // past to pass through
+    const auto miss = (dist2 > 1.0f) || (ray_length < d - along_dist) || (d + along_dist < 0.0f);
+    const auto pass_through = ray_length * (1.0f - ratio) > d + along_dist;
+
+    for (int k = 0; k < count; k++)
     {
-      int index = indices(j, i);
-      if (cloud.rayBounded(index))
-      {
-        Eigen::Vector3d offset = cloud.ends[index] - centroid;
-        scatter += offset * offset.transpose();
-      }
+      results[packet_start + k] =
+        miss[k] ? IntersectResult::Miss : (pass_through[k] ? IntersectResult::Passthrough : IntersectResult::Hit);
     }
-    scatter /= num_neighbours;
-
-    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigen_solver(scatter.transpose());
-    ASSERT(eigen_solver.info() == Eigen::ComputationInfo::Success);
-
-    Eigen::Vector3d eigen_value = eigen_solver.eigenvalues();
-    Eigen::Matrix3d eigen_vector = eigen_solver.eigenvectors();
-
-    ellipsoid.pos = centroid;
-    double scale = 1.7;  // this scale roughly matches the dimensions of a uniformly dense ellipsoid
-    eigen_value[0] = scale * sqrt(std::max(1e-10, eigen_value[0]));
-    eigen_value[1] = scale * sqrt(std::max(1e-10, eigen_value[1]));
-    eigen_value[2] = scale * sqrt(std::max(1e-10, eigen_value[2]));
-    ellipsoid.eigen_mat.row(0) = (eigen_vector.col(0) / eigen_value[0]).cast<float>();
-    ellipsoid.eigen_mat.row(1) = (eigen_vector.col(1) / eigen_value[1]).cast<float>();
-    ellipsoid.eigen_mat.row(2) = (eigen_vector.col(2) / eigen_value[2]).cast<float>();
-    ellipsoid.time = cloud.times[i];
-    ellipsoid.setExtents(eigen_vector, eigen_value);
-  };
+  }
+}
 
-#if RAYLIB_WITH_TBB
-  tbb::parallel_for<size_t>(0, cloud.rayCount(), generate_ellipsoid);
+void EllipsoidBvh::build(const EllipsoidStore &store)
+{
+  nodes_.clear();
+  boxes_.resize(store.size());
+  ellipsoid_ids_.resize(store.size());
+  if (store.size() == 0)
+  {
+    return;
+  }
+  const double max_double = std::numeric_limits<double>::max();
+  Eigen::Vector3d bounds_min(max_double, max_double, max_double);
+  Eigen::Vector3d bounds_max(-max_double, -max_double, -max_double);
+  for (size_t i = 0; i < store.size(); i++)
+  {
+    expandBounds(store.position(i), store.ellipsoids[i].extents, bounds_min, bounds_max);
+  }
+  origin_ = (bounds_min + bounds_max) / 2.0;
+  for (size_t i = 0; i < store.size(); i++)
+  {
+    // rounding the box outwards keeps the culling conservative, however far the ellipsoid is from the origin
+    const Eigen::Vector3d pos = store.position(i) - origin_;
+    const Eigen::Vector3d extents = store.ellipsoids[i].extents.cast<double>();
+    for (int axis = 0; axis < 3; axis++)
+    {
+      boxes_[i].min[axis] = roundDown(pos[axis] - extents[axis]);
+      boxes_[i].max[axis] = roundUp(pos[axis] + extents[axis]);
+    }
+    ellipsoid_ids_[i] = static_cast<uint32_t>(i);
+  }
+  nodes_.reserve(store.size());
+  nodes_.resize(1);
+  buildNode(0, 0, static_cast<uint32_t>(store.size()));
+}
 
-  for (size_t i = 0; i < ellipsoids->size(); ++i)
+void EllipsoidBvh::buildNode(uint32_t node_index, uint32_t first, uint32_t count)
+{
+  const float max_float = std::numeric_limits<float>::max();
+  Eigen::Vector3f box_min(max_float, max_float, max_float), box_max(-max_float, -max_float, -max_float);
+  Eigen::Vector3f centre_min = box_min, centre_max = box_max;
+  for (uint32_t i = first; i < first + count; i++)
   {
-    Ellipsoid &ellipsoid = (*ellipsoids)[i];
-    const auto ellipsoid_min = ellipsoid.pos - ellipsoid.extents.cast<double>();
-    const auto ellipsoid_max = ellipsoid.pos + ellipsoid.extents.cast<double>();
+    const Box &box = boxes_[ellipsoid_ids_[i]];
+    box_min = box_min.cwiseMin(box.min);
+    box_max = box_max.cwiseMax(box.max);
+    const Eigen::Vector3f centre = (box.min + box.max) / 2.0f;
+    centre_min = centre_min.cwiseMin(centre);
+    centre_max = centre_max.cwiseMax(centre);
+  }
+  nodes_[node_index].box_min = box_min;
+  nodes_[node_index].box_max = box_max;
 
-    ellipsoids_min.x() = std::min(ellipsoids_min.x(), ellipsoid_min.x());
-    ellipsoids_min.y() = std::min(ellipsoids_min.y(), ellipsoid_min.y());
-    ellipsoids_min.z() = std::min(ellipsoids_min.z(), ellipsoid_min.z());
-    ellipsoids_max.x() = std::max(ellipsoids_max.x(), ellipsoid_max.x());
-    ellipsoids_max.y() = std::max(ellipsoids_max.y(), ellipsoid_max.y());
-    ellipsoids_max.z() = std::max(ellipsoids_max.z(), ellipsoid_max.z());
+  const uint32_t leaf_size = 4;
+  int axis;
+  if (count <= leaf_size || (centre_max - centre_min).maxCoeff(&axis) <= 0.0f)
+  {
+    nodes_[node_index].first = first;
+    nodes_[node_index].count = count;
+    return;
   }
-#else   // RAYLIB_WITH_TBB
-  const size_t count = cloud.rayCount();
-  #pragma omp parallel for schedule(static)
-  for (size_t i = 0; i < count; ++i)
+  // split at the median centre along the widest axis
+  const uint32_t half = count / 2;
+  const auto &boxes = boxes_;
+  std::nth_element(
+    ellipsoid_ids_.begin() + first, ellipsoid_ids_.begin() + first + half, ellipsoid_ids_.begin() + first + count,
+    [&boxes, axis](uint32_t a, uint32_t b) {
+      return boxes[a].min[axis] + boxes[a].max[axis] < boxes[b].min[axis] + boxes[b].max[axis];
+    });
+  const uint32_t children = static_cast<uint32_t>(nodes_.size());
+  nodes_.resize(children + 2);
+  nodes_[node_index].first = children;
+  nodes_[node_index].count = 0;
+  buildNode(children, first, half);
+  buildNode(children + 1, first + half, count - half);
+}
+
+void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max,
+                        const Cloud &cloud, Progress *progress)
+{
+  ellipsoids->clear();
+  ellipsoids->resize(cloud.rayCount());
+  for (auto &ellipsoid : *ellipsoids)
+  {
+    ellipsoid.clear();
+    ellipsoid.opacity = 1.0;
+  }
+  fitEllipsoids(cloud, progress,
+                [&](size_t i, const Eigen::Vector3d &centroid, const Eigen::Matrix3f &eigen_mat,
+                    const Eigen::Vector3f &extents)  //
+                {
+                  Ellipsoid &ellipsoid = (*ellipsoids)[i];
+                  ellipsoid.pos = centroid;
+                  ellipsoid.eigen_mat = eigen_mat;
+                  ellipsoid.time = cloud.times[i];
+                  ellipsoid.extents = extents;
+                });
+
+  const double max_double = std::numeric_limits<double>::max();
+  Eigen::Vector3d ellipsoids_min(max_double, max_double, max_double);
+  Eigen::Vector3d ellipsoids_max(-max_double, -max_double, -max_double);
+  for (const auto &ellipsoid : *ellipsoids)
   {
-    generate_ellipsoid(i);
+    expandBounds(ellipsoid.pos, ellipsoid.extents, ellipsoids_min, ellipsoids_max);
   }
-  for (size_t i = 0; i < ellipsoids->size(); ++i)
+  if (bounds_min)
   {
-    Ellipsoid &ellipsoid = (*ellipsoids)[i];
-    const auto ellipsoid_min = ellipsoid.pos - ellipsoid.extents.cast<double>();
-    const auto ellipsoid_max = ellipsoid.pos + ellipsoid.extents.cast<double>();
+    *bounds_min = ellipsoids_min;
+  }
+  if (bounds_max)
+  {
+    *bounds_max = ellipsoids_max;
+  }
+}
 
-    ellipsoids_min.x() = std::min(ellipsoids_min.x(), ellipsoid_min.x());
-    ellipsoids_min.y() = std::min(ellipsoids_min.y(), ellipsoid_min.y());
-    ellipsoids_min.z() = std::min(ellipsoids_min.z(), ellipsoid_min.z());
-    ellipsoids_max.x() = std::max(ellipsoids_max.x(), ellipsoid_max.x());
-    ellipsoids_max.y() = std::max(ellipsoids_max.y(), ellipsoid_max.y());
-    ellipsoids_max.z() = std::max(ellipsoids_max.z(), ellipsoid_max.z());
+void generateEllipsoids(EllipsoidStore *store, Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max,
+                        const Cloud &cloud, Progress *progress)
+{
+  store->clear();
+  const uint32_t no_slot = std::numeric_limits<uint32_t>::max();
+  std::vector<uint32_t> slots(cloud.rayCount(), no_slot);  // the store index of each bounded ray
+  for (size_t i = 0; i < cloud.rayCount(); i++)
+  {
+    if (cloud.rayBounded(i))
+    {
+      slots[i] = static_cast<uint32_t>(store->ray_ids.size());
+      store->ray_ids.push_back(static_cast<uint32_t>(i));
+    }
   }
-#endif  // RAYLIB_WITH_TBB
+
+  CompactEllipsoid empty;
+  empty.pos = empty.extents = Eigen::Vector3f::Zero();
+  empty.eigen_mat = Eigen::Matrix3f::Identity();
+  empty.opacity = 1.0f;
+  empty.num_rays = empty.num_gone = 0;
+  empty.transient = false;
+  empty.block = 0;
+  store->ellipsoids.resize(store->ray_ids.size(), empty);
+
+  // Each ellipsoid is placed in the block containing its ray end. The blocks are widened until they can be indexed
+  // in 16 bits, which only happens for clouds many kilometres across
+  const size_t max_blocks = static_cast<size_t>(std::numeric_limits<uint16_t>::max()) + 1;
+  VoxelMap<uint16_t> block_of_cell;
+  for (double block_width = 128.0;; block_width *= 2.0)
+  {
+    block_of_cell.clear();
+    store->origins.clear();
+    size_t j = 0;
+    for (; j < store->ray_ids.size(); j++)
+    {
+      const Eigen::Vector3d cell = (cloud.ends[store->ray_ids[j]] / block_width).array().floor();
+      const Eigen::Vector3i index = cell.cast<int>();
+      if (!block_of_cell.find(index))
+      {
+        if (store->origins.size() == max_blocks)
+        {
+          break;
+        }
+        block_of_cell.insert(index, static_cast<uint16_t>(store->origins.size()));
+        store->origins.push_back((cell + Eigen::Vector3d(0.5, 0.5, 0.5)) * block_width);
+      }
+      store->ellipsoids[j].block = *block_of_cell.find(index);
+    }
+    if (j == store->ray_ids.size())
+    {
+      break;
+    }
+  }
+
+  fitEllipsoids(cloud, progress,
+                [store, &slots](size_t i, const Eigen::Vector3d &centroid, const Eigen::Matrix3f &eigen_mat,
+                                const Eigen::Vector3f &extents)  //
+                {
+                  CompactEllipsoid &ellipsoid = store->ellipsoids[slots[i]];
+                  ellipsoid.pos = (centroid - store->origins[ellipsoid.block]).cast<float>();
+                  ellipsoid.eigen_mat = eigen_mat;
+                  ellipsoid.extents = extents;
+                });
+
+  // remove the bounded rays that had too few neighbours to fit an ellipsoid
+  const double max_double = std::numeric_limits<double>::max();
+  Eigen::Vector3d ellipsoids_min(max_double, max_double, max_double);
+  Eigen::Vector3d ellipsoids_max(-max_double, -max_double, -max_double);
+  size_t num_kept = 0;
+  for (size_t j = 0; j < store->ellipsoids.size(); j++)
+  {
+    if (store->ellipsoids[j].extents == Eigen::Vector3f::Zero())
+    {
+      continue;
+    }
+    store->ellipsoids[num_kept] = store->ellipsoids[j];
+    store->ray_ids[num_kept] = store->ray_ids[j];
+    expandBounds(store->position(num_kept), store->ellipsoids[num_kept].extents, ellipsoids_min, ellipsoids_max);
+    num_kept++;
+  }
+  store->ellipsoids.resize(num_kept);
+  store->ray_ids.resize(num_kept);
+  store->ellipsoids.shrink_to_fit();
+  store->ray_ids.shrink_to_fit();
 
   if (bounds_min)
   {
     *bounds_min = ellipsoids_min;
   }
-
   if (bounds_max)
   {
     *bounds_max = ellipsoids_max;
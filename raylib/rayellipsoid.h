@@ -11,6 +11,7 @@
 #include <Eigen/Dense>
 
 #include <cmath>
+#include <cstdint>
 #include <vector>
 
 namespace ray
@@ -43,11 +44,113 @@ public:
   IntersectResult intersect(const Eigen::Vector3d &start, const Eigen::Vector3d &end) const;
 };
 
+/// A compact form of @c Ellipsoid, for storing the ellipsoids of large clouds. The position is single precision,
+/// relative to the origin of its block in the @c EllipsoidStore that holds it, and the ray counts are 32 bit.
+class RAYLIB_EXPORT CompactEllipsoid
+{
+public:
+  Eigen::Vector3f pos;  ///< position relative to the origin of its block
+  Eigen::Matrix3f eigen_mat;  // each row is a scaled eigenvector
+  Eigen::Vector3f extents;
+  float opacity;  ///< A representation of certainty of this ellipsoid.
+  uint32_t num_rays;
+  uint32_t num_gone;
+  bool transient;
+  uint16_t block;  ///< index of the block origin in the store
+
+  IntersectResult intersect(const Eigen::Vector3d &start, const Eigen::Vector3d &end,
+                            const Eigen::Vector3d &origin) const;
+};
+
+/// The ellipsoids of a cloud, stored only for the rays that have one: the bounded rays with enough neighbours.
+/// The rays without an ellipsoid have an opacity of 1 and no pass through rays, and are never transient.
+/// Space is divided into coarse blocks, and each ellipsoid position is relative to the centre of its block, so the
+/// single precision positions are as accurate in a large cloud as in a small one.
+struct RAYLIB_EXPORT EllipsoidStore
+{
+  std::vector<Eigen::Vector3d> origins;  ///< the origin of each block
+  std::vector<CompactEllipsoid> ellipsoids;
+  std::vector<uint32_t> ray_ids;  ///< the ray index of each ellipsoid, in increasing order
+
+  inline size_t size() const { return ellipsoids.size(); }
+  /// The origin that the position of ellipsoid @c i is relative to
+  inline const Eigen::Vector3d &origin(size_t i) const { return origins[ellipsoids[i].block]; }
+  inline Eigen::Vector3d position(size_t i) const { return origin(i) + ellipsoids[i].pos.cast<double>(); }
+  void clear()
+  {
+    origins.clear();
+    ellipsoids.clear();
+    ray_ids.clear();
+  }
+};
+
+/// Bounding volume hierarchy over the axis-aligned boxes of the ellipsoids in an @c EllipsoidStore. This finds the
+/// ellipsoids that a ray may intersect without voxelising the rays, which is cheaper when the rays are long compared
+/// to the ellipsoid spacing.
+class RAYLIB_EXPORT EllipsoidBvh
+{
+public:
+  /// Build the hierarchy over the ellipsoids of @c store . It must be rebuilt if the store changes
+  void build(const EllipsoidStore &store);
+
+  /// Calls @c func(ellipsoid_index) for each ellipsoid whose box is crossed by the ray from @c start to @c end
+  template <class Func>
+  void forEachOverlap(const Eigen::Vector3d &start, const Eigen::Vector3d &end, Func func) const;
+
+private:
+  struct Box
+  {
+    Eigen::Vector3f min;  ///< relative to the hierarchy's origin
+    Eigen::Vector3f max;
+  };
+  struct Node
+  {
+    Eigen::Vector3f box_min;  ///< relative to the hierarchy's origin
+    Eigen::Vector3f box_max;
+    uint32_t first;  ///< first ellipsoid of a leaf, or the index of the first of the two children
+    uint32_t count;  ///< number of ellipsoids in a leaf, or zero for an inner node
+  };
+  /// Set the box of node @c node_index over the @c count ellipsoids from @c first in the leaf order, and split it
+  void buildNode(uint32_t node_index, uint32_t first, uint32_t count);
+  /// Whether the segment at @c start with direction reciprocal @c inv_dir crosses the box, for the segment
+  /// parameter in [0,1]
+  static inline bool segmentCrossesBox(const Eigen::Vector3f &start, const Eigen::Vector3f &inv_dir,
+                                       const Eigen::Vector3f &box_min, const Eigen::Vector3f &box_max)
+  {
+    const Eigen::Vector3f t0 = (box_min - start).cwiseProduct(inv_dir);
+    const Eigen::Vector3f t1 = (box_max - start).cwiseProduct(inv_dir);
+    const float t_near = std::max(0.0f, t0.cwiseMin(t1).maxCoeff());
+    const float t_far = std::min(1.0f, t0.cwiseMax(t1).minCoeff());
+    return t_near <= t_far;
+  }
+
+  Eigen::Vector3d origin_ = Eigen::Vector3d::Zero();  ///< the centre of the ellipsoid bounds
+  std::vector<Box> boxes_;  ///< box of each ellipsoid, rounded outwards to single precision
+  std::vector<Node> nodes_;
+  std::vector<uint32_t> ellipsoid_ids_;  ///< ellipsoid indices, in leaf order
+};
+
 /// Convert the cloud into a list of ellipsoids, which represent a volume around each cloud point,
 /// shaped by the distribution of its neighbouring points.
 void RAYLIB_EXPORT generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bounds_min,
                                       Eigen::Vector3d *bounds_max, const Cloud &cloud, Progress *progress = nullptr);
 
+/// Compact form of generateEllipsoids, storing only the rays that have an ellipsoid. The bounds are those of the
+/// stored ellipsoids.
+void RAYLIB_EXPORT generateEllipsoids(EllipsoidStore *store, Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max,
+                                      const Cloud &cloud, Progress *progress = nullptr);
+
+/// Batched form of @c intersectEllipsoid, for the rays of @c cloud with ids @c ray_ids, which are intersected with
+/// the ellipsoid in packets using single precision vector arithmetic. The ray coordinates are taken relative to @c pos
+/// so there is little loss of precision. @c results is set to the intersection result of each ray in @c ray_ids .
+void RAYLIB_EXPORT intersectEllipsoidBatch(const Eigen::Vector3d &pos, const Eigen::Matrix3f &eigen_mat,
+                                           const Cloud &cloud, const std::vector<unsigned> &ray_ids,
+                                           std::vector<IntersectResult> &results);
+
+/// Intersection of the ray from @c start to @c end with the ellipsoid at @c pos with scaled eigenvectors @c eigen_mat
+inline IntersectResult intersectEllipsoid(const Eigen::Vector3d &pos, const Eigen::Matrix3f &eigen_mat,
+                                          const Eigen::Vector3d &start, const Eigen::Vector3d &end);
+
 inline void Ellipsoid::clear()
 {
   pos = Eigen::Vector3d::Zero();
@@ -59,7 +162,8 @@ inline void Ellipsoid::clear()
   transient = false;
 }
 
-inline void Ellipsoid::setExtents(const Eigen::Matrix3d &vecs, const Eigen::Vector3d &vals)
+/// The axis-aligned half-extents of the ellipsoid with eigenvectors @c vecs and radii @c vals
+inline Eigen::Vector3f ellipsoidExtents(const Eigen::Matrix3d &vecs, const Eigen::Vector3d &vals)
 {
   // This is approximate (slightly larger than minimal bounds), but
   // an exact bounding box is most likely non-analytic, and expensive to compute
@@ -67,12 +171,69 @@ inline void Ellipsoid::setExtents(const Eigen::Matrix3d &vecs, const Eigen::Vect
   const Eigen::Vector3d &x = vecs.col(0);
   const Eigen::Vector3d &y = vecs.col(1);
   const Eigen::Vector3d &z = vecs.col(2);
+  Eigen::Vector3f extents;
   extents[0] = static_cast<float>(std::min(max_rr, std::abs(x[0]) * vals[0] + std::abs(y[0]) * vals[1] + std::abs(z[0]) * vals[2]));
   extents[1] = static_cast<float>(std::min(max_rr, std::abs(x[1]) * vals[0] + std::abs(y[1]) * vals[1] + std::abs(z[1]) * vals[2]));
   extents[2] = static_cast<float>(std::min(max_rr, std::abs(x[2]) * vals[0] + std::abs(y[2]) * vals[1] + std::abs(z[2]) * vals[2]));
+  return extents;
+}
+
+inline void Ellipsoid::setExtents(const Eigen::Matrix3d &vecs, const Eigen::Vector3d &vals)
+{
+  extents = ellipsoidExtents(vecs, vals);
 }
 
 inline IntersectResult Ellipsoid::intersect(const Eigen::Vector3d &start, const Eigen::Vector3d &end) const
+{
+  return intersectEllipsoid(pos, eigen_mat, start, end);
+}
+
+inline IntersectResult CompactEllipsoid::intersect(const Eigen::Vector3d &start, const Eigen::Vector3d &end,
+                                                   const Eigen::Vector3d &origin) const
+{
+  return intersectEllipsoid(origin + pos.cast<double>(), eigen_mat, start, end);
+}
+
+template <class Func>
+void EllipsoidBvh::forEachOverlap(const Eigen::Vector3d &start, const Eigen::Vector3d &end, Func func) const
+{
+  if (nodes_.empty())
+  {
+    return;
+  }
+  const Eigen::Vector3f start_f = (start - origin_).cast<float>();
+  const Eigen::Vector3f dir = (end - start).cast<float>();
+  // a zero direction component gives an infinite reciprocal, which the slab test handles
+  const Eigen::Vector3f inv_dir(1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2]);
+  uint32_t stack[64];
+  int stack_size = 0;
+  stack[stack_size++] = 0;
+  while (stack_size > 0)
+  {
+    const Node &node = nodes_[stack[--stack_size]];
+    if (!segmentCrossesBox(start_f, inv_dir, node.box_min, node.box_max))
+    {
+      continue;
+    }
+    if (node.count == 0)
+    {
+      stack[stack_size++] = node.first;
+      stack[stack_size++] = node.first + 1;
+      continue;
+    }
+    for (uint32_t i = node.first; i < node.first + node.count; i++)
+    {
+      const uint32_t id = ellipsoid_ids_[i];
+      if (segmentCrossesBox(start_f, inv_dir, boxes_[id].min, boxes_[id].max))
+      {
+        func(id);
+      }
+    }
+  }
+}
+
+inline IntersectResult intersectEllipsoid(const Eigen::Vector3d &pos, const Eigen::Matrix3f &eigen_mat,
+                                          const Eigen::Vector3d &start, const Eigen::Vector3d &end)
 {
   Eigen::Matrix3d eigen_matd = eigen_mat.cast<double>();
   const Eigen::Vector3d dir = end - start;
@@ -97,6 +258,12 @@ inline IntersectResult Ellipsoid::intersect(const Eigen::Vector3d &start, const
   {
     return IntersectResult::Miss;
   }
+  // The ray's line can cross an ellipsoid that lies wholly behind its start. The ray never reaches it, so it is a miss
+  // rather than a pass through, which would depend on which candidate rays the ray grid or BVH query returns
+  if (d + along_dist < 0.0)  // the ellipsoid is behind the ray start
+  {
+    return IntersectResult::Miss;
+  }
 
   const double pass_distance = 0.05;
   double ratio = pass_distance / dir.norm();
@@ -4,7 +4,9 @@
 //
 // Author: Thomas Lowe
 #include "rayforeststructure.h"
+#include "raycloudwriter.h"
 // #define OUTPUT_MOMENTS  // used in unit tests
+#include <algorithm>
 #include <unordered_map>
 #include <complex>
 
@@ -379,80 +381,189 @@ bool ForestStructure::save(const std::string &filename)
   return true;
 }
 
-void ForestStructure::splitCloud(const Cloud &cloud, double offset, Cloud &inside, Cloud &outside)
+namespace
+{
+/// The cylinder of a tree segment, lengthened and widened by the split offset
+struct SegmentCylinder
 {
-  // first implementation is gonna be slow I guess... 
-  // I could either grid up the cylinder indices, or I could grid up the point indices.... I wonder what is better...
-  // points are easier in that they have no width... 
-  double voxel_width = 0.2; // TODO: where to get grid cell size from
-  Eigen::Vector3d minbound = cloud.calcMinBound();
-  Grid<int> grid(minbound, cloud.calcMaxBound(), voxel_width); 
-  // fill the acceleration structure
-  for (size_t i = 0; i<cloud.ends.size(); i++)
+  Eigen::Vector3d base;
+  Eigen::Vector3d dir;
+  double length;
+  double radius;
+
+  inline bool contains(const Eigen::Vector3d &p) const
   {
-    if (!cloud.rayBounded(i))
+    const double d = (p - base).dot(dir);
+    if (d < 0 || d > length)
     {
-      continue;
+      return false;
     }
-    grid.insert(grid.index(cloud.ends[i]), (int)i);
+    return (p - (base + dir * d)).squaredNorm() < radius * radius;
   }
+};
 
-  // now find all ends that we can remove on a per-segment basis:
-  std::vector<bool> remove(cloud.ends.size(), false);
-  for (auto &tree: trees)
+/// Sparse voxel index of the cylinders of all tree segments, used to test whether points lie within any segment.
+/// Its size depends only on the forest structure, so clouds of any size can be streamed through it.
+class SegmentIndex
+{
+public:
+  SegmentIndex(const std::vector<TreeStructure> &trees, double offset)
   {
-    for (auto &segment: tree.segments())
+    double total_extent = 0.0;
+    for (auto &tree : trees)
     {
-      if (segment.parent_id != -1)
+      for (auto &segment : tree.segments())
       {
-        Eigen::Vector3d pos1 = tree.segments()[segment.parent_id].tip;
-        Eigen::Vector3d pos2 = segment.tip;
-        double r = segment.radius;
-        Eigen::Vector3d dir = (pos2 - pos1).normalized();
-        pos1 -= dir*offset;
-        pos2 += dir*offset;
-        r += offset;
-        double len = (pos2 - pos1).norm();
-        Eigen::Vector3d one(1,1,1);
-        Eigen::Vector3i minindex = grid.index(minVector(pos1, pos2) - r*one);
-        Eigen::Vector3i maxindex = grid.index(maxVector(pos1, pos2) + r*one);
-        for (int i = minindex[0]; i<=maxindex[0]; i++)
+        if (segment.parent_id == -1)
         {
-          for (int j = minindex[1]; j<=maxindex[1]; j++)
+          continue;
+        }
+        SegmentCylinder cylinder;
+        const Eigen::Vector3d parent_tip = tree.segments()[segment.parent_id].tip;
+        cylinder.dir = segment.tip - parent_tip;
+        const double segment_length = cylinder.dir.norm();
+        cylinder.radius = segment.radius + offset;
+        // a segment thinner than a negative offset encloses no points, rather than those within |radius + offset|
+        if (!(segment_length > 0.0) || cylinder.radius <= 0.0)
+        {
+          continue;
+        }
+        cylinder.dir /= segment_length;
+        cylinder.base = parent_tip - cylinder.dir * offset;
+        cylinder.length = segment_length + 2.0 * offset;
+        cylinders_.push_back(cylinder);
+        total_extent += std::max(cylinder.length, 2.0 * cylinder.radius);
+      }
+    }
+    if (cylinders_.empty())
+    {
+      return;
+    }
+    // voxels of about the size of a typical segment keep both the candidates per point and the voxels per segment low
+    voxel_width_ = std::max(total_extent / (double)cylinders_.size(), 1e-3);
+
+    // list the voxels overlapped by each cylinder's bounding box, then group the cylinder ids per voxel
+    std::vector<std::pair<Eigen::Vector3i, int>> voxel_cylinders;
+    for (int c = 0; c < (int)cylinders_.size(); c++)
+    {
+      const SegmentCylinder &cylinder = cylinders_[c];
+      const Eigen::Vector3d tip = cylinder.base + cylinder.dir * cylinder.length;
+      const Eigen::Vector3d rad(cylinder.radius, cylinder.radius, cylinder.radius);
+      const Eigen::Vector3i minindex = voxelIndex(minVector(cylinder.base, tip) - rad, voxel_width_);
+      const Eigen::Vector3i maxindex = voxelIndex(maxVector(cylinder.base, tip) + rad, voxel_width_);
+      for (int i = minindex[0]; i <= maxindex[0]; i++)
+      {
+        for (int j = minindex[1]; j <= maxindex[1]; j++)
+        {
+          for (int k = minindex[2]; k <= maxindex[2]; k++)
           {
-            for (int k = minindex[2]; k<=maxindex[2]; k++)
-            {
-              auto &cell = grid.cell(i,j,k);
-              for (auto id: cell.data)
-              {
-                // intersect the point cloud.ends[id] with segment:
-                const Eigen::Vector3d &p = cloud.ends[id];
-                double d = (p - pos1).dot(dir);
-                if (d < 0 || d > len)
-                {
-                  continue;
-                }
-                Eigen::Vector3d closest = pos1 + dir*d;
-                double r2 = (p - closest).squaredNorm();
-                if (r2 < r*r) // inside the cylinder
-                {
-                  remove[id] = true;
-                }
-              }
-            }
+            voxel_cylinders.push_back(std::make_pair(Eigen::Vector3i(i, j, k), c));
           }
         }
       }
     }
+    std::sort(voxel_cylinders.begin(), voxel_cylinders.end(),
+              [](const std::pair<Eigen::Vector3i, int> &a, const std::pair<Eigen::Vector3i, int> &b) {
+                if (a.first[0] != b.first[0])
+                  return a.first[0] < b.first[0];
+                if (a.first[1] != b.first[1])
+                  return a.first[1] < b.first[1];
+                if (a.first[2] != b.first[2])
+                  return a.first[2] < b.first[2];
+                return a.second < b.second;
+              });
+    voxel_cylinder_ids_.resize(voxel_cylinders.size());
+    for (size_t i = 0; i < voxel_cylinders.size(); i++)
+    {
+      voxel_cylinder_ids_[i] = voxel_cylinders[i].second;
+      if (i == 0 || voxel_cylinders[i].first != voxel_cylinders[i - 1].first)
+      {
+        voxels_.insert(voxel_cylinders[i].first, std::make_pair((int)i, (int)i));
+      }
+      voxels_.find(voxel_cylinders[i].first)->second = (int)i + 1;
+    }
   }
 
-  for (size_t i = 0; i<cloud.ends.size(); i++)
+  /// whether @c point is inside any of the segment cylinders
+  bool contains(const Eigen::Vector3d &point) const
   {
-    Cloud &dest = remove[i] ? inside : outside;
+    if (cylinders_.empty())
+    {
+      return false;
+    }
+    const std::pair<int, int> *range = voxels_.find(voxelIndex(point, voxel_width_));
+    if (!range)
+    {
+      return false;
+    }
+    for (int i = range->first; i < range->second; i++)
+    {
+      if (cylinders_[voxel_cylinder_ids_[i]].contains(point))
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  std::vector<SegmentCylinder> cylinders_;
+  double voxel_width_ = 1.0;
+  VoxelMap<std::pair<int, int>> voxels_;  // range of voxel_cylinder_ids_ for each occupied voxel
+  std::vector<int> voxel_cylinder_ids_;
+};
+}  // namespace
+
+void ForestStructure::splitCloud(const Cloud &cloud, double offset, Cloud &inside, Cloud &outside)
+{
+  const SegmentIndex segments(trees, offset);
+  std::vector<uint8_t> is_inside(cloud.ends.size());
+  #pragma omp parallel for schedule(dynamic, 1024)
+  for (int i = 0; i < (int)cloud.ends.size(); i++)
+  {
+    is_inside[i] = cloud.rayBounded(i) && segments.contains(cloud.ends[i]);
+  }
+  for (size_t i = 0; i < cloud.ends.size(); i++)
+  {
+    Cloud &dest = is_inside[i] ? inside : outside;
     dest.addRay(cloud.starts[i], cloud.ends[i], cloud.times[i], cloud.colours[i]);
   }
 }
 
+bool ForestStructure::splitCloud(const std::string &cloud_name, double offset, const std::string &inside_name,
+                                 const std::string &outside_name)
+{
+  const SegmentIndex segments(trees, offset);
+  CloudWriter in_cloud, out_cloud;
+  if (!in_cloud.begin(inside_name) || !out_cloud.begin(outside_name))
+    return false;
+
+  std::vector<uint8_t> is_inside;
+  Cloud in_chunk, out_chunk;
+  auto split_chunk = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                         std::vector<double> &times, std::vector<RGBA> &colours) {
+    is_inside.resize(ends.size());
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (int i = 0; i < (int)ends.size(); i++)
+    {
+      is_inside[i] = colours[i].alpha > 0 && segments.contains(ends[i]);
+    }
+    in_chunk.clear();
+    out_chunk.clear();
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+      Cloud &dest = is_inside[i] ? in_chunk : out_chunk;
+      dest.addRay(starts[i], ends[i], times[i], colours[i]);
+    }
+    in_cloud.writeChunk(in_chunk);
+    out_cloud.writeChunk(out_chunk);
+  };
+  const bool read_ok = Cloud::read(cloud_name, split_chunk);
+  in_cloud.end();
+  out_cloud.end();
+  return read_ok;
+}
+
 // add a single section of a capsule. Each one is like a node in the polyline with a radius.
 void addCapsulePiece(Mesh &mesh, int wind, const Eigen::Vector3d &pos, const Eigen::Vector3d &side1,
                      const Eigen::Vector3d &side2, double radius, const RGBA &rgba, bool cap_start, bool cap_end, bool add_uvs)
@@ -23,7 +23,12 @@ struct RAYLIB_EXPORT ForestStructure
   bool save(const std::string &filename);
   bool trunksOnly() { return trees.size() > 0 && trees[0].segments().size() == 1; }
   Eigen::Array<double, 9, 1> getMoments() const;
+  /// split @c cloud into the rays whose end points are within @c offset of the tree segments, and the rest
   void splitCloud(const Cloud &cloud, double offset, Cloud &inside, Cloud &outside);
+  /// chunk-loaded form of splitCloud, which streams the cloud in @c cloud_name to the files @c inside_name and
+  /// @c outside_name
+  bool splitCloud(const std::string &cloud_name, double offset, const std::string &inside_name,
+                  const std::string &outside_name);
   void generateSmoothMesh(Mesh &mesh, int red_id, double red_scale,
                           double green_scale, double blue_scale, bool add_uvs = false);
   /// reindex the segments to remove any disconnected segments, and order from root to tips
@@ -0,0 +1,189 @@
+// Copyright (c) 2026
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYHASHMAP_H
+#define RAYLIB_RAYHASHMAP_H
+
+#include "raylib/raylibconfig.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace ray
+{
+/// The value type of a HashMap that is used as a set. It takes no space in the table
+struct NoValue
+{
+};
+
+/// Map from keys to values of type T, stored in an open-addressing (linear probing) hash table. @c Hash is a function
+/// object giving a well mixed hash of a key, whose low bits select the slot. Unlike a std::map or std::unordered_map
+/// there is no allocation per element and a lookup is typically a single cache miss, which matters when every point or
+/// ray of a large cloud is looked up. Each slot is stamped with the generation that filled it, so clearing the map
+/// takes constant time and keeps its capacity. Iteration order is unspecified. For a set, T is NoValue.
+template <class Key, class T, class Hash>
+class HashMap
+{
+public:
+  HashMap(size_t expected_size = 0) { reserve(expected_size); }
+
+  /// The value at @c key, or nullptr if it is not present
+  inline T *find(const Key &key)
+  {
+    if (entries_.empty())
+    {
+      return nullptr;
+    }
+    Entry &entry = entries_[slot(key)];
+    return occupied(entry) ? &entry.value() : nullptr;
+  }
+  inline const T *find(const Key &key) const { return const_cast<HashMap<Key, T, Hash> *>(this)->find(key); }
+
+  /// Insert @c value at @c key if the key is not already present. Returns the stored value, and whether the
+  /// insertion took place
+  inline std::pair<T *, bool> insert(const Key &key, const T &value)
+  {
+    // keep the load factor at or below 1/2, so that probe sequences stay short
+    if (2 * (size_ + 1) > entries_.size())
+    {
+      rehash(std::max<size_t>(16, 2 * entries_.size()));
+    }
+    Entry &entry = entries_[slot(key)];
+    if (occupied(entry))
+    {
+      return std::make_pair(&entry.value(), false);
+    }
+    entry.key = key;
+    entry.value() = value;
+    entry.generation = generation_;
+    size_++;
+    return std::make_pair(&entry.value(), true);
+  }
+
+  /// The value at @c key, which is default constructed if not present
+  inline T &operator[](const Key &key) { return *insert(key, T()).first; }
+
+  /// Remove @c key from the map. Returns true if it was present
+  bool erase(const Key &key)
+  {
+    if (entries_.empty())
+    {
+      return false;
+    }
+    size_t index = slot(key);
+    if (!occupied(entries_[index]))
+    {
+      return false;
+    }
+    // shift later entries of the probe sequence back into the gap, so that no tombstones are needed
+    const size_t mask = entries_.size() - 1;
+    for (size_t next = (index + 1) & mask; occupied(entries_[next]); next = (next + 1) & mask)
+    {
+      const size_t home = Hash()(entries_[next].key) & mask;
+      // the entry can move into the gap unless its home slot lies cyclically within (index, next]
+      const bool stays = index <= next ? (index < home && home <= next) : (index < home || home <= next);
+      if (!stays)
+      {
+        entries_[index] = std::move(entries_[next]);
+        index = next;
+      }
+    }
+    entries_[index].generation = 0;
+    size_--;
+    return true;
+  }
+
+  /// Calls @c func(key, value) on every stored key
+  template <class Func>
+  void forEach(Func func) const
+  {
+    for (const auto &entry : entries_)
+    {
+      if (occupied(entry))
+      {
+        func(entry.key, entry.value());
+      }
+    }
+  }
+
+  /// Ensure that @c count keys can be stored without rehashing
+  void reserve(size_t count)
+  {
+    size_t capacity = 16;
+    while (capacity < 2 * count) capacity *= 2;
+    if (capacity > entries_.size())
+    {
+      rehash(capacity);
+    }
+  }
+  inline size_t size() const { return size_; }
+  inline bool empty() const { return size_ == 0; }
+  /// Remove all keys, in constant time
+  void clear()
+  {
+    size_ = 0;
+    if (++generation_ == 0)  // the generation has wrapped around, so old stamps could match it
+    {
+      for (auto &entry : entries_) entry.generation = 0;
+      generation_ = 1;
+    }
+  }
+
+private:
+  /// Holds the value of an entry, or for an empty value type, derives from it so that it takes no space
+  template <class V, bool empty = std::is_empty<V>::value>
+  struct ValueHolder
+  {
+    V value_;
+    inline V &value() { return value_; }
+    inline const V &value() const { return value_; }
+  };
+  template <class V>
+  struct ValueHolder<V, true> : V
+  {
+    inline V &value() { return *this; }
+    inline const V &value() const { return *this; }
+  };
+  struct Entry : ValueHolder<T>
+  {
+    Key key;
+    uint32_t generation = 0;  // the entry is occupied when this matches the map's generation
+  };
+
+  inline bool occupied(const Entry &entry) const { return entry.generation == generation_; }
+
+  /// The slot holding @c key, or the empty slot where it would be inserted
+  inline size_t slot(const Key &key) const
+  {
+    const size_t mask = entries_.size() - 1;
+    size_t index = Hash()(key) & mask;
+    while (occupied(entries_[index]) && !(entries_[index].key == key)) index = (index + 1) & mask;
+    return index;
+  }
+
+  void rehash(size_t capacity)
+  {
+    std::vector<Entry> old_entries(capacity);
+    old_entries.swap(entries_);
+    for (auto &entry : old_entries)
+    {
+      if (occupied(entry))
+      {
+        entries_[slot(entry.key)] = std::move(entry);
+      }
+    }
+  }
+
+  std::vector<Entry> entries_;
+  size_t size_ = 0;
+  uint32_t generation_ = 1;
+};
+
+}  // namespace ray
+
+#endif  // RAYLIB_RAYHASHMAP_H
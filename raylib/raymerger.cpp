@@ -6,45 +6,58 @@
 #include "raymerger.h"
 
 #include "raygrid.h"
+#include "rayhashmap.h"
 #include "rayprogress.h"
 #include "rayunused.h"
 
 #if RAYLIB_WITH_TBB
 #include <tbb/enumerable_thread_specific.h>
 #include <tbb/parallel_for.h>
+#elif defined(_OPENMP)
+#include <omp.h>
 #endif  // RAYLIB_WITH_TBB
 
 #include <algorithm>
+#include <cmath>
 #include <iomanip>
 #include <iostream>
-#include <set>
+#include <limits>
 
-#if RAYLIB_WITH_TBB
+#if RAYLIB_WITH_TBB || RAYLIB_WITH_OPENMP
 // With threads we use std::atomic_bool for the transient marks. These are default initialised to false. No additional
 // argument required
 #define MARKER_BOOL_INIT
-#else  // RAYLIB_WITH_TBB
+#else  // RAYLIB_WITH_TBB || RAYLIB_WITH_OPENMP
 // Without threads, we use bool for the transient marks. There is no default construction, so we must provide the
 // initialisation argument
 #define MARKER_BOOL_INIT , false
-#endif  // RAYLIB_WITH_TBB
+#endif  // RAYLIB_WITH_TBB || RAYLIB_WITH_OPENMP
 
 namespace ray
 {
+/// Hash function object for ray ids, using the Fibonacci multiplier to spread consecutive ids across the slots
+struct RayIdHash
+{
+  inline size_t operator()(unsigned ray_id) const
+  {
+    return static_cast<size_t>((static_cast<uint64_t>(ray_id) * 0x9E3779B97F4A7C15ull) >> 32);
+  }
+};
+
+/// The set of rays already visited while gathering the rays near one ellipsoid. It is cleared in constant time for
+/// each ellipsoid, and its size follows the number of rays near an ellipsoid, rather than the number of rays in the
+/// cloud.
+using VisitedRays = HashMap<unsigned, NoValue, RayIdHash>;
+
 class EllipsoidTransientMarker
 {
 public:
-  EllipsoidTransientMarker(size_t ray_count)
-    : ray_tested(ray_count, false)
-  {}
-  EllipsoidTransientMarker(const EllipsoidTransientMarker &other)
-    : ray_tested(other.ray_tested.size(), false)
-  {}
-
   /// Test a single @p ellipsoid against the @p ray_grid and resolve whether it should be marked as traisient.
   /// The @p ellipsoid is considered transient if sufficient rays pass through or near it.
   ///
   /// @param ellipsoid The ellipsoid to check for transient marks.
+  /// @param origin The origin that the @p ellipsoid position is relative to.
+  /// @param ellipsoid_time The time of the ray that generated the @p ellipsoid.
   /// @param transient_ray_marks Array marking which rays from @p cloud are transient and should be removed.
   /// @param ray_grid The voxelised representation of @p cloud .
   /// @param num_rays Thresholding value indicating the number of nearby rays required to mark the ellipsoid as
@@ -52,64 +65,102 @@ public:
   /// @param merge_type The merging strategy.
   /// @param self_transient True when the @p ellipsoid was generated from @p cloud and we are looking for transient
   /// points within this cloud.
-  void mark(Ellipsoid *ellipsoid, std::vector<Merger::Bool> *transient_ray_marks, const Cloud &cloud,
-            const Grid<unsigned> &ray_grid, double num_rays, MergeType merge_type, bool self_transient,
+  void mark(CompactEllipsoid *ellipsoid, const Eigen::Vector3d &origin, double ellipsoid_time,
+            std::vector<Merger::Bool> *transient_ray_marks, const Cloud &cloud, const Grid<unsigned> &ray_grid,
+            double num_rays, MergeType merge_type, bool self_transient, bool ellipsoid_cloud_first);
+
+  /// As above, but testing the @p num_ray_ids rays in @p ray_ids rather than gathering them from a ray grid.
+  void mark(CompactEllipsoid *ellipsoid, const Eigen::Vector3d &origin, double ellipsoid_time,
+            std::vector<Merger::Bool> *transient_ray_marks, const Cloud &cloud, const unsigned *ray_ids,
+            size_t num_ray_ids, double num_rays, MergeType merge_type, bool self_transient,
             bool ellipsoid_cloud_first);
 
 private:
+  /// Test the gathered @c test_ray_ids against the @p ellipsoid and mark the transients
+  void markTested(CompactEllipsoid *ellipsoid, const Eigen::Vector3d &pos, double ellipsoid_time,
+                  std::vector<Merger::Bool> *transient_ray_marks, const Cloud &cloud, double num_rays,
+                  MergeType merge_type, bool self_transient, bool ellipsoid_cloud_first);
+
   // Working memory.
 
-  /// Tracks which rays have been tested. Sized to match incoming cloud ray count.
-  std::vector<bool> ray_tested;
+  /// Tracks which rays have been gathered for the current ellipsoid.
+  VisitedRays ray_tested;
   /// Ids of ray to test.
   std::vector<unsigned> test_ray_ids;
+  /// The intersection result of each ray in @c test_ray_ids .
+  std::vector<IntersectResult> intersect_results;
   /// Ids of rays which intersect the ellipsoid with a @c IntersectResult::Passthrough result.
   std::vector<unsigned> pass_through_ids;
 };
 
-typedef Eigen::Matrix<double, 6, 1> Vector6i;
-class Vector6iLess
+// TODO: Make config value
+const double test_width = 0.01;  // allows a minor variation when checking for similarity of rays
+
+/// Mix the bits of @c x (the splitmix64 finaliser)
+inline uint64_t mixBits(uint64_t x)
 {
-public:
-  inline bool operator()(const Vector6i &a, const Vector6i &b) const
-  {
-    if (a[0] != b[0])
-      return a[0] < b[0];
-    if (a[1] != b[1])
-      return a[1] < b[1];
-    if (a[2] != b[2])
-      return a[2] < b[2];
-    if (a[3] != b[3])
-      return a[3] < b[3];
-    if (a[4] != b[4])
-      return a[4] < b[4];
-    return a[5] < b[5];
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+/// A 64-bit key for the ray from @c start to @c end, with both points quantised to @c test_width . Rays in the same
+/// pair of cells share a key, while rays in different cells share a key with negligible probability (about one in
+/// 2^64 per lookup)
+inline uint64_t quantisedRayKey(const Eigen::Vector3d &start, const Eigen::Vector3d &end)
+{
+  uint64_t key = 0;
+  for (int j = 0; j < 3; j++)
+  {
+    key = mixBits(key ^ static_cast<uint64_t>(static_cast<int64_t>(std::floor(start[j] / test_width))));
   }
+  for (int j = 0; j < 3; j++)
+  {
+    key = mixBits(key ^ static_cast<uint64_t>(static_cast<int64_t>(std::floor(end[j] / test_width))));
+  }
+  return key;
+}
+
+/// The quantised ray key of each ray in @c cloud
+void rayKeys(const Cloud &cloud, std::vector<uint64_t> &keys)
+{
+  keys.resize(cloud.rayCount());
+  const auto set_key = [&](size_t i) { keys[i] = quantisedRayKey(cloud.starts[i], cloud.ends[i]); };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for<size_t>(0u, keys.size(), set_key);
+#else   // RAYLIB_WITH_TBB
+  #pragma omp parallel for schedule(static)
+  for (int64_t i = 0; i < static_cast<int64_t>(keys.size()); i++)
+  {
+    set_key(static_cast<size_t>(i));
+  }
+#endif  // RAYLIB_WITH_TBB
+}
+
+/// Hash function object for quantised ray keys, which are already well mixed so are used directly
+struct RayKeyHash
+{
+  inline size_t operator()(uint64_t key) const { return static_cast<size_t>(key); }
 };
 
-// TODO: Make config value
-const double test_width = 0.01;  // allows a minor variation when checking for similarity of rays
+/// The set of quantised ray keys in a cloud, for quick lookup of whether a ray is present
+using RayKeySet = HashMap<uint64_t, NoValue, RayKeyHash>;
 
-void rayLookup(const Cloud *cloud, std::set<Vector6i, Vector6iLess> &ray_lookup)
+/// Insert the ray @c keys into @c key_set
+void buildRayKeySet(const std::vector<uint64_t> &keys, RayKeySet &key_set)
 {
-  for (size_t i = 0; i < cloud->rayCount(); i++)
+  key_set.reserve(keys.size());
+  for (const auto &key : keys)
   {
-    const Eigen::Vector3d &point = cloud->ends[i];
-    const Eigen::Vector3d &start = cloud->starts[i];
-    Vector6i ray;
-    for (int j = 0; j < 3; j++)
-    {
-      ray[j] = int(floor(start[j] / test_width));
-      ray[3 + j] = int(floor(point[j] / test_width));
-    }
-    if (ray_lookup.find(ray) == ray_lookup.end())
-      ray_lookup.insert(ray);
+    key_set.insert(key, NoValue());
   }
 }
 
-void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bool> *transient_ray_marks,
-                                    const Cloud &cloud, const Grid<unsigned> &ray_grid, double num_rays,
-                                    MergeType merge_type, bool self_transient, bool ellipsoid_cloud_first)
+void EllipsoidTransientMarker::mark(CompactEllipsoid *ellipsoid, const Eigen::Vector3d &origin, double ellipsoid_time,
+                                    std::vector<Merger::Bool> *transient_ray_marks, const Cloud &cloud,
+                                    const Grid<unsigned> &ray_grid, double num_rays, MergeType merge_type,
+                                    bool self_transient, bool ellipsoid_cloud_first)
 {
   if (ellipsoid->transient)
   {
@@ -123,18 +174,16 @@ void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bo
     return;
   }
 
-  if (ray_tested.size() != cloud.rayCount())
-  {
-    ray_tested.resize(cloud.rayCount(), false);
-  }
+  ray_tested.clear();
   test_ray_ids.clear();
   pass_through_ids.clear();
 
   // get all the rays that overlap this ellipsoid
+  const Eigen::Vector3d pos = origin + ellipsoid->pos.cast<double>();
   const Eigen::Vector3d ellipsoid_bounds_min =
-    (ellipsoid->pos - ellipsoid->extents.cast<double>() - ray_grid.box_min) / ray_grid.voxel_width;
+    (pos - ellipsoid->extents.cast<double>() - ray_grid.box_min) / ray_grid.voxel_width;
   const Eigen::Vector3d ellipsoid_bounds_max =
-    (ellipsoid->pos + ellipsoid->extents.cast<double>() - ray_grid.box_min) / ray_grid.voxel_width;
+    (pos + ellipsoid->extents.cast<double>() - ray_grid.box_min) / ray_grid.voxel_width;
 
   if (ellipsoid_bounds_max[0] < 0.0 || ellipsoid_bounds_max[1] < 0.0 || ellipsoid_bounds_max[2] < 0.0)
   {
@@ -161,25 +210,46 @@ void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bo
         auto &ray_list = ray_grid.cell(x, y, z).data;
         for (auto &ray_id : ray_list)
         {
-          if (ray_tested[ray_id])
+          if (ray_tested.insert(ray_id, NoValue()).second)
           {
-            continue;
+            test_ray_ids.push_back(ray_id);
           }
-          ray_tested[ray_id] = true;
-          test_ray_ids.push_back(ray_id);
         }
       }
     }
   }
+  markTested(ellipsoid, pos, ellipsoid_time, transient_ray_marks, cloud, num_rays, merge_type, self_transient,
+             ellipsoid_cloud_first);
+}
+
+void EllipsoidTransientMarker::mark(CompactEllipsoid *ellipsoid, const Eigen::Vector3d &origin, double ellipsoid_time,
+                                    std::vector<Merger::Bool> *transient_ray_marks, const Cloud &cloud,
+                                    const unsigned *ray_ids, size_t num_ray_ids, double num_rays,
+                                    MergeType merge_type, bool self_transient, bool ellipsoid_cloud_first)
+{
+  if (ellipsoid->transient || ellipsoid->extents == Eigen::Vector3f::Zero())
+  {
+    return;
+  }
+  test_ray_ids.assign(ray_ids, ray_ids + num_ray_ids);
+  pass_through_ids.clear();
+  markTested(ellipsoid, origin + ellipsoid->pos.cast<double>(), ellipsoid_time, transient_ray_marks, cloud, num_rays,
+             merge_type, self_transient, ellipsoid_cloud_first);
+}
 
+void EllipsoidTransientMarker::markTested(CompactEllipsoid *ellipsoid, const Eigen::Vector3d &pos,
+                                          double ellipsoid_time, std::vector<Merger::Bool> *transient_ray_marks,
+                                          const Cloud &cloud, double num_rays, MergeType merge_type,
+                                          bool self_transient, bool ellipsoid_cloud_first)
+{
   double first_intersection_time = std::numeric_limits<double>::max();
   double last_intersection_time = std::numeric_limits<double>::lowest();
   unsigned hits = 0;
-  for (auto &ray_id : test_ray_ids)
+  intersectEllipsoidBatch(pos, ellipsoid->eigen_mat, cloud, test_ray_ids, intersect_results);
+  for (size_t k = 0; k < test_ray_ids.size(); k++)
   {
-    ray_tested[ray_id] = false;
-
-    switch (ellipsoid->intersect(cloud.starts[ray_id], cloud.ends[ray_id]))
+    const unsigned ray_id = test_ray_ids[k];
+    switch (intersect_results[k])
     {
     default:
     case IntersectResult::Miss:
@@ -197,7 +267,7 @@ void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bo
   }
 
   size_t num_before = 0, num_after = 0;
-  ellipsoid->num_rays = hits + pass_through_ids.size();
+  ellipsoid->num_rays = static_cast<uint32_t>(hits + pass_through_ids.size());
   if (num_rays == 0 || self_transient)
   {
     ellipsoid->opacity = (float)hits / ((float)hits + (float)pass_through_ids.size());
@@ -208,7 +278,7 @@ void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bo
   }
   if (self_transient)
   {
-    ellipsoid->num_gone = pass_through_ids.size();
+    ellipsoid->num_gone = static_cast<uint32_t>(pass_through_ids.size());
     // now get some density stats...
     double misses = 0;
     for (auto &ray_id : pass_through_ids)
@@ -228,13 +298,13 @@ void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bo
     }
     double h = hits + 1e-8 - 1.0;  // subtracting 1 gives an unbiased opacity estimate
     ellipsoid->opacity = static_cast<float>(h / (h + misses));
-    ellipsoid->num_gone = num_before + num_after;
+    ellipsoid->num_gone = static_cast<uint32_t>(num_before + num_after);
   }
   else  // compare to other cloud
   {
     if (pass_through_ids.size() > 0)
     {
-      if (cloud.times[pass_through_ids[0]] > ellipsoid->time)
+      if (cloud.times[pass_through_ids[0]] > ellipsoid_time)
       {
         num_after = pass_through_ids.size();
       }
@@ -333,28 +403,102 @@ bool Merger::filter(const Cloud &cloud, Progress *progress)
 
   clear();
 
+  // Atomic do not support assignment and construction so we can't really retain the vector memory.
+  std::vector<Bool> transient_ray_marks(cloud.rayCount() MARKER_BOOL_INIT);
+  markSelfTransients(cloud, &transient_ray_marks, progress);
+
+  finaliseFilter(cloud, transient_ray_marks);
+
+  progress->end();
+
+  return true;
+}
+
+void Merger::filterTile(const Cloud &cloud, const std::vector<uint8_t> &owned, std::vector<uint8_t> &transient_marks,
+                        std::vector<RGBA> &colours, const Eigen::Vector3d *grid_origin, Progress *progress)
+{
+  Progress tracker;
+  if (!progress)
+  {
+    progress = &tracker;
+  }
+
+  clear();
+
+  std::vector<Bool> transient_ray_marks(cloud.rayCount() MARKER_BOOL_INIT);
+  markSelfTransients(cloud, &transient_ray_marks, progress, &owned, grid_origin);
+
+  transient_marks.resize(cloud.rayCount());
+  colours.resize(cloud.rayCount());
+  size_t e = 0;
+  for (size_t i = 0; i < cloud.rayCount(); i++)
+  {
+    const CompactEllipsoid *ellipsoid = ellipsoidOfRay(i, e);
+    transient_marks[i] = transient_ray_marks[i] || (owned[i] && ellipsoid && ellipsoid->transient);
+    colours[i] = owned[i] ? filterColour(cloud, i, ellipsoid) : cloud.colours[i];
+  }
+
+  progress->end();
+}
+
+Eigen::Vector3d Merger::tileGridOrigin(const Cloud &cloud, const std::vector<uint8_t> &owned, Progress *progress)
+{
+  clear();
+  generateCloudEllipsoids(cloud, nullptr, nullptr, progress);
+  const double max_double = std::numeric_limits<double>::max();
+  Eigen::Vector3d origin(max_double, max_double, max_double);
+  for (size_t e = 0; e < ellipsoids_.size(); e++)
+  {
+    if (owned[ellipsoids_.ray_ids[e]])
+    {
+      // as in the ellipsoid bounds of generateEllipsoids
+      origin = minVector(origin,
+                         Eigen::Vector3d(ellipsoids_.position(e) - ellipsoids_.ellipsoids[e].extents.cast<double>()));
+    }
+  }
+  return origin;
+}
+
+void Merger::markSelfTransients(const Cloud &cloud, std::vector<Bool> *transient_ray_marks, Progress *progress,
+                                const std::vector<uint8_t> *active, const Eigen::Vector3d *grid_origin)
+{
   Eigen::Vector3d bounds_min, bounds_max;
-  generateEllipsoids(&ellipsoids_, &bounds_min, &bounds_max, cloud, progress);
+  generateCloudEllipsoids(cloud, &bounds_min, &bounds_max, progress);
 
   const double voxel_size = voxelSizeForCloud(cloud);
   if (config_.voxel_size == 0)
   {
     std::cout << "estimated required voxel size: " << voxel_size << std::endl;
   }
+  if (useEllipsoidBvh(cloud, voxel_size, ellipsoids_.size()))
+  {
+    markIntersectedEllipsoids(cloud, cloud, nullptr, transient_ray_marks, config_.num_rays_filter_threshold, true,
+                              progress, false, active);
+    return;
+  }
 
+  // A tile's grid covers the rays as well as the ellipsoids, and is aligned to a lattice of the voxel size. So the
+  // voxels of any ellipsoid are the same in every tile that contains it, and the same as the whole cloud's grid when
+  // the lattice is from the whole cloud's grid origin
+  if (active)
+  {
+    for (size_t i = 0; i < cloud.rayCount(); i++)
+    {
+      bounds_min = minVector(bounds_min, minVector(cloud.starts[i], cloud.ends[i]));
+      bounds_max = maxVector(bounds_max, maxVector(cloud.starts[i], cloud.ends[i]));
+    }
+    const Eigen::Vector3d origin = grid_origin ? *grid_origin : Eigen::Vector3d::Zero();
+    for (int i = 0; i < 3; i++)
+    {
+      bounds_min[i] = origin[i] + std::floor((bounds_min[i] - origin[i]) / voxel_size) * voxel_size;
+    }
+  }
   Grid<unsigned> ray_grid(bounds_min, bounds_max, voxel_size);
   seedRayGrid(&ray_grid, cloud);
   fillRayGrid(&ray_grid, cloud, progress);
 
-  // Atomic do not support assignment and construction so we can't really retain the vector memory.
-  std::vector<Bool> transient_ray_marks(cloud.rayCount() MARKER_BOOL_INIT);
-  markIntersectedEllipsoids(cloud, ray_grid, &transient_ray_marks, config_.num_rays_filter_threshold, true, progress);
-
-  finaliseFilter(cloud, transient_ray_marks);
-
-  progress->end();
-
-  return true;
+  markIntersectedEllipsoids(cloud, cloud, &ray_grid, transient_ray_marks, config_.num_rays_filter_threshold, true,
+                            progress, false, active);
 }
 
 bool Merger::mergeMultiple(std::vector<Cloud> &clouds, Progress *progress)
@@ -368,27 +512,135 @@ bool Merger::mergeMultiple(std::vector<Cloud> &clouds, Progress *progress)
 
   clear();
 
-  std::vector<Grid<unsigned>> grids(clouds.size());
+  std::vector<double> voxel_sizes(clouds.size());
   for (size_t c = 0; c < clouds.size(); c++)
   {
-    const double voxel_size = voxelSizeForCloud(clouds[c]);
+    voxel_sizes[c] = voxelSizeForCloud(clouds[c]);
     if (config_.voxel_size == 0)
     {
-      std::cout << "estimated required voxel size for cloud " << c << ": " << voxel_size << std::endl;
+      std::cout << "estimated required voxel size for cloud " << c << ": " << voxel_sizes[c] << std::endl;
     }
-    grids[c].init(clouds[c].calcMinBound(), clouds[c].calcMaxBound(), voxel_size);
-    for (size_t d = 0; d < clouds.size(); d++)
+  }
+
+  std::vector<std::vector<Bool>> transient_ray_marks;
+  markMultiple(clouds, voxel_sizes, nullptr, nullptr, transient_ray_marks, progress);
+
+  for (size_t c = 0; c < clouds.size(); c++)
+  {
+    auto &cloud = clouds[c];
+    for (size_t i = 0; i < cloud.rayCount(); i++)
     {
-      seedRayGrid(&grids[c], clouds[d]);
+      if (transient_ray_marks[c][i])
+      {
+        difference_.addRay(cloud, i);
+      }
+      else
+      {
+        fixed_.addRay(cloud, i);
+      }
     }
   }
 
-  for (size_t c = 0; c < clouds.size(); c++)
+  return true;
+}
+
+void Merger::mergeMultipleTile(const std::vector<Cloud> &clouds, const std::vector<std::vector<uint8_t>> &owned,
+                               const std::vector<double> &voxel_sizes, const std::vector<Cuboid> &grid_bounds,
+                               std::vector<std::vector<uint8_t>> &transient_marks, Progress *progress)
+{
+  Progress tracker;
+  if (!progress)
   {
-    fillRayGrid(&grids[c], clouds[c], progress);
-  }  
+    progress = &tracker;
+  }
+
+  clear();
 
   std::vector<std::vector<Bool>> transient_ray_marks;
+  markMultiple(clouds, voxel_sizes, &owned, &grid_bounds, transient_ray_marks, progress);
+
+  transient_marks.resize(clouds.size());
+  for (size_t c = 0; c < clouds.size(); c++)
+  {
+    transient_marks[c].resize(clouds[c].rayCount());
+    for (size_t i = 0; i < clouds[c].rayCount(); i++)
+    {
+      transient_marks[c][i] = transient_ray_marks[c][i];
+    }
+  }
+
+  progress->end();
+}
+
+void Merger::markMultiple(const std::vector<Cloud> &clouds, const std::vector<double> &voxel_sizes,
+                          const std::vector<std::vector<uint8_t>> *owned, const std::vector<Cuboid> *grid_bounds,
+                          std::vector<std::vector<Bool>> &transient_ray_marks, Progress *progress)
+{
+  // Each cloud's rays are found with the ellipsoid BVH or a ray grid, chosen once from the cloud's own rays and its
+  // number of bounded rays, which bounds its number of ellipsoids
+  std::vector<bool> use_bvh(clouds.size());
+  for (size_t d = 0; d < clouds.size(); d++)
+  {
+    size_t num_bounded = 0;
+    for (size_t i = 0; i < clouds[d].rayCount(); i++)
+    {
+      num_bounded += clouds[d].rayBounded(i) ? 1 : 0;
+    }
+    use_bvh[d] = useEllipsoidBvh(clouds[d], voxel_sizes[d], num_bounded);
+  }
+  // The ray grid of each cloud is only filled when first needed
+  std::vector<Grid<unsigned>> grids(clouds.size());
+  std::vector<bool> grid_filled(clouds.size(), false);
+  const auto ray_grid = [&](size_t d) -> const Grid<unsigned> *  //
+  {
+    if (use_bvh[d])
+    {
+      return nullptr;
+    }
+    if (!grid_filled[d])
+    {
+      if (owned)
+      {
+        // A tile can hold only unbounded or passing rays, so its grid covers all of the rays. It is clipped to the
+        // whole cloud's grid, and on the same voxel lattice, so the voxels of any ellipsoid are those of the untiled
+        // merge
+        const Eigen::Vector3d &grid_min = (*grid_bounds)[d].min_bound_;
+        const Eigen::Vector3d &grid_max = (*grid_bounds)[d].max_bound_;
+        Eigen::Vector3d bounds_min(1e10, 1e10, 1e10), bounds_max(-1e10, -1e10, -1e10);
+        for (size_t i = 0; i < clouds[d].rayCount(); i++)
+        {
+          bounds_min = minVector(bounds_min, minVector(clouds[d].starts[i], clouds[d].ends[i]));
+          bounds_max = maxVector(bounds_max, maxVector(clouds[d].starts[i], clouds[d].ends[i]));
+        }
+        for (int i = 0; i < 3; i++)
+        {
+          const double width = voxel_sizes[d];
+          if (grid_min[i] <= grid_max[i])  // the whole cloud has bounded rays
+          {
+            const double grid_end = grid_min[i] + std::ceil((grid_max[i] - grid_min[i]) / width) * width;
+            bounds_min[i] = std::min(std::max(bounds_min[i], grid_min[i]), grid_end - width);
+            bounds_min[i] = grid_min[i] + std::floor((bounds_min[i] - grid_min[i]) / width) * width;
+            bounds_max[i] = std::min(bounds_max[i], grid_end);
+          }
+          bounds_max[i] = std::max(bounds_max[i], bounds_min[i] + width);
+        }
+        grids[d].init(bounds_min, bounds_max, voxel_sizes[d]);
+      }
+      else
+      {
+        grids[d].init(clouds[d].calcMinBound(), clouds[d].calcMaxBound(), voxel_sizes[d]);
+      }
+      for (size_t e = 0; e < clouds.size(); e++)
+      {
+        seedRayGrid(&grids[d], clouds[e]);
+      }
+      fillRayGrid(&grids[d], clouds[d], progress);
+      grid_filled[d] = true;
+    }
+    return &grids[d];
+  };
+
+  transient_ray_marks.clear();
   transient_ray_marks.reserve(clouds.size());
   for (size_t c = 0; c < clouds.size(); c++)
   {
@@ -398,48 +650,37 @@ bool Merger::mergeMultiple(std::vector<Cloud> &clouds, Progress *progress)
   // now for each cloud, look for other clouds that penetrate it
   for (size_t c = 0; c < clouds.size(); c++)
   {
-    generateEllipsoids(&ellipsoids_, nullptr, nullptr, clouds[c], progress);
+    if (clouds[c].rayCount() == 0)
+    {
+      continue;
+    }
+    // only the ellipsoids of owned rays are tested, when the clouds are tiles of larger clouds
+    const std::vector<uint8_t> *active = owned ? &(*owned)[c] : nullptr;
+    generateCloudEllipsoids(clouds[c], nullptr, nullptr, progress);
     // just set opacity
-    markIntersectedEllipsoids(clouds[c], grids[c], &transient_ray_marks[c], 0, false, progress);
+    markIntersectedEllipsoids(clouds[c], clouds[c], ray_grid(c), &transient_ray_marks[c], 0, false, progress, false,
+                              active);
 
     for (size_t d = 0; d < clouds.size(); d++)
     {
-      if (d == c)
+      if (d == c || clouds[d].rayCount() == 0)
       {
         continue;
       }
       const bool ellipsoid_cloud_first = c < d;  // used when argument order of the files is the merge type
       // use ellipsoid opacity to set transient flag true on transients
-      markIntersectedEllipsoids(clouds[d], grids[d], &transient_ray_marks[d], config_.num_rays_filter_threshold, false,
-                                progress, ellipsoid_cloud_first);
-    }
-
-    for (size_t i = 0; i < clouds[c].rayCount(); i++)
-    {
-      if (ellipsoids_[i].transient)
-      {
-        transient_ray_marks[c][i] = true;
-      }
+      markIntersectedEllipsoids(clouds[c], clouds[d], ray_grid(d), &transient_ray_marks[d],
+                                config_.num_rays_filter_threshold, false, progress, ellipsoid_cloud_first, active);
     }
-  }
 
-  for (size_t c = 0; c < clouds.size(); c++)
-  {
-    auto &cloud = clouds[c];
-    for (size_t i = 0; i < cloud.rayCount(); i++)
+    for (size_t e = 0; e < ellipsoids_.size(); e++)
     {
-      if (transient_ray_marks[c][i])
+      if (ellipsoids_.ellipsoids[e].transient)
       {
-        difference_.addRay(cloud, i);
-      }
-      else
-      {
-        fixed_.addRay(cloud, i);
+        transient_ray_marks[c][ellipsoids_.ray_ids[e]] = true;
       }
     }
   }
-
-  return true;
 }
 
 bool Merger::mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2, Progress *progress)
@@ -452,10 +693,22 @@ bool Merger::mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2
 
   // generate quick lookup for the existance of a particular (quantised) ray
   Cloud *clouds[2] = { &cloud1, &cloud2 };
-  std::set<Vector6i, Vector6iLess> base_ray_lookup;
-  rayLookup(&base_cloud, base_ray_lookup);
-  std::set<Vector6i, Vector6iLess> ray_lookups[2];
-  for (int c = 0; c < 2; c++) rayLookup(clouds[c], ray_lookups[c]);
+  std::vector<uint64_t> base_keys, keys[2];
+  rayKeys(base_cloud, base_keys);
+  for (int c = 0; c < 2; c++) rayKeys(*clouds[c], keys[c]);
+  // the three sets are independent, so are built concurrently
+  RayKeySet ray_lookups[3];
+  RayKeySet &base_ray_lookup = ray_lookups[2];
+  const std::vector<uint64_t> *lookup_keys[3] = { &keys[0], &keys[1], &base_keys };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for<int>(0, 3, [&](int c) { buildRayKeySet(*lookup_keys[c], ray_lookups[c]); });
+#else   // RAYLIB_WITH_TBB
+  #pragma omp parallel for schedule(static, 1)
+  for (int c = 0; c < 3; c++)
+  {
+    buildRayKeySet(*lookup_keys[c], ray_lookups[c]);
+  }
+#endif  // RAYLIB_WITH_TBB
 
   std::cout << "set size " << ray_lookups[0].size() << ", " << ray_lookups[1].size() << ", " << base_ray_lookup.size()
             << std::endl;
@@ -466,19 +719,15 @@ bool Merger::mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2
   for (int c = 0; c < 2; c++)
   {
     Cloud &cloud = *clouds[c];
+    std::vector<uint64_t> &cloud_keys = keys[c];
     for (size_t i = 0; i < cloud.rayCount(); i++)
     {
       Eigen::Vector3d &point = cloud.ends[i];
       Eigen::Vector3d &start = cloud.starts[i];
-      Vector6i ray;
-      for (int j = 0; j < 3; j++)
-      {
-        ray[j] = int(std::floor(start[j] / test_width));
-        ray[3 + j] = int(std::floor(point[j] / test_width));
-      }
+      const uint64_t ray = cloud_keys[i];
       int other = 1 - c;
       // if the ray is in cloud1 and cloud2 there is no contention, so add the ray to the result
-      if (ray_lookups[other].find(ray) != ray_lookups[other].end())
+      if (ray_lookups[other].find(ray))
       {
         if (c == preferred_cloud)
         {
@@ -489,7 +738,7 @@ bool Merger::mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2
       // we want to run the combine (which revolves conflicts) on only the changed parts
       // so we want to keep only the changes for cloud[0] and cloud[1]...
       // which means removing rays that aren't changed:
-      if (base_ray_lookup.find(ray) != base_ray_lookup.end())
+      if (base_ray_lookup.find(ray))
       {
         cloud.starts[i] = cloud.starts.back();
         cloud.starts.pop_back();
@@ -499,6 +748,8 @@ bool Merger::mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2
         cloud.times.pop_back();
         cloud.colours[i] = cloud.colours.back();
         cloud.colours.pop_back();
+        cloud_keys[i] = cloud_keys.back();
+        cloud_keys.pop_back();
         i--;
       }
     }
@@ -524,15 +775,38 @@ bool Merger::mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2
     return true;
   }
   // otherwise we run combine on the altered clouds
-  // first, grid the rays for fast lookup
-  Grid<unsigned> grids[2];
-  for (int c = 0; c < 2; c++)
+  // first, choose once per cloud whether its rays are found with the ellipsoid BVH or a ray grid, as in markMultiple,
+  // and grid the rays for fast lookup when first needed
+  double voxel_sizes[2];
+  bool use_bvh[2];
+  for (int d = 0; d < 2; d++)
   {
-    grids[c].init(clouds[c]->calcMinBound(), clouds[c]->calcMaxBound(), voxelSizeForCloud(*clouds[c]));
-    seedRayGrid(&grids[c], *clouds[0]); // to only fill rays in voxels occupied by cloud 0 or 1
-    seedRayGrid(&grids[c], *clouds[1]);
-    fillRayGrid(&grids[c], *clouds[c], progress);
+    voxel_sizes[d] = voxelSizeForCloud(*clouds[d]);
+    size_t num_bounded = 0;
+    for (size_t i = 0; i < clouds[d]->rayCount(); i++)
+    {
+      num_bounded += clouds[d]->rayBounded(i) ? 1 : 0;
+    }
+    use_bvh[d] = useEllipsoidBvh(*clouds[d], voxel_sizes[d], num_bounded);
   }
+  Grid<unsigned> grids[2];
+  bool grid_filled[2] = { false, false };
+  const auto ray_grid = [&](int d) -> const Grid<unsigned> *  //
+  {
+    if (use_bvh[d])
+    {
+      return nullptr;
+    }
+    if (!grid_filled[d])
+    {
+      grids[d].init(clouds[d]->calcMinBound(), clouds[d]->calcMaxBound(), voxel_sizes[d]);
+      seedRayGrid(&grids[d], *clouds[0]);  // to only fill rays in voxels occupied by cloud 0 or 1
+      seedRayGrid(&grids[d], *clouds[1]);
+      fillRayGrid(&grids[d], *clouds[d], progress);
+      grid_filled[d] = true;
+    }
+    return &grids[d];
+  };
 
   std::vector<Bool> transients[2] = { std::vector<Bool>(clouds[0]->rayCount() MARKER_BOOL_INIT),
                                       std::vector<Bool>(clouds[1]->rayCount() MARKER_BOOL_INIT) };
@@ -543,22 +817,22 @@ bool Merger::mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2
     {
       continue;
     }
-    generateEllipsoids(&ellipsoids_, nullptr, nullptr, *clouds[c]);
+    generateCloudEllipsoids(*clouds[c], nullptr, nullptr, nullptr);
 
     // just set opacity
-    markIntersectedEllipsoids(*clouds[c], grids[c], &transients[c], 0, false, progress);
+    markIntersectedEllipsoids(*clouds[c], *clouds[c], ray_grid(c), &transients[c], 0, false, progress);
 
     const int d = 1 - c;
     const bool ellipsoid_cloud_first = c < d;  // used when argument order of the files is the merge type
     // use ellipsoid opacity to set transient flag true on transients (intersected ellipsoids)
-    markIntersectedEllipsoids(*clouds[d], grids[d], &transients[d], config_.num_rays_filter_threshold, false, progress,
-                              ellipsoid_cloud_first);
+    markIntersectedEllipsoids(*clouds[c], *clouds[d], ray_grid(d), &transients[d], config_.num_rays_filter_threshold,
+                              false, progress, ellipsoid_cloud_first);
 
-    for (size_t i = 0; i < ellipsoids_.size(); i++)
+    for (size_t e = 0; e < ellipsoids_.size(); e++)
     {
-      if (ellipsoids_[i].transient)
+      if (ellipsoids_.ellipsoids[e].transient)
       {
-        transients[c][i] = true;
+        transients[c][ellipsoids_.ray_ids[e]] = true;
       }
     }
   }
@@ -588,6 +862,14 @@ void Merger::clear()
   difference_.clear();
   fixed_.clear();
   ellipsoids_.clear();
+  ellipsoid_bvh_built_ = false;
+}
+
+void Merger::generateCloudEllipsoids(const Cloud &cloud, Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max,
+                                     Progress *progress)
+{
+  generateEllipsoids(&ellipsoids_, bounds_min, bounds_max, cloud, progress);
+  ellipsoid_bvh_built_ = false;
 }
 
 void Merger::seedRayGrid(Grid<unsigned> *grid, const Cloud &cloud)
@@ -689,57 +971,201 @@ double Merger::voxelSizeForCloud(const Cloud &cloud) const
   return voxel_size;
 }
 
-void Merger::markIntersectedEllipsoids(const Cloud &cloud, const Grid<unsigned> &ray_grid,
-                                       std::vector<Bool> *transient_ray_marks, double num_rays, bool self_transient,
-                                       Progress *progress, bool ellipsoid_cloud_first)
+bool Merger::useEllipsoidBvh(const Cloud &cloud, double voxel_size, size_t num_ellipsoids) const
+{
+  if (config_.ray_query != RayQuery::Automatic)
+  {
+    return config_.ray_query == RayQuery::EllipsoidBvh;
+  }
+  if (num_ellipsoids == 0 || cloud.rayCount() == 0)
+  {
+    return false;
+  }
+  // Filling the ray grid walks each ray through about length / voxel_size cells, while a ray traverses about
+  // log2(ellipsoid count) levels of the BVH, testing a few boxes at each. So the BVH is preferred for long rays
+  // and few ellipsoids.
+  const size_t stride = std::max<size_t>(1, cloud.rayCount() / 4096);
+  double length_sum = 0.0;
+  size_t num_samples = 0;
+  for (size_t i = 0; i < cloud.rayCount(); i += stride)
+  {
+    length_sum += (cloud.ends[i] - cloud.starts[i]).norm();
+    num_samples++;
+  }
+  const double cells_per_ray = length_sum / (double(num_samples) * voxel_size) + 1.0;
+  const double bvh_cost_per_level = 4.0;  // relative to the cost of one ray grid cell
+  const double bvh_cost_per_ray = bvh_cost_per_level * std::log2(double(num_ellipsoids) + 1.0);
+  return bvh_cost_per_ray < cells_per_ray;
+}
+
+void Merger::gatherEllipsoidRays(const Cloud &cloud, std::vector<size_t> &offsets, std::vector<unsigned> &ray_ids)
 {
-  progress->begin("transient-mark-ellipsoids", cloud.rayCount());
+  if (!ellipsoid_bvh_built_)
+  {
+    ellipsoid_bvh_.build(ellipsoids_);
+    ellipsoid_bvh_built_ = true;
+  }
+  const EllipsoidBvh &bvh = ellipsoid_bvh_;
 
-  // Check each ellipsoid against the ray grid for intersections.
+  // collect the (ellipsoid, ray) pairs of each thread, then sort them by ellipsoid in a compressed row form
+  using RayPairs = std::vector<std::pair<uint32_t, unsigned>>;
+  const auto add_pairs = [&bvh, &cloud](unsigned i, RayPairs &pairs)  //
+  {
+    bvh.forEachOverlap(cloud.starts[i], cloud.ends[i], [&pairs, i](uint32_t e) { pairs.emplace_back(e, i); });
+  };
+  std::vector<RayPairs> thread_pairs;
 #if RAYLIB_WITH_TBB
-  // Declare thread local for ellipsoid marking
-  using ThreadLocalRayMarkers = tbb::enumerable_thread_specific<EllipsoidTransientMarker>;
-  ThreadLocalRayMarkers thread_markers(EllipsoidTransientMarker(cloud.rayCount()));
+  tbb::enumerable_thread_specific<RayPairs> local_pairs;
+  tbb::parallel_for<unsigned>(0u, unsigned(cloud.rayCount()), [&](unsigned i) { add_pairs(i, local_pairs.local()); });
+  for (auto &pairs : local_pairs)
+  {
+    thread_pairs.emplace_back(std::move(pairs));
+  }
+#else   // RAYLIB_WITH_TBB
+#if defined(_OPENMP)
+  thread_pairs.resize(std::max(1, omp_get_max_threads()));
+#else   // defined(_OPENMP)
+  thread_pairs.resize(1);
+#endif  // defined(_OPENMP)
+  const int count = static_cast<int>(cloud.rayCount());
+  #pragma omp parallel for schedule(dynamic, 1024)
+  for (int i = 0; i < count; ++i)
+  {
+#if defined(_OPENMP)
+    add_pairs(static_cast<unsigned>(i), thread_pairs[omp_get_thread_num()]);
+#else   // defined(_OPENMP)
+    add_pairs(static_cast<unsigned>(i), thread_pairs[0]);
+#endif  // defined(_OPENMP)
+  }
+#endif  // RAYLIB_WITH_TBB
 
-  auto tbb_process_ellipsoid = [this, &cloud, &ray_grid, transient_ray_marks, &num_rays, &thread_markers,
-                                ellipsoid_cloud_first, progress, self_transient](size_t ellipsoid_id)  //
+  offsets.assign(ellipsoids_.size() + 1, 0);
+  for (const auto &pairs : thread_pairs)
   {
-    // Resolve the ray marker for this thread.
-    EllipsoidTransientMarker &marker = thread_markers.local();
-    marker.mark(&ellipsoids_[ellipsoid_id], transient_ray_marks, cloud, ray_grid, num_rays, config_.merge_type,
-                self_transient, ellipsoid_cloud_first);
+    for (const auto &pair : pairs)
+    {
+      offsets[pair.first + 1]++;
+    }
+  }
+  for (size_t e = 0; e < ellipsoids_.size(); e++)
+  {
+    offsets[e + 1] += offsets[e];
+  }
+  ray_ids.resize(offsets.back());
+  std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+  for (auto &pairs : thread_pairs)
+  {
+    for (const auto &pair : pairs)
+    {
+      ray_ids[fill[pair.first]++] = pair.second;
+    }
+    RayPairs().swap(pairs);
+  }
+  // the threads collect in an arbitrary order, so order the rays of each ellipsoid by index
+  const int num_ellipsoids = static_cast<int>(ellipsoids_.size());
+  #pragma omp parallel for schedule(dynamic, 1024)
+  for (int e = 0; e < num_ellipsoids; e++)
+  {
+    std::sort(ray_ids.begin() + offsets[e], ray_ids.begin() + offsets[e + 1]);
+  }
+}
+
+void Merger::markIntersectedEllipsoids(const Cloud &ellipsoid_cloud, const Cloud &cloud, const Grid<unsigned> *ray_grid,
+                                       std::vector<Bool> *transient_ray_marks, double num_rays, bool self_transient,
+                                       Progress *progress, bool ellipsoid_cloud_first,
+                                       const std::vector<uint8_t> *active)
+{
+  // Without a ray grid, the rays near each ellipsoid are found by traversing the rays through an ellipsoid BVH
+  std::vector<size_t> offsets;
+  std::vector<unsigned> ray_ids;
+  if (!ray_grid)
+  {
+    gatherEllipsoidRays(cloud, offsets, ray_ids);
+  }
+
+  progress->begin("transient-mark-ellipsoids", ellipsoids_.size());
+
+  const auto mark_ellipsoid = [&](EllipsoidTransientMarker &marker, size_t ellipsoid_id)  //
+  {
+    const uint32_t ray_id = ellipsoids_.ray_ids[ellipsoid_id];
+    if (!active || (*active)[ray_id])
+    {
+      CompactEllipsoid *ellipsoid = &ellipsoids_.ellipsoids[ellipsoid_id];
+      const double ellipsoid_time = ellipsoid_cloud.times[ray_id];
+      if (ray_grid)
+      {
+        marker.mark(ellipsoid, ellipsoids_.origin(ellipsoid_id), ellipsoid_time, transient_ray_marks, cloud, *ray_grid,
+                    num_rays, config_.merge_type, self_transient, ellipsoid_cloud_first);
+      }
+      else
+      {
+        marker.mark(ellipsoid, ellipsoids_.origin(ellipsoid_id), ellipsoid_time, transient_ray_marks, cloud,
+                    ray_ids.data() + offsets[ellipsoid_id], offsets[ellipsoid_id + 1] - offsets[ellipsoid_id],
+                    num_rays, config_.merge_type, self_transient, ellipsoid_cloud_first);
+      }
+    }
     progress->increment();
   };
-  tbb::parallel_for<size_t>(0u, cloud.rayCount(), tbb_process_ellipsoid);
+
+  // Check each ellipsoid for intersections. Each thread has its own marker working memory.
+#if RAYLIB_WITH_TBB
+  // Declare thread local for ellipsoid marking
+  using ThreadLocalRayMarkers = tbb::enumerable_thread_specific<EllipsoidTransientMarker>;
+  ThreadLocalRayMarkers thread_markers;
+  tbb::parallel_for<size_t>(0u, ellipsoids_.size(),
+                            [&](size_t ellipsoid_id) { mark_ellipsoid(thread_markers.local(), ellipsoid_id); });
 #else   // RAYLIB_WITH_TBB
-  std::vector<bool> ray_tested;
-  ray_tested.resize(cloud.rayCount(), false);
-  EllipsoidTransientMarker ellipsoid_maker(cloud.rayCount());
- // #pragma omp parallel for schedule(static)
-  for (size_t i = 0; i < ellipsoids_.size(); ++i)
-  {
-    ellipsoid_maker.mark(&ellipsoids_[i], transient_ray_marks, cloud, ray_grid, num_rays, config_.merge_type,
-                         self_transient, ellipsoid_cloud_first);
-    progress->increment();
+#if defined(_OPENMP)
+  std::vector<EllipsoidTransientMarker> markers(std::max(1, omp_get_max_threads()));
+#else   // defined(_OPENMP)
+  std::vector<EllipsoidTransientMarker> markers(1);
+#endif  // defined(_OPENMP)
+  const int count = static_cast<int>(ellipsoids_.size());
+  #pragma omp parallel for schedule(dynamic, 64)
+  for (int i = 0; i < count; ++i)
+  {
+#if defined(_OPENMP)
+    mark_ellipsoid(markers[omp_get_thread_num()], i);
+#else   // defined(_OPENMP)
+    mark_ellipsoid(markers[0], i);
+#endif  // defined(_OPENMP)
   }
 #endif  // RAYLIB_WITH_TBB
 }
 
+const CompactEllipsoid *Merger::ellipsoidOfRay(size_t i, size_t &e) const
+{
+  while (e < ellipsoids_.size() && ellipsoids_.ray_ids[e] < i)
+  {
+    e++;
+  }
+  return e < ellipsoids_.size() && ellipsoids_.ray_ids[e] == i ? &ellipsoids_.ellipsoids[e] : nullptr;
+}
+
+RGBA Merger::filterColour(const Cloud &cloud, size_t i, const CompactEllipsoid *ellipsoid) const
+{
+  RGBA col = cloud.colours[i];
+  if (config_.colour_cloud)
+  {
+    // rays without an ellipsoid are opaque, with no pass through rays
+    const double opacity = ellipsoid ? ellipsoid->opacity : 1.0;
+    const double num_gone = ellipsoid ? ellipsoid->num_gone : 0.0;
+    col.red = (uint8_t)0;
+    col.blue = (uint8_t)(opacity * 255.0);
+    col.green = (uint8_t)(num_gone / (num_gone + 10.0) * 255.0);
+  }
+  return col;
+}
 
 void Merger::finaliseFilter(const Cloud &cloud, const std::vector<Bool> &transient_ray_marks)
 {
   // Lastly, generate the new ray clouds from this sphere information
-  for (size_t i = 0; i < ellipsoids_.size(); i++)
+  size_t e = 0;
+  for (size_t i = 0; i < cloud.rayCount(); i++)
   {
-    RGBA col = cloud.colours[i];
-    if (config_.colour_cloud)
-    {
-      col.red = (uint8_t)0;
-      col.blue = (uint8_t)(ellipsoids_[i].opacity * 255.0);
-      col.green = (uint8_t)((double)ellipsoids_[i].num_gone / ((double)ellipsoids_[i].num_gone + 10.0) * 255.0);
-    }
-
-    if (ellipsoids_[i].transient || transient_ray_marks[i])
+    const CompactEllipsoid *ellipsoid = ellipsoidOfRay(i, e);
+    const RGBA col = filterColour(cloud, i, ellipsoid);
+    if ((ellipsoid && ellipsoid->transient) || transient_ray_marks[i])
     {
       difference_.starts.emplace_back(cloud.starts[i]);
       difference_.ends.emplace_back(cloud.ends[i]);
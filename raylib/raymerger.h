@@ -33,6 +33,17 @@ enum class RAYLIB_EXPORT MergeType : int
   All
 };
 
+/// How @c Merger finds the rays that may intersect each ellipsoid
+enum class RAYLIB_EXPORT RayQuery : int
+{
+  /// Choose from the ray lengths and the number of ellipsoids
+  Automatic,
+  /// Walk the rays through a voxel grid, and look up the voxels around each ellipsoid
+  RayGrid,
+  /// Traverse each ray through a bounding volume hierarchy of the ellipsoids
+  EllipsoidBvh
+};
+
 /// Parameter configuration structure for @c Merger
 struct RAYLIB_EXPORT MergerConfig
 {
@@ -40,6 +51,7 @@ struct RAYLIB_EXPORT MergerConfig
   double num_rays_filter_threshold = 20;
   MergeType merge_type = MergeType::Mininum;
   bool colour_cloud = true;
+  RayQuery ray_query = RayQuery::Automatic;
 };
 
 /// A cloud merger which supports filtering 'transient' rays and merging from a ray clouds. A transient ray is one which
@@ -48,11 +60,11 @@ struct RAYLIB_EXPORT MergerConfig
 class RAYLIB_EXPORT Merger
 {
 public:
-#if RAYLIB_WITH_TBB
+#if RAYLIB_WITH_TBB || RAYLIB_WITH_OPENMP
   using Bool = std::atomic_bool;
-#else   // RAYLIB_WITH_TBB
+#else   // RAYLIB_WITH_TBB || RAYLIB_WITH_OPENMP
   using Bool = bool;
-#endif  // RAYLIB_WITH_TBB
+#endif  // RAYLIB_WITH_TBB || RAYLIB_WITH_OPENMP
 
   Merger(const MergerConfig &config);
   ~Merger();
@@ -67,9 +79,35 @@ public:
   /// Perform the transient filtering on the given @p cloud .
   bool filter(const Cloud &cloud, Progress *progress = nullptr);
 
+  /// Transient filtering of one tile of a larger cloud. @p cloud holds the tile's rays, together with the rays ending
+  /// in a halo around the tile and those passing through it. Only the ellipsoids of rays with non-zero @p owned are
+  /// tested. @p transient_marks is set non-zero for each ray found to be transient, which can include rays from
+  /// outside the tile that pass through it. When colouring, @p colours is given the colours of the owned rays.
+  /// The rays are gridded on a lattice of the voxel size from @p grid_origin , or from zero if it is not given.
+  /// For the same result as @c filter() the voxel size must be set in the config, as an estimate from a single tile
+  /// differs from that of the whole cloud, and @p grid_origin must be the minimum @c tileGridOrigin over the tiles.
+  void filterTile(const Cloud &cloud, const std::vector<uint8_t> &owned, std::vector<uint8_t> &transient_marks,
+                  std::vector<RGBA> &colours, const Eigen::Vector3d *grid_origin = nullptr,
+                  Progress *progress = nullptr);
+
+  /// The lower bound of the ellipsoids of the rays of tile @p cloud with non-zero @p owned . @c filter() grids the
+  /// rays from the lower bound of all of its ellipsoids, which is the minimum of this over the tiles of the cloud
+  Eigen::Vector3d tileGridOrigin(const Cloud &cloud, const std::vector<uint8_t> &owned, Progress *progress = nullptr);
+
   /// Multi-merge
   bool mergeMultiple(std::vector<Cloud> &clouds, Progress *progress = nullptr);
 
+  /// Multi-merge of one tile of larger clouds. Each of @c clouds holds a tile's rays from one cloud, together with the
+  /// rays ending in a halo around the tile and those passing through it, and @c owned is non-zero for the tile's own
+  /// rays. Only the ellipsoids of owned rays are tested. @c transient_marks is set non-zero for each ray found to be
+  /// transient, which can include rays from outside the tile that pass through it. The rays of each cloud are gridded
+  /// with the corresponding @c voxel_sizes, which should be estimated over the whole clouds. The grid of each tile is
+  /// the part of the grid that @c mergeMultiple() would use for the whole cloud, whose bounded rays are bounded by the
+  /// corresponding @c grid_bounds (the @c bounded_rays_bound of @c Cloud::Info ).
+  void mergeMultipleTile(const std::vector<Cloud> &clouds, const std::vector<std::vector<uint8_t>> &owned,
+                         const std::vector<double> &voxel_sizes, const std::vector<Cuboid> &grid_bounds,
+                         std::vector<std::vector<uint8_t>> &transient_marks, Progress *progress = nullptr);
+
   /// Three way merger
   bool mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2, Progress *progress = nullptr);
 
@@ -93,13 +131,49 @@ public:
 private:
   double voxelSizeForCloud(const Cloud &cloud) const;
 
-  /// For all ellipsoids_ intersect with rays in @c cloud (accelerated using @c ray_grid)
-  /// depending on config.merge_type, either mark the ellipsoid object as removed, or
+  /// For all ellipsoids_ (generated from @c ellipsoid_cloud) intersect with rays in @c cloud (accelerated using
+  /// @c ray_grid) depending on config.merge_type, either mark the ellipsoid object as removed, or
   /// mark the ray (through @c transient_ray_marks) as removed.
   /// @c ellipsoid_cloud_first is used only for the 'order' merge type, to choose which to mark
-  void markIntersectedEllipsoids(const Cloud &cloud, const Grid<unsigned> &ray_grid,
+  /// @c active optionally restricts the test to the ellipsoids of the rays with non-zero entries
+  /// Without a @c ray_grid the rays are found using a BVH of the ellipsoids.
+  void markIntersectedEllipsoids(const Cloud &ellipsoid_cloud, const Cloud &cloud, const Grid<unsigned> *ray_grid,
                                  std::vector<Bool> *transient_ray_marks, double num_rays, bool self_transient,
-                                 Progress *progress, bool ellipsoid_cloud_first = false);
+                                 Progress *progress, bool ellipsoid_cloud_first = false,
+                                 const std::vector<uint8_t> *active = nullptr);
+
+  /// Whether to find the rays of @c cloud that may intersect @c num_ellipsoids ellipsoids with an ellipsoid BVH, rather
+  /// than a ray grid of voxel width @c voxel_size
+  bool useEllipsoidBvh(const Cloud &cloud, double voxel_size, size_t num_ellipsoids) const;
+
+  /// Generate @c ellipsoids_ from @c cloud , replacing any previous ellipsoids and their BVH
+  void generateCloudEllipsoids(const Cloud &cloud, Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max,
+                               Progress *progress);
+
+  /// The rays of @c cloud whose segments cross the box of each ellipsoid, found with an ellipsoid BVH. The rays of
+  /// ellipsoid @c e are @c ray_ids from @c offsets[e] to @c offsets[e+1] , in increasing order. The BVH is built on
+  /// first use, and kept until the ellipsoids are regenerated
+  void gatherEllipsoidRays(const Cloud &cloud, std::vector<size_t> &offsets, std::vector<unsigned> &ray_ids);
+
+  /// Mark the transient rays of each of @c clouds against the others, in @c transient_ray_marks. The rays of each
+  /// cloud are gridded with the corresponding @c voxel_sizes. When @c owned is given, the clouds are tiles and only
+  /// the ellipsoids of the owned rays are tested, and each tile is gridded within the corresponding @c grid_bounds
+  void markMultiple(const std::vector<Cloud> &clouds, const std::vector<double> &voxel_sizes,
+                    const std::vector<std::vector<uint8_t>> *owned, const std::vector<Cuboid> *grid_bounds,
+                    std::vector<std::vector<Bool>> &transient_ray_marks, Progress *progress);
+
+  /// Generate the ellipsoids of @c cloud and mark its transient rays in @c transient_ray_marks. Only the ellipsoids of
+  /// non-zero @c active entries are tested, if given, in which case the rays are gridded on a lattice from
+  /// @c grid_origin , or from zero if it is null
+  void markSelfTransients(const Cloud &cloud, std::vector<Bool> *transient_ray_marks, Progress *progress,
+                          const std::vector<uint8_t> *active = nullptr, const Eigen::Vector3d *grid_origin = nullptr);
+
+  /// The ellipsoid of ray @c i, or nullptr if it has none. For use on increasing @c i, @c e is the ellipsoid index to
+  /// search from, which should start at 0 and is advanced to the ellipsoid of ray @c i or after it
+  const CompactEllipsoid *ellipsoidOfRay(size_t i, size_t &e) const;
+
+  /// The colour of ray @c i of @c cloud in the filter results, given its @c ellipsoid (if any)
+  RGBA filterColour(const Cloud &cloud, size_t i, const CompactEllipsoid *ellipsoid) const;
 
   /// Finalise the cloud filter and populate @c transientResults() and @c fixedResults() .
   void finaliseFilter(const Cloud &cloud, const std::vector<Bool> &transient_ray_marks);
@@ -107,7 +181,9 @@ private:
   Cloud difference_;
   Cloud fixed_;
   MergerConfig config_;
-  std::vector<Ellipsoid> ellipsoids_;
+  EllipsoidStore ellipsoids_;
+  EllipsoidBvh ellipsoid_bvh_;  ///< BVH of ellipsoids_, when ellipsoid_bvh_built_
+  bool ellipsoid_bvh_built_ = false;
 };
 }  // namespace ray
 
@@ -10,7 +10,10 @@
 #include "raycloudwriter.h"
 #include "rayunused.h"
 
-#include <set>
+#include <algorithm>
+#include <future>
+#include <limits>
+#include <memory>
 
 namespace ray
 {
@@ -20,7 +23,7 @@ public:
   Eigen::Vector3d corners[3];
   Eigen::Vector3d normal;
   bool tested;
-  bool intersectsRay(const Eigen::Vector3d &ray_start, const Eigen::Vector3d &ray_end, double &depth)
+  bool intersectsRay(const Eigen::Vector3d &ray_start, const Eigen::Vector3d &ray_end, double &depth) const
   {
     // 1. plane test:
     double d1 = (ray_start - corners[0]).dot(normal);
@@ -40,7 +43,7 @@ public:
     }
     return true;
   }
-  double distSqrToPoint(const Eigen::Vector3d &point)
+  double distSqrToPoint(const Eigen::Vector3d &point) const
   {
     Eigen::Vector3d pos = point - normal * (point - corners[0]).dot(normal);
     bool outs[3];
@@ -75,6 +78,91 @@ public:
   }
 };
 
+/// Triangles binned into the vertical columns of a 2D grid, so that a vertical ray only tests the triangles of the
+/// one column that it lies in. Each column is stored contiguously and sorted by the triangles' minimum height, so a
+/// downward search can stop at the first triangle that lies entirely above the point.
+class TriangleColumns
+{
+public:
+  /// bin the triangles with bounding boxes @c mins to @c maxs into columns of width @c width
+  void init(const std::vector<Eigen::Vector3d> &mins, const std::vector<Eigen::Vector3d> &maxs, double width)
+  {
+    const double mx = std::numeric_limits<double>::max();
+    box_min_ = Eigen::Vector2d(mx, mx);
+    Eigen::Vector2d box_max(-mx, -mx);
+    for (size_t i = 0; i < mins.size(); i++)
+    {
+      box_min_ = box_min_.cwiseMin(mins[i].head<2>());
+      box_max = box_max.cwiseMax(maxs[i].head<2>());
+    }
+    width_ = width;
+    dims_ = mins.empty() ? Eigen::Vector2i(0, 0) : column(box_max) + Eigen::Vector2i(1, 1);
+
+    // count the triangles per column, then fill each column's range of the index list
+    std::vector<int> counts(static_cast<size_t>(dims_[0]) * static_cast<size_t>(dims_[1]) + 1, 0);
+    for (size_t i = 0; i < mins.size(); i++)
+    {
+      const Eigen::Vector2i col_min = column(mins[i].head<2>()), col_max = column(maxs[i].head<2>());
+      for (int x = col_min[0]; x <= col_max[0]; x++)
+        for (int y = col_min[1]; y <= col_max[1]; y++) counts[columnIndex(x, y) + 1]++;
+    }
+    for (size_t i = 1; i < counts.size(); i++) counts[i] += counts[i - 1];
+    offsets_ = counts;
+    indices_.resize(counts.back());
+    for (size_t i = 0; i < mins.size(); i++)
+    {
+      const Eigen::Vector2i col_min = column(mins[i].head<2>()), col_max = column(maxs[i].head<2>());
+      for (int x = col_min[0]; x <= col_max[0]; x++)
+        for (int y = col_min[1]; y <= col_max[1]; y++) indices_[counts[columnIndex(x, y)]++] = static_cast<int>(i);
+    }
+    min_heights_.resize(indices_.size());
+    for (size_t c = 0; c + 1 < offsets_.size(); c++)
+    {
+      std::sort(indices_.begin() + offsets_[c], indices_.begin() + offsets_[c + 1],
+                [&mins](int a, int b) { return mins[a][2] < mins[b][2]; });
+      for (int j = offsets_[c]; j < offsets_[c + 1]; j++) min_heights_[j] = mins[indices_[j]][2];
+    }
+  }
+
+  /// Calls @c func(triangle_index) on the triangles of the column containing @c point whose minimum height is at or
+  /// below the point, lowest first. Stops early if @c func returns false
+  template <class Func>
+  void forEachBelow(const Eigen::Vector3d &point, Func func) const
+  {
+    const Eigen::Vector2i col = column(point.head<2>());
+    if (col[0] < 0 || col[1] < 0 || col[0] >= dims_[0] || col[1] >= dims_[1])
+    {
+      return;
+    }
+    const size_t c = columnIndex(col[0], col[1]);
+    for (int j = offsets_[c]; j < offsets_[c + 1] && min_heights_[j] <= point[2]; j++)
+    {
+      if (!func(indices_[j]))
+      {
+        return;
+      }
+    }
+  }
+
+private:
+  inline Eigen::Vector2i column(const Eigen::Vector2d &pos) const
+  {
+    return Eigen::Vector2i(int(std::floor((pos[0] - box_min_[0]) / width_)),
+                           int(std::floor((pos[1] - box_min_[1]) / width_)));
+  }
+  inline size_t columnIndex(int x, int y) const
+  {
+    return static_cast<size_t>(x) + static_cast<size_t>(dims_[0]) * static_cast<size_t>(y);
+  }
+
+  Eigen::Vector2d box_min_;
+  double width_;
+  Eigen::Vector2i dims_;
+  std::vector<int> offsets_;  // start of each column in indices_, plus a final end value
+  std::vector<int> indices_;
+  std::vector<double> min_heights_;  // minimum height of each triangle in indices_
+};
+
 // remove additional points that are not connected to the mesh
 void Mesh::reduce()
 {
@@ -215,150 +303,124 @@ bool Mesh::splitCloud(const std::string &cloud_name, double offset, const std::s
 
   // convert to separate triangles for convenience
   std::vector<Triangle> triangles(index_list_.size());
-  double mx = std::numeric_limits<double>::max();
-  double mn = std::numeric_limits<double>::lowest();
-  Eigen::Vector3d box_min(mx, mx, mx), box_max(mn, mn, mn);
+  std::vector<Eigen::Vector3d> tri_mins(triangles.size()), tri_maxs(triangles.size());
+  double mean_footprint = 0.0;
+  Eigen::Vector2d box_min(std::numeric_limits<double>::max(), std::numeric_limits<double>::max());
+  Eigen::Vector2d box_max = -box_min;
   for (int i = 0; i < (int)index_list_.size(); i++)
   {
     Triangle &tri = triangles[i];
     for (int j = 0; j < 3; j++) tri.corners[j] = vertices_[index_list_[i][j]];
     tri.tested = false;
     tri.normal = (tri.corners[1] - tri.corners[0]).cross(tri.corners[2] - tri.corners[0]).normalized();
-    for (int j = 0; j < 3; j++)
-    {
-      box_min = minVector(box_min, tri.corners[j]);
-      box_max = maxVector(box_max, tri.corners[j]);
-    }
+    tri_mins[i] = minVector(tri.corners[0], minVector(tri.corners[1], tri.corners[2]));
+    tri_maxs[i] = maxVector(tri.corners[0], maxVector(tri.corners[1], tri.corners[2]));
+    mean_footprint += (tri_maxs[i] - tri_mins[i]).head<2>().maxCoeff();
+    box_min = box_min.cwiseMin(tri_mins[i].head<2>());
+    box_max = box_max.cwiseMax(tri_maxs[i].head<2>());
   }
-
-  // Thirdly, put the triangles into a grid
-  double voxel_width = 1.0;
-  Grid<Triangle *> grid(box_min, box_max, voxel_width);
-  Grid<Triangle *> expanded_triangle_grid;
-
-  for (auto &tri : triangles)
+  if (triangles.empty())
   {
-    Eigen::Vector3d tri_min =
-      (minVector(tri.corners[0], minVector(tri.corners[1], tri.corners[2])) - box_min) / voxel_width;
-    Eigen::Vector3d tri_max =
-      (maxVector(tri.corners[0], maxVector(tri.corners[1], tri.corners[2])) - box_min) / voxel_width;
-    for (int x = (int)tri_min[0]; x <= (int)tri_max[0]; x++)
-    {
-      for (int y = (int)tri_min[1]; y <= (int)tri_max[1]; y++)
-      {
-        for (int z = (int)tri_min[2]; z <= (int)tri_max[2]; z++)
-        {
-          grid.insert(x, y, z, &tri);
-        }
-      }
-    }
+    std::cerr << "Error: mesh has no triangles" << std::endl;
+    return false;
   }
+  mean_footprint /= (double)triangles.size();
+
+  // Thirdly, bin the triangles into vertical columns. The column width follows the triangle size, so that fine
+  // meshes get fine columns and large sparse meshes get coarse ones, limited to a few columns per triangle
+  const Eigen::Vector2d extent = (box_max - box_min).cwiseMax(Eigen::Vector2d(1e-10, 1e-10));
+  double column_width = std::max(mean_footprint, 1e-3 * extent.maxCoeff());
+  const double max_columns = 4.0 * (double)triangles.size() + 16.0;
+  column_width = std::max(column_width, std::sqrt(extent[0] * extent[1] / max_columns));
+  TriangleColumns columns;
+  columns.init(tri_mins, tri_maxs, column_width);
+
+  // the offset volume of each triangle is conservatively bounded by its box expanded by the offset distance
+  TriangleColumns expanded_columns;
+  std::vector<Eigen::Vector3d> expanded_maxs;
   if (offset != 0.0)
   {
-    // Thirdly, put the triangles into a grid
-    expanded_triangle_grid.init(box_min, box_max, voxel_width);
-    for (int i = 0; i < (int)index_list_.size(); i++)
+    const Eigen::Vector3d pad(std::abs(offset), std::abs(offset), std::abs(offset));
+    std::vector<Eigen::Vector3d> expanded_mins(triangles.size());
+    expanded_maxs.resize(triangles.size());
+    for (size_t i = 0; i < triangles.size(); i++)
     {
-      if (!(i % 100000))
-        std::cout << "filling volumes " << i << "/" << index_list_.size() << std::endl;
-      Triangle &tri = triangles[i];
-      Eigen::Vector3d extruded_corners[3];
-      for (int j = 0; j < 3; j++) 
-      {
-        extruded_corners[j] = tri.corners[j] + normals[index_list_[i][j]] * offset;
-      }
-      Eigen::Vector3d tri_min = minVector(tri.corners[0], minVector(tri.corners[1], tri.corners[2]));
-      Eigen::Vector3d tri_max = maxVector(tri.corners[0], maxVector(tri.corners[1], tri.corners[2]));
-      Eigen::Vector3d tri_min2 = minVector(extruded_corners[0], minVector(extruded_corners[1], extruded_corners[2]));
-      Eigen::Vector3d tri_max2 = maxVector(extruded_corners[0], maxVector(extruded_corners[1], extruded_corners[2]));
-      tri_min = (minVector(tri_min, tri_min2) - box_min) / voxel_width;
-      tri_max = (maxVector(tri_max, tri_max2) - box_min) / voxel_width;
-      for (int x = (int)tri_min[0]; x <= (int)tri_max[0]; x++)
-      {
-        for (int y = (int)tri_min[1]; y <= (int)tri_max[1]; y++)
-        {
-          for (int z = (int)tri_min[2]; z <= (int)tri_max[2]; z++) 
-          {
-            expanded_triangle_grid.insert(x, y, z, &tri);
-          }
-        }
-      }
+      expanded_mins[i] = tri_mins[i] - pad;
+      expanded_maxs[i] = tri_maxs[i] + pad;
     }
+    expanded_columns.init(expanded_mins, expanded_maxs, column_width);
   }
+
   // Fourthly, drop each end point downwards to decide whether it is inside or outside..
   CloudWriter in_cloud, out_cloud;
-  in_cloud.begin(inside_name);
-  out_cloud.begin(outside_name);
+  if (!in_cloud.begin(inside_name) || !out_cloud.begin(outside_name))
+    return false;
+
+  // the rays of one chunk are written in the background while the next chunk is read and classified
+  std::future<void> pending_write;
+  std::vector<uint8_t> inside;
 
   // splitting performed per chunk
-  auto write_chunk = [&in_cloud, &out_cloud, &grid, &expanded_triangle_grid, &box_min, 
-                      &voxel_width, &offset](
-                    std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
-                    std::vector<double> &times, std::vector<RGBA> &colours) 
-  {
-    Cloud in_chunk, out_chunk;
-    #pragma omp parallel for
+  auto write_chunk = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                         std::vector<double> &times, std::vector<RGBA> &colours) {
+    inside.resize(ends.size());
+    const bool inside_val = offset >= 0.0;
+    #pragma omp parallel for schedule(dynamic, 1024)
     for (int i = 0; i < (int)ends.size(); i++)
     {
+      const Eigen::Vector3d &end = ends[i];
+      const Eigen::Vector3d ray_base = end - Eigen::Vector3d(0.0, 0.0, 1e3);
       int intersections = 0;
-      Eigen::Vector3d start = (ends[i] - box_min) / voxel_width;
-      Eigen::Vector3i index(start.cast<int>());
-      std::set<Triangle *> tri_set;
-      for (int z = clamped(index[2], 0, grid.dims[2] - 1); z >= 0; --z)
-      {
-        auto &tris = grid.cell(index[0], index[1], z).data;
-        for (auto &tri : tris)
+      columns.forEachBelow(end, [&](int t) {
+        double depth;
+        if (triangles[t].intersectsRay(end, ray_base, depth))
         {
-          const auto &ret = tri_set.insert(tri); // downside: log n lookup, upside: allows parallelisation
-          if (ret.second == false) // already exists
-          {
-            continue;
-          }
-          double depth;
-          if (tri->intersectsRay(ends[i], ends[i] - Eigen::Vector3d(0.0, 0.0, 1e3), depth))
-          {
-            intersections++;
-          }
+          intersections++;
         }
-      }
-      bool inside_val = offset >= 0.0;
+        return true;
+      });
       bool is_inside = !inside_val; // start off not inside
       if ((intersections % 2) == (int)inside_val)  // inside
       {
         bool in_tri = false;
         if (offset != 0.0) // check if it is really inside...
         {
-          Eigen::Vector3d pos = (ends[i] - box_min) / voxel_width;
-          Eigen::Vector3i index(pos.cast<int>());
-          auto &tris = expanded_triangle_grid.cell(index[0], index[1], index[2]).data;
-          for (auto &tri : tris)
-          {
-            if (tri->distSqrToPoint(ends[i]) < offset*offset)
-            {
-              in_tri = true;
-              break;
-            };
-          }
+          expanded_columns.forEachBelow(end, [&](int t) {
+            in_tri = expanded_maxs[t][2] >= end[2] && triangles[t].distSqrToPoint(end) < offset * offset;
+            return !in_tri;
+          });
         }
         if (offset == 0.0 || !in_tri)
         {
           is_inside = inside_val;
         }
       }
-      Cloud &out = is_inside ? in_chunk : out_chunk;
-      #pragma omp critical
-      {
-        out.addRay(starts[i], ends[i], times[i], colours[i]);
-      }      
+      inside[i] = is_inside;
     }
-    in_cloud.writeChunk(in_chunk);
-    out_cloud.writeChunk(out_chunk);
+
+    // gather in ray order, so that the output is deterministic
+    auto in_chunk = std::make_shared<Cloud>(), out_chunk = std::make_shared<Cloud>();
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+      (inside[i] ? in_chunk : out_chunk)->addRay(starts[i], ends[i], times[i], colours[i]);
+    }
+    if (pending_write.valid())
+    {
+      pending_write.wait();
+    }
+    pending_write = std::async(std::launch::async, [&in_cloud, &out_cloud, in_chunk, out_chunk]() {
+      in_cloud.writeChunk(*in_chunk);
+      out_cloud.writeChunk(*out_chunk);
+    });
   };
-  if (!Cloud::read(cloud_name, write_chunk))
-    return false;
+  const bool read_ok = Cloud::read(cloud_name, write_chunk);
+  if (pending_write.valid())
+  {
+    pending_write.wait();
+  }
   in_cloud.end();
   out_cloud.end();
-  return true;
+  return read_ok;
 }
 
 Eigen::Array<double, 6, 1> Mesh::getMoments() const
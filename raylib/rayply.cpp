@@ -22,15 +22,94 @@ unsigned long point_cloud_chunk_header_length = 0;
 unsigned long vertex_size_pos = 0;
 unsigned long point_cloud_vertex_size_pos = 0;
 
-enum DataType
+/// Read the header of the binary .ply file @c input into @c layout. The stream is left at the first vertex
+bool readPlyHeader(std::ifstream &input, const std::string &file_name, PlyLayout &layout)
 {
-  kDTfloat,
-  kDTdouble,
-  kDTushort,
-  kDTuchar,
-  kDTint,
-  kDTnone
-};
+  std::string line;
+  int rowsteps[] = { int(sizeof(float)), int(sizeof(double)), int(sizeof(unsigned short)), int(sizeof(unsigned char)), int(sizeof(int)),
+                     0 };  // to match each DataType enum
+
+  while (line != "end_header\r" && line != "end_header")
+  {
+    if (!getline(input, line))
+    {
+      break;
+    }
+
+    if (line.find("format ascii 1.0") != std::string::npos)
+    {
+      std::cerr << "ASCII PLY not supported " << file_name << std::endl;
+      return false;
+    }
+
+    // support multiple data types
+    PlyLayout::DataType data_type = PlyLayout::kDTnone;
+    if (line.find("property float") != std::string::npos)
+      data_type = PlyLayout::kDTfloat;
+    else if (line.find("property double") != std::string::npos)
+      data_type = PlyLayout::kDTdouble;
+    else if (line.find("property uchar") != std::string::npos || line.find("property uint8") != std::string::npos)
+      data_type = PlyLayout::kDTuchar;
+    else if (line.find("property ushort") != std::string::npos)
+      data_type = PlyLayout::kDTushort;    
+    else if (line.find("property int") != std::string::npos)
+      data_type = PlyLayout::kDTint;
+
+    if (line == "property float x" || line == "property double x")
+    {
+      layout.offset = layout.row_size;
+      if (line.find("float") != std::string::npos)
+        layout.pos_is_float = true;
+    }
+    if (line == "property float rayx" || line == "property double rayx")
+    {
+#if RAYLIB_WITH_NORMAL_FIELD
+      if (layout.normal_offset == -1)
+#endif
+      {
+        layout.normal_offset = layout.row_size;
+        layout.normal_is_float = line.find("float") != std::string::npos;
+      }
+    }
+    if (line == "property float nx" || line == "property double nx")
+    {
+#if !RAYLIB_WITH_NORMAL_FIELD
+      if (layout.normal_offset == -1)
+#endif
+      {
+        layout.normal_offset = layout.row_size;
+        layout.normal_is_float = line.find("float") != std::string::npos;
+      }
+    }
+    if (line.find("time") != std::string::npos)
+    {
+      layout.time_offset = layout.row_size;
+      if (line.find("float") != std::string::npos)
+        layout.time_is_float = true;
+    }
+    if (line.find("intensity") != std::string::npos)
+    {
+      layout.intensity_offset = layout.row_size;
+      layout.intensity_type = data_type;
+    }
+    if (line == "property uchar red" || line == "property uint8 red")
+      layout.colour_offset = layout.row_size;
+
+    layout.row_size += rowsteps[data_type];
+  }
+  if (layout.offset == -1)
+  {
+    std::cerr << "could not find position properties of file: " << file_name << std::endl;
+    return false;
+  }
+
+  std::streampos start = input.tellg();
+  input.seekg(0, input.end);
+  size_t length = input.tellg() - start;
+  input.seekg(start);
+  layout.num_vertices = length / layout.row_size;
+  return true;
+}
 }  // namespace
 
 bool writeRayCloudChunkStart(const std::string &file_name, std::ofstream &out)
@@ -339,90 +418,17 @@ bool readPly(const std::string &file_name, bool is_ray_cloud,
     std::cerr << "Couldn't open file: " << file_name << std::endl;
     return false;
   }
-  std::string line;
-  int row_size = 0;
-  int offset = -1, normal_offset = -1, time_offset = -1, colour_offset = -1;
-  int intensity_offset = -1;
-  bool time_is_float = false;
-  bool pos_is_float = false;
-  bool normal_is_float = false;
-  DataType intensity_type = kDTnone;
-  int rowsteps[] = { int(sizeof(float)), int(sizeof(double)), int(sizeof(unsigned short)), int(sizeof(unsigned char)), int(sizeof(int)),
-                     0 };  // to match each DataType enum
-
-  while (line != "end_header\r" && line != "end_header")
-  {
-    if (!getline(input, line))
-    {
-      break;
-    }
-
-    if (line.find("format ascii 1.0") != std::string::npos)
-    {
-      std::cerr << "ASCII PLY not supported " << file_name << std::endl;
-      return false;
-    }
-
-    // support multiple data types
-    DataType data_type = kDTnone;
-    if (line.find("property float") != std::string::npos)
-      data_type = kDTfloat;
-    else if (line.find("property double") != std::string::npos)
-      data_type = kDTdouble;
-    else if (line.find("property uchar") != std::string::npos || line.find("property uint8") != std::string::npos)
-      data_type = kDTuchar;
-    else if (line.find("property ushort") != std::string::npos)
-      data_type = kDTushort;    
-    else if (line.find("property int") != std::string::npos)
-      data_type = kDTint;
-
-    if (line == "property float x" || line == "property double x")
-    {
-      offset = row_size;
-      if (line.find("float") != std::string::npos)
-        pos_is_float = true;
-    }
-    if (line == "property float rayx" || line == "property double rayx")
-    {
-#if RAYLIB_WITH_NORMAL_FIELD
-      if (normal_offset == -1)
-#endif
-      {
-        normal_offset = row_size;
-        normal_is_float = line.find("float") != std::string::npos;
-      }
-    }
-    if (line == "property float nx" || line == "property double nx")
-    {
-#if !RAYLIB_WITH_NORMAL_FIELD
-      if (normal_offset == -1)
-#endif
-      {
-        normal_offset = row_size;
-        normal_is_float = line.find("float") != std::string::npos;
-      }
-    }
-    if (line.find("time") != std::string::npos)
-    {
-      time_offset = row_size;
-      if (line.find("float") != std::string::npos)
-        time_is_float = true;
-    }
-    if (line.find("intensity") != std::string::npos)
-    {
-      intensity_offset = row_size;
-      intensity_type = data_type;
-    }
-    if (line == "property uchar red" || line == "property uint8 red")
-      colour_offset = row_size;
-
-    row_size += rowsteps[data_type];
-  }
-  if (offset == -1)
+  PlyLayout layout;
+  if (!readPlyHeader(input, file_name, layout))
   {
-    std::cerr << "could not find position properties of file: " << file_name << std::endl;
     return false;
   }
+  const int row_size = layout.row_size;
+  const int offset = layout.offset, normal_offset = layout.normal_offset, time_offset = layout.time_offset;
+  const int colour_offset = layout.colour_offset, intensity_offset = layout.intensity_offset;
+  const bool pos_is_float = layout.pos_is_float, normal_is_float = layout.normal_is_float;
+  const bool time_is_float = layout.time_is_float;
+  const PlyLayout::DataType intensity_type = layout.intensity_type;
   if (is_ray_cloud && normal_offset == -1)
   {
     std::cerr << "could not find normal properties of file: " << file_name << std::endl;
@@ -430,11 +436,7 @@ bool readPly(const std::string &file_name, bool is_ray_cloud,
     return false;
   }
 
-  std::streampos start = input.tellg();
-  input.seekg(0, input.end);
-  size_t length = input.tellg() - start;
-  input.seekg(start);
-  size_t size = length / row_size;
+  size_t size = layout.num_vertices;
 
   ray::Progress progress;
   ray::ProgressThread progress_thread(progress);
@@ -600,9 +602,9 @@ bool readPly(const std::string &file_name, bool is_ray_cloud,
       if (intensity_offset != -1)
       {
         double intensity;
-        if (intensity_type == kDTfloat)
+        if (intensity_type == PlyLayout::kDTfloat)
           intensity = (double)((float &)vertices[intensity_offset]);
-        else if (intensity_type == kDTdouble)
+        else if (intensity_type == PlyLayout::kDTdouble)
           intensity = (double &)vertices[intensity_offset];
         else  // (intensity_type == kDTushort)
           intensity = (double)((unsigned short &)vertices[intensity_offset]);
@@ -705,6 +707,76 @@ bool readPly(const std::string &file_name, bool is_ray_cloud,
   return true;
 }
 
+bool readRayCloudChunkStart(const std::string &file_name, std::ifstream &in, PlyLayout &layout)
+{
+  std::cout << "reading: " << file_name << std::endl;
+  in.open(file_name.c_str(), std::ios::in | std::ios::binary);
+  if (in.fail())
+  {
+    std::cerr << "Couldn't open file: " << file_name << std::endl;
+    return false;
+  }
+  layout = PlyLayout();
+  if (!readPlyHeader(in, file_name, layout))
+  {
+    return false;
+  }
+  if (layout.normal_offset == -1)
+  {
+    std::cerr << "could not find normal properties of file: " << file_name << std::endl;
+    std::cerr << "ray clouds store the ray starts using the normal field" << std::endl;
+    return false;
+  }
+  if (layout.time_offset == -1)
+  {
+    std::cerr << "error: no time information found in " << file_name << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool readRayCloudChunk(std::ifstream &in, const PlyLayout &layout, size_t max_rays,
+                       std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                       std::vector<double> &times, std::vector<RGBA> &colours)
+{
+  starts.clear();
+  ends.clear();
+  times.clear();
+  colours.clear();
+  std::vector<unsigned char> vertices;
+  vertices.resize(max_rays * layout.row_size);
+  in.read((char *)vertices.data(), vertices.size());
+  const size_t num_read = static_cast<size_t>(in.gcount()) / layout.row_size;
+  for (size_t i = 0; i < num_read; i++)
+  {
+    unsigned char *vertex = &vertices[i * layout.row_size];
+    Eigen::Vector3d end, normal;
+    if (layout.pos_is_float)
+      end = ((Eigen::Vector3f &)vertex[layout.offset]).cast<double>();
+    else
+      end = (Eigen::Vector3d &)vertex[layout.offset];
+    if (layout.normal_is_float)
+      normal = ((Eigen::Vector3f &)vertex[layout.normal_offset]).cast<double>();
+    else
+      normal = (Eigen::Vector3d &)vertex[layout.normal_offset];
+    if (!(end == end) || !(normal == normal))
+      continue;
+    starts.push_back(end + normal);
+    ends.push_back(end);
+    if (layout.time_is_float)
+      times.push_back((double)((float &)vertex[layout.time_offset]));
+    else
+      times.push_back((double &)vertex[layout.time_offset]);
+    if (layout.colour_offset != -1)
+      colours.push_back((RGBA &)vertex[layout.colour_offset]);
+  }
+  if (layout.colour_offset == -1)
+  {
+    colourByTime(times, colours);
+  }
+  return num_read > 0;
+}
+
 bool readPly(const std::string &file_name, std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
              std::vector<double> &times, std::vector<RGBA> &colours, bool is_ray_cloud, double max_intensity)
 {
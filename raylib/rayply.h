@@ -22,6 +22,25 @@ using RayPlyEntry = Eigen::Matrix<float, 9, 1>;  // structure of raycloud cloud
 using PointPlyBuffer = std::vector<PointPlyEntry>;
 using RayPlyBuffer = std::vector<RayPlyEntry>;  // buffer for storing a list of rays to be written
 
+/// The location and type of each field in the vertices of a binary .ply file, as given by its header
+struct RAYLIB_EXPORT PlyLayout
+{
+  enum DataType
+  {
+    kDTfloat,
+    kDTdouble,
+    kDTushort,
+    kDTuchar,
+    kDTint,
+    kDTnone
+  };
+  int row_size = 0;
+  int offset = -1, normal_offset = -1, time_offset = -1, colour_offset = -1, intensity_offset = -1;
+  bool pos_is_float = false, normal_is_float = false, time_is_float = false;
+  DataType intensity_type = kDTnone;
+  size_t num_vertices = 0;
+};
+
 /// read in a .ply file into the fields given by reference
 /// Note that @c max_intensity is only used when reading in a point cloud. Intensities are already stored in the
 /// colour alpha channel in ray clouds.
@@ -62,6 +81,15 @@ bool RAYLIB_EXPORT writeRayCloudChunk(std::ofstream &out, RayPlyBuffer &vertices
                                       const std::vector<RGBA> &colours, bool &has_warned);
 unsigned long RAYLIB_EXPORT writeRayCloudChunkEnd(std::ofstream &out);
 
+/// Chunked version of readPly for ray clouds, which reads each chunk on request rather than calling a function on it.
+/// This allows several ray clouds to be read in step. Opens @c file_name and reads its header into @c layout
+bool RAYLIB_EXPORT readRayCloudChunkStart(const std::string &file_name, std::ifstream &in, PlyLayout &layout);
+/// Read up to @c max_rays further rays from the file, replacing the contents of the vectors. Rays with NANs are skipped.
+/// Returns false once there are no more rays to read
+bool RAYLIB_EXPORT readRayCloudChunk(std::ifstream &in, const PlyLayout &layout, size_t max_rays,
+                                     std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                     std::vector<double> &times, std::vector<RGBA> &colours);
+
 /// Chunked version of writePlyPointCloud
 bool RAYLIB_EXPORT writePointCloudChunkStart(const std::string &file_name, std::ofstream &out);
 bool RAYLIB_EXPORT writePointCloudChunk(std::ofstream &out, PointPlyBuffer &vertices,
@@ -8,6 +8,10 @@
 #include "raycloud.h"
 #include "raylib/raylibconfig.h"
 #include "rayparse.h"
+#include "raythreads.h"
+#if RAYLIB_WITH_TBB
+#include <tbb/parallel_for.h>
+#endif  // RAYLIB_WITH_TBB
 #if RAYLIB_WITH_TIFF   // build option to support outputting to geotif (.tif) format
 #include "geotiffio.h" /* for GeoTIFF */
 #include "xtiffio.h"   /* for TIFF */
@@ -487,76 +491,168 @@ bool renderCloud(const std::string &cloud_file, const Cuboid &bounds, ViewDirect
     }
     else  // otherwise we use a common algorithm, specialising on render style only per-ray
     {
+      // render a single ray, only into the image rows from @c row_begin up to @c row_end
+      auto render_ray = [&](const Eigen::Vector3d &ray_start, const Eigen::Vector3d &ray_end, const RGBA &colour,
+                            int row_begin, int row_end) {
+        if (colour.alpha == 0)
+          return;
+        const Eigen::Vector3d col = Eigen::Vector3d(colour.red, colour.green, colour.blue) / 255.0;
+        const Eigen::Vector3d point = style == RenderStyle::Starts ? ray_start : ray_end;
+        const Eigen::Vector3d pos = (point - bounds.min_bound_) / pix_width;
+        const Eigen::Vector3i p = (pos).cast<int>();
+        const int x = p[ax1], y = p[ax2];
+        if (style != RenderStyle::Rays && (y < row_begin || y >= row_end))
+          return;
+        // using 4 dimensions helps us to accumulate colours in a greater variety of ways
+        Eigen::Vector4d &pix = pixels[x + width * y];
+        switch (style)  // render the image according to the chosen style
+        {
+        case RenderStyle::Ends:
+        case RenderStyle::Starts:
+        case RenderStyle::Height:
+          if (pos[axis] * dir > pix[3] * dir || pix[3] == 0.0)  // using 0.0 precisely as a flag here
+          {
+            pix = Eigen::Vector4d(col[0], col[1], col[2], pos[axis]);
+          }
+          break;
+        case RenderStyle::Mean:
+          pix += Eigen::Vector4d(col[0], col[1], col[2], 1.0);
+          break;
+        case RenderStyle::Sum:
+          pix += Eigen::Vector4d(col[0], col[1], col[2], 1.0);
+          break;
+        case RenderStyle::Rays:
+        {
+          Eigen::Vector3d cloud_start = ray_start;
+          Eigen::Vector3d cloud_end = ray_end;
+          // clip to within the image (since we exclude unbounded rays from the image bounds)
+          if (!bounds.clipRay(cloud_start, cloud_end))
+          {
+            return;
+          }
+          Eigen::Vector3d start = (cloud_start - bounds.min_bound_) / pix_width;
+          Eigen::Vector3d end = (cloud_end - bounds.min_bound_) / pix_width;
+          const Eigen::Vector3d dir = cloud_end - cloud_start;
+
+          // fast approximate 2D line rendering requires picking the long axis to iterate along
+          const bool x_long = std::abs(dir[ax1]) > std::abs(dir[ax2]);
+          const int axis_long = x_long ? ax1 : ax2;
+          const int axis_short = x_long ? ax2 : ax1;
+          const int width_long = x_long ? 1 : width;
+          const int width_short = x_long ? width : 1;
+
+          const double gradient = dir[axis_short] / dir[axis_long];
+          if (dir[axis_long] < 0.0)
+            std::swap(start, end);  // this lets us iterate from low up to high values
+          const int start_long = static_cast<int>(start[axis_long]);
+          const int end_long = static_cast<int>(end[axis_long]);
+          // place a pixel at the height of each midpoint (of the pixel) in the long axis
+          const double start_mid_point = 0.5 + static_cast<double>(start_long);
+          double height = start[axis_short] + (start_mid_point - start[axis_long]) * gradient;
+          for (int l = start_long; l <= end_long; l++, height += gradient)
+          {
+            const int s = static_cast<int>(height);
+            const int row = x_long ? s : l;
+            if (row < row_begin || row >= row_end)
+              continue;
+            pixels[width_long * l + width_short * s] += Eigen::Vector4d(col[0], col[1], col[2], 1.0);
+          }
+          break;
+        }
+        default:
+          break;
+        }
+      };
+
+      // find the range of image rows that a ray renders into, returning false if it renders nothing
+      auto ray_rows = [&](const Eigen::Vector3d &ray_start, const Eigen::Vector3d &ray_end, const RGBA &colour,
+                          Eigen::Vector2i &rows) {
+        if (colour.alpha == 0)
+          return false;
+        if (style == RenderStyle::Rays)
+        {
+          Eigen::Vector3d cloud_start = ray_start;
+          Eigen::Vector3d cloud_end = ray_end;
+          if (!bounds.clipRay(cloud_start, cloud_end))
+            return false;
+          const double start_row = (cloud_start[ax2] - bounds.min_bound_[ax2]) / pix_width;
+          const double end_row = (cloud_end[ax2] - bounds.min_bound_[ax2]) / pix_width;
+          // padded, as the line's pixel centres can round to a neighbouring row
+          rows = Eigen::Vector2i(static_cast<int>(std::min(start_row, end_row)) - 2,
+                                 static_cast<int>(std::max(start_row, end_row)) + 2);
+        }
+        else
+        {
+          const Eigen::Vector3d point = style == RenderStyle::Starts ? ray_start : ray_end;
+          const int row = static_cast<int>((point[ax2] - bounds.min_bound_[ax2]) / pix_width);
+          rows = Eigen::Vector2i(row, row);
+        }
+        rows = rows.cwiseMax(0).cwiseMin(height - 1);
+        return true;
+      };
+
+      // The image is divided into bands of rows, one per thread, and each thread renders only the rays that touch its
+      // band, into its band. So no further image buffers are needed, and every pixel receives its rays in file order,
+      // giving the same image as a serial render
+      const int num_bands = std::max(1, std::min(height, Threads::availableThreads()));
+      std::vector<int> band_rows(num_bands + 1);
+      for (int b = 0; b <= num_bands; b++)
+      {
+        band_rows[b] = static_cast<int>((static_cast<int64_t>(b) * height + num_bands - 1) / num_bands);
+      }
+      auto band_of_row = [&](int row) { return static_cast<int>(static_cast<int64_t>(row) * num_bands / height); };
+      std::vector<Eigen::Vector2i> ray_row_ranges;
+      std::vector<int> band_starts, band_rays;
+
       // this lambda expression lets us chunk load the ray cloud file, so we don't run out of RAM
       auto render = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends, std::vector<double> &,
                         std::vector<RGBA> &colours) {
-        for (size_t i = 0; i < ends.size(); i++)
-        {
-          const RGBA &colour = colours[i];
-          if (colour.alpha == 0)
-            continue;
-          const Eigen::Vector3d col = Eigen::Vector3d(colour.red, colour.green, colour.blue) / 255.0;
-          const Eigen::Vector3d point = style == RenderStyle::Starts ? starts[i] : ends[i];
-          const Eigen::Vector3d pos = (point - bounds.min_bound_) / pix_width;
-          const Eigen::Vector3i p = (pos).cast<int>();
-          const int x = p[ax1], y = p[ax2];
-          // using 4 dimensions helps us to accumulate colours in a greater variety of ways
-          Eigen::Vector4d &pix = pixels[x + width * y];
-          switch (style)  // render the image according to the chosen style
+        const int count = static_cast<int>(ends.size());
+        ray_row_ranges.resize(ends.size());
+        const auto find_rows = [&](int i) {
+          if (!ray_rows(starts[i], ends[i], colours[i], ray_row_ranges[i]))
+            ray_row_ranges[i] = Eigen::Vector2i(1, 0);  // an empty range
+        };
+        // bin the rays into the bands that they touch, keeping file order within each band
+        band_starts.assign(num_bands + 1, 0);
+        const auto bin_rays = [&]() {
+          for (const auto &rows : ray_row_ranges)
           {
-          case RenderStyle::Ends:
-          case RenderStyle::Starts:
-          case RenderStyle::Height:
-            if (pos[axis] * dir > pix[3] * dir || pix[3] == 0.0)  // using 0.0 precisely as a flag here
+            if (rows[0] <= rows[1])
             {
-              pix = Eigen::Vector4d(col[0], col[1], col[2], pos[axis]);
+              for (int b = band_of_row(rows[0]); b <= band_of_row(rows[1]); b++) band_starts[b + 1]++;
             }
-            break;
-          case RenderStyle::Mean:
-            pix += Eigen::Vector4d(col[0], col[1], col[2], 1.0);
-            break;
-          case RenderStyle::Sum:
-            pix += Eigen::Vector4d(col[0], col[1], col[2], 1.0);
-            break;
-          case RenderStyle::Rays:
+          }
+          for (int b = 0; b < num_bands; b++) band_starts[b + 1] += band_starts[b];
+          band_rays.resize(band_starts[num_bands]);
+          std::vector<int> band_ends(band_starts.begin(), band_starts.end() - 1);
+          for (int i = 0; i < count; i++)
           {
-            Eigen::Vector3d cloud_start = starts[i];
-            Eigen::Vector3d cloud_end = ends[i];
-            // clip to within the image (since we exclude unbounded rays from the image bounds)
-            if (!bounds.clipRay(cloud_start, cloud_end))
+            const Eigen::Vector2i &rows = ray_row_ranges[i];
+            if (rows[0] <= rows[1])
             {
-              continue;
-            }
-            Eigen::Vector3d start = (cloud_start - bounds.min_bound_) / pix_width;
-            Eigen::Vector3d end = (cloud_end - bounds.min_bound_) / pix_width;
-            const Eigen::Vector3d dir = cloud_end - cloud_start;
-
-            // fast approximate 2D line rendering requires picking the long axis to iterate along
-            const bool x_long = std::abs(dir[ax1]) > std::abs(dir[ax2]);
-            const int axis_long = x_long ? ax1 : ax2;
-            const int axis_short = x_long ? ax2 : ax1;
-            const int width_long = x_long ? 1 : width;
-            const int width_short = x_long ? width : 1;
-
-            const double gradient = dir[axis_short] / dir[axis_long];
-            if (dir[axis_long] < 0.0)
-              std::swap(start, end);  // this lets us iterate from low up to high values
-            const int start_long = static_cast<int>(start[axis_long]);
-            const int end_long = static_cast<int>(end[axis_long]);
-            // place a pixel at the height of each midpoint (of the pixel) in the long axis
-            const double start_mid_point = 0.5 + static_cast<double>(start_long);
-            double height = start[axis_short] + (start_mid_point - start[axis_long]) * gradient;
-            for (int l = start_long; l <= end_long; l++, height += gradient)
-            {
-              const int s = static_cast<int>(height);
-              pixels[width_long * l + width_short * s] += Eigen::Vector4d(col[0], col[1], col[2], 1.0);
+              for (int b = band_of_row(rows[0]); b <= band_of_row(rows[1]); b++) band_rays[band_ends[b]++] = i;
             }
-            break;
           }
-          default:
-            break;
+        };
+        const auto render_band = [&](int b) {
+          for (int j = band_starts[b]; j < band_starts[b + 1]; j++)
+          {
+            const int i = band_rays[j];
+            render_ray(starts[i], ends[i], colours[i], band_rows[b], band_rows[b + 1]);
           }
-        }
+        };
+#if RAYLIB_WITH_TBB
+        tbb::parallel_for(0, count, find_rows);
+        bin_rays();
+        tbb::parallel_for(0, num_bands, render_band);
+#else   // RAYLIB_WITH_TBB
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < count; i++) find_rows(i);
+        bin_rays();
+        #pragma omp parallel for schedule(dynamic)
+        for (int b = 0; b < num_bands; b++) render_band(b);
+#endif  // RAYLIB_WITH_TBB
       };
       if (!Cloud::read(cloud_file, render))
         return false;
@@ -4,54 +4,130 @@
 //
 // Author: Thomas Lowe
 #include "raysplitter.h"
+#include <cstdio>
+#include <future>
 #include <iostream>
 #include <limits>
-#include <map>
+#include <memory>
 #include "extraction/rayforest.h"
 #include "raycloudwriter.h"
 #include "raycuboid.h"
 #include "extraction/raytrees.h"
 
+#if RAYLIB_WITH_TBB
+#include <tbb/parallel_for.h>
+#endif  // RAYLIB_WITH_TBB
+
 namespace ray
 {
+namespace
+{
+/// The number of rays in each slice of a chunk, when processing the slices in parallel
+const size_t kSliceSize = 16384;
+
+inline int numSlices(size_t count)
+{
+  return static_cast<int>((count + kSliceSize - 1) / kSliceSize);
+}
+
+/// Calls @c process(slice, begin, end) on consecutive slices of @c count rays, in parallel. Each slice should write
+/// only to its own outputs, which can then be joined in slice order to give the same result as serial processing
+void forEachSlice(size_t count, const std::function<void(int slice, size_t begin, size_t end)> &process)
+{
+  const int num_slices = numSlices(count);
+  const auto process_slice = [&](int slice) {
+    const size_t begin = static_cast<size_t>(slice) * kSliceSize;
+    process(slice, begin, std::min(count, begin + kSliceSize));
+  };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for<int>(0, num_slices, process_slice);
+#else   // RAYLIB_WITH_TBB
+#pragma omp parallel for schedule(dynamic)
+  for (int slice = 0; slice < num_slices; slice++)
+  {
+    process_slice(slice);
+  }
+#endif  // RAYLIB_WITH_TBB
+}
+
+/// Append the rays of each of @c slices to @c cloud, in slice order
+void joinSlices(const std::vector<Cloud> &slices, Cloud &cloud)
+{
+  for (const auto &slice : slices)
+  {
+    cloud.starts.insert(cloud.starts.end(), slice.starts.begin(), slice.starts.end());
+    cloud.ends.insert(cloud.ends.end(), slice.ends.begin(), slice.ends.end());
+    cloud.times.insert(cloud.times.end(), slice.times.begin(), slice.times.end());
+    cloud.colours.insert(cloud.colours.end(), slice.colours.begin(), slice.colours.end());
+  }
+}
+}  // namespace
+
 /// This is a helper function to aid in splitting the cloud while chunk-loading it. The purpose is to be able to
 /// split clouds of any size, without running out of main memory.
-bool split(const std::string &file_name, const std::string &in_name, const std::string &out_name,
-           std::function<bool(const Cloud &cloud, int i)> is_outside)
+bool splitChunks(const std::string &file_name, const std::string &in_name, const std::string &out_name,
+                 const std::function<void(const Cloud &chunk, std::vector<uint8_t> &outside)> &classify)
 {
-  Cloud cloud_buffer;
   CloudWriter in_writer, out_writer;
   if (!in_writer.begin(in_name))
     return false;
   if (!out_writer.begin(out_name))
     return false;
-  Cloud in_chunk, out_chunk;
+  Cloud chunk;
+  std::vector<uint8_t> outside;
+  // the rays of one chunk are written in the background while the next chunk is read and classified
+  std::future<void> pending_write;
 
-  /// move each ray into either the in_chunk or out_chunk, depending on the condition function is_outside
-  auto per_chunk = [&cloud_buffer, &in_writer, &out_writer, &in_chunk, &out_chunk, &is_outside](
-                     std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
-                     std::vector<double> &times, std::vector<RGBA> &colours) {
-    // I move these into the cloud buffer, so that they can be indexed easily in is_outside (by index).
-    cloud_buffer.starts = starts;
-    cloud_buffer.ends = ends;
-    cloud_buffer.times = times;
-    cloud_buffer.colours = colours;
+  /// move each ray into either the in_chunk or out_chunk, depending on the classification
+  auto per_chunk = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                       std::vector<double> &times, std::vector<RGBA> &colours) {
+    // borrow the chunk's arrays, so that the classifier can index them as a cloud without copying them
+    chunk.starts.swap(starts);
+    chunk.ends.swap(ends);
+    chunk.times.swap(times);
+    chunk.colours.swap(colours);
+    outside.resize(chunk.ends.size());
+    classify(chunk, outside);
+
+    auto in_chunk = std::make_shared<Cloud>(), out_chunk = std::make_shared<Cloud>();
+    for (size_t i = 0; i < chunk.ends.size(); i++)
+    {
+      Cloud &cloud = outside[i] ? *out_chunk : *in_chunk;
+      cloud.addRay(chunk.starts[i], chunk.ends[i], chunk.times[i], chunk.colours[i]);
+    }
+    chunk.starts.swap(starts);
+    chunk.ends.swap(ends);
+    chunk.times.swap(times);
+    chunk.colours.swap(colours);
 
-    for (int i = 0; i < (int)cloud_buffer.ends.size(); i++)
+    if (pending_write.valid())
     {
-      Cloud &cloud = is_outside(cloud_buffer, i) ? out_chunk : in_chunk;
-      cloud.addRay(cloud_buffer.starts[i], cloud_buffer.ends[i], cloud_buffer.times[i], cloud_buffer.colours[i]);
+      pending_write.wait();
     }
-    in_writer.writeChunk(in_chunk);
-    out_writer.writeChunk(out_chunk);
-    in_chunk.clear();
-    out_chunk.clear();
+    pending_write = std::async(std::launch::async, [&in_writer, &out_writer, in_chunk, out_chunk]() {
+      in_writer.writeChunk(*in_chunk);
+      out_writer.writeChunk(*out_chunk);
+    });
   };
-  if (!Cloud::read(file_name, per_chunk))
-    return false;
+  const bool read_ok = Cloud::read(file_name, per_chunk);
+  if (pending_write.valid())
+  {
+    pending_write.wait();
+  }
   in_writer.end();
   out_writer.end();
-  return true;
+  return read_ok;
+}
+
+bool split(const std::string &file_name, const std::string &in_name, const std::string &out_name,
+           std::function<bool(const Cloud &cloud, int i)> is_outside)
+{
+  return splitChunks(file_name, in_name, out_name, [&is_outside](const Cloud &chunk, std::vector<uint8_t> &outside) {
+    for (int i = 0; i < (int)chunk.ends.size(); i++)
+    {
+      outside[i] = is_outside(chunk, i);
+    }
+  });
 }
 
 /// Special case for splitting around a plane.
@@ -245,39 +321,51 @@ bool splitBox(const std::string &file_name, const std::string &in_name, const st
   if (!outside_writer.begin(out_name))
     return false;
   Cloud in_chunk, out_chunk;
+  // each slice of a chunk is clipped on its own thread, into its own buffers
+  std::vector<Cloud> in_slices, out_slices;
 
   // splitting per chunk
   auto per_chunk = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
                        std::vector<double> &times, std::vector<RGBA> &colours) {
-    // I move these into the cloud buffer, so that they can be indexed easily in fptr (by index).
     const Cuboid cuboid(centre - extents, centre + extents);
-    for (size_t i = 0; i < ends.size(); i++)
-    {
-      Eigen::Vector3d start = starts[i];
-      Eigen::Vector3d end = ends[i];
-      if (cuboid.clipRay(start, end))  // true if ray intersects the cuboid
+    in_slices.resize(numSlices(ends.size()));
+    out_slices.resize(in_slices.size());
+    auto clip_slice = [&](int slice, size_t begin, size_t end_index) {
+      Cloud &in_slice = in_slices[slice];
+      Cloud &out_slice = out_slices[slice];
+      in_slice.clear();
+      out_slice.clear();
+      for (size_t i = begin; i < end_index; i++)
       {
-        RGBA col = colours[i];
-        if (!cuboid.intersects(ends[i]))  // mark as unbounded for the in_chunk
-        {
-          col.red = col.green = col.blue = col.alpha = 0;
-        }
-        in_chunk.addRay(start, end, times[i], col);
-        if (start != starts[i])  // start part is clipped
+        Eigen::Vector3d start = starts[i];
+        Eigen::Vector3d end = ends[i];
+        if (cuboid.clipRay(start, end))  // true if ray intersects the cuboid
         {
-          col.red = col.green = col.blue = col.alpha = 0;
-          out_chunk.addRay(starts[i], start, times[i], col);
+          RGBA col = colours[i];
+          if (!cuboid.intersects(ends[i]))  // mark as unbounded for the in_chunk
+          {
+            col.red = col.green = col.blue = col.alpha = 0;
+          }
+          in_slice.addRay(start, end, times[i], col);
+          if (start != starts[i])  // start part is clipped
+          {
+            col.red = col.green = col.blue = col.alpha = 0;
+            out_slice.addRay(starts[i], start, times[i], col);
+          }
+          if (ends[i] != end)  // end part is clipped
+          {
+            out_slice.addRay(end, ends[i], times[i], colours[i]);
+          }
         }
-        if (ends[i] != end)  // end part is clipped
+        else  // no intersection
         {
-          out_chunk.addRay(end, ends[i], times[i], colours[i]);
+          out_slice.addRay(starts[i], ends[i], times[i], colours[i]);
         }
       }
-      else  // no intersection
-      {
-        out_chunk.addRay(starts[i], ends[i], times[i], colours[i]);
-      }
-    }
+    };
+    forEachSlice(ends.size(), clip_slice);
+    joinSlices(in_slices, in_chunk);
+    joinSlices(out_slices, out_chunk);
     inside_writer.writeChunk(in_chunk);
     outside_writer.writeChunk(out_chunk);
     in_chunk.clear();
@@ -333,37 +421,44 @@ bool splitGrid(const std::string &file_name, const std::string &cloud_name_stub,
   const int time_dimension = static_cast<int>(
     max_time - min_time);  // the difference won't overflow integers. We don't scan for 20 years straight.
 
-  const int length = dimensions[0] * dimensions[1] * dimensions[2] * time_dimension;
+  const long int length = static_cast<long int>(dimensions[0]) * static_cast<long int>(dimensions[1]) *
+                          static_cast<long int>(dimensions[2]) * static_cast<long int>(time_dimension);
   std::cout << "splitting into maximum of: " << length << " files" << std::endl;
-  if (length > 50000)
+  if (length > 1000000)
   {
-    std::cerr << "error: output of over 50,000 files is probably a mistake, exiting" << std::endl;
+    std::cerr << "error: output of over 1,000,000 files is probably a mistake, exiting" << std::endl;
     return false;
   }
-  const int max_open_files = 256;
-  if (length > max_open_files)
-  {
-    std::cout << "Warning: nominally more than " << max_open_files << " file pointers will be open at once." << std::endl;
-    std::cout << "Diving the operation into " << 1+length/max_open_files << " passes" << std::endl;
-  }
-  for (int pass = 0; pass<length; pass+=max_open_files)
+  // a single pass, with the output files written through a limited pool of open files
+  CloudWriterPool cells;
+
+  /// a ray clipped to a grid cell
+  struct CellRay
   {
-    if (pass > 0)
-    {
-      std::cout << "Running pass " << 1 + pass/max_open_files << " / " << 1+length/max_open_files << std::endl;
-    }
-    std::vector<CloudWriter> cells(max_open_files);
-    std::vector<Cloud> chunks(max_open_files);
-
-    // splitting performed per chunk
-    auto per_chunk = [&min_index, &max_index, &width, min_time, &dimensions, &cells, &chunks, length, &cell_width,
-                      &cloud_name_stub, &overlap, &pass, &max_open_files ](std::vector<Eigen::Vector3d> &starts,
-                                                  std::vector<Eigen::Vector3d> &ends, std::vector<double> &times,
-                                                  std::vector<RGBA> &colours) {
-      for (size_t i = 0; i < ends.size(); i++)
+    long int index;
+    Eigen::Vector3i cell;
+    long int t;
+    Eigen::Vector3d start, end;
+    double time;
+    RGBA colour;
+  };
+  // each slice of a chunk is clipped on its own thread, into its own list of clipped rays
+  std::vector<std::vector<CellRay>> slices;
+
+  // splitting performed per chunk
+  auto per_chunk = [&min_index, &max_index, &width, min_time, &dimensions, &cells, &slices, length, &cell_width,
+                    &cloud_name_stub, &overlap](std::vector<Eigen::Vector3d> &starts,
+                                                std::vector<Eigen::Vector3d> &ends, std::vector<double> &times,
+                                                std::vector<RGBA> &colours) {
+    slices.resize(numSlices(ends.size()));
+    auto clip_slice = [&](int slice, size_t begin, size_t end_index) {
+      std::vector<CellRay> &cell_rays = slices[slice];
+      cell_rays.clear();
+      for (size_t i = begin; i < end_index; i++)
       {
         // get set of cells that the ray may intersect
-        const Eigen::Vector3d from(0.5 + starts[i][0] / width[0], 0.5 + starts[i][1] / width[1], 0.5 + starts[i][2] / width[2]);
+        const Eigen::Vector3d from(0.5 + starts[i][0] / width[0], 0.5 + starts[i][1] / width[1],
+                                   0.5 + starts[i][2] / width[2]);
         const Eigen::Vector3d to(0.5 + ends[i][0] / width[0], 0.5 + ends[i][1] / width[1], 0.5 + ends[i][2] / width[2]);
         const Eigen::Vector3d pos0 = minVector(from, to) - Eigen::Vector3d(overlap, overlap, 0.0);
         const Eigen::Vector3d pos1 = maxVector(from, to) + Eigen::Vector3d(overlap, overlap, 0.0);
@@ -381,186 +476,139 @@ bool splitGrid(const std::string &file_name, const std::string &cloud_name_stub,
           {
             for (int z = minI[2]; z < maxI[2]; z++)
             {
-              const int time_dif = static_cast<int>(t - min_time);
-              int index = (x - min_index[0]) + dimensions[0] * (y - min_index[1]) +
-                                dimensions[0] * dimensions[1] * (z - min_index[2]) +
-                                dimensions[0] * dimensions[1] * dimensions[2] * time_dif;
+              const long int time_dif = t - min_time;
+              const long int index = static_cast<long int>(x - min_index[0]) +
+                                     static_cast<long int>(dimensions[0]) *
+                                       (static_cast<long int>(y - min_index[1]) +
+                                        static_cast<long int>(dimensions[1]) *
+                                          (static_cast<long int>(z - min_index[2]) +
+                                           static_cast<long int>(dimensions[2]) * time_dif));
               if (index < 0 || index >= length)
               {
                 std::cout << "Error: bad index: " << index << std::endl;  // this should not happen
                 return;
               }
-              index -= pass;
-              if (index < 0 || index >= max_open_files)
-                continue;
               // do actual clipping here....
               const Eigen::Vector3d box_min(((double)x - 0.5) * width[0] - overlap,
                                             ((double)y - 0.5) * width[1] - overlap, ((double)z - 0.5) * width[2]);
               const Eigen::Vector3d box_max(((double)x + 0.5) * width[0] + overlap,
                                             ((double)y + 0.5) * width[1] + overlap, ((double)z + 0.5) * width[2]);
               const Cuboid cuboid(box_min, box_max);
-              Eigen::Vector3d start = starts[i];
-              Eigen::Vector3d end = ends[i];
-
-              if (cuboid.clipRay(start, end))
+              CellRay cell_ray;
+              cell_ray.start = starts[i];
+              cell_ray.end = ends[i];
+              if (cuboid.clipRay(cell_ray.start, cell_ray.end))
               {
-                RGBA col = colours[i];
-                if (cells[index].fileName().empty())  // first time in this cell, so start writing to a new file
-                {
-                  std::stringstream name;
-                  name << cloud_name_stub;
-                  if (cell_width[0] > 0.0)
-                    name << "_" << x;
-                  if (cell_width[1] > 0.0)
-                    name << "_" << y;
-                  if (cell_width[2] > 0.0)
-                    name << "_" << z;
-                  if (cell_width[3] > 0.0)
-                    name << "_" << t;
-                  name << ".ply";
-                  cells[index].begin(name.str());
-                }
+                cell_ray.index = index;
+                cell_ray.cell = Eigen::Vector3i(x, y, z);
+                cell_ray.t = t;
+                cell_ray.time = times[i];
+                cell_ray.colour = colours[i];
                 if (!cuboid.intersects(ends[i]))  // end point is outside, so mark an unbounded ray
                 {
-                  col.red = col.green = col.blue = col.alpha = 0;
+                  cell_ray.colour.red = cell_ray.colour.green = cell_ray.colour.blue = cell_ray.colour.alpha = 0;
                 }
-                chunks[index].addRay(start, end, times[i], col);
+                cell_rays.push_back(cell_ray);
               }
             }
           }
         }
       }
-      for (int i = 0; i < max_open_files; i++)
+    };
+    forEachSlice(ends.size(), clip_slice);
+
+    // add the clipped rays to their cells in ray order
+    for (const auto &cell_rays : slices)
+    {
+      for (const auto &cell_ray : cell_rays)
       {
-        if (chunks[i].ends.size() > 0)
+        if (!cells.has(cell_ray.index))  // first time in this cell, so start writing to a new file
         {
-          cells[i].writeChunk(chunks[i]);
-          chunks[i].clear();
+          std::stringstream name;
+          name << cloud_name_stub;
+          if (cell_width[0] > 0.0)
+            name << "_" << cell_ray.cell[0];
+          if (cell_width[1] > 0.0)
+            name << "_" << cell_ray.cell[1];
+          if (cell_width[2] > 0.0)
+            name << "_" << cell_ray.cell[2];
+          if (cell_width[3] > 0.0)
+            name << "_" << cell_ray.t;
+          name << ".ply";
+          cells.create(cell_ray.index, name.str());
         }
+        cells.addRay(cell_ray.index, cell_ray.start, cell_ray.end, cell_ray.time, cell_ray.colour);
       }
-    };
-    if (!Cloud::read(file_name, per_chunk))
-      return false;
-
-    for (int i = 0; i < max_open_files; i++)
-    {
-      cells[i].end();  // has no effect on writers where begin has not been called
     }
-  }
-  return true;
+    cells.flush();
+  };
+  if (!Cloud::read(file_name, per_chunk))
+    return false;
+  return cells.end();
 }
 
-class RGBALess
-{
-public:
-  bool operator()(const RGBA &a, const RGBA &b) const
-  {
-    if (a.red != b.red)
-      return a.red < b.red;
-    if (a.green != b.green)
-      return a.green < b.green;
-    return a.blue < b.blue;
-  }
-};
-
 /// Special case for splitting based on a colour
 bool splitColour(const std::string &file_name, const std::string &cloud_name_stub, bool seg_colour)
 {
-  std::map<RGBA, int, RGBALess> vox_map;
-  // firstly, find out how many different colours there are
-  int num_colours = 0;
-  auto count_colours = [&vox_map, &num_colours](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &,
-                                                std::vector<double> &, std::vector<ray::RGBA> &colours) {
-    for (auto &colour : colours)
-    {
-      if (vox_map.find(colour) == vox_map.end())
-      {
-        vox_map.insert(std::pair<RGBA, int>(colour, num_colours++));
-      }
-    }
-  };
-  if (!ray::Cloud::read(file_name, count_colours))
-    return false;
-
-  const int max_total_files = 5000; // raysplit colour more likely to be a mistake in this case
-  if (num_colours > max_total_files)
-  {
-    std::cerr << "Error: " << num_colours << " colours generates more than the maximum number of files: " << max_total_files << std::endl;
-    return false;
-  }
-  const int max_files_at_once = 512;  // operating systems will fail with too many open file pointers.
-  std::cout << "splitting into: " << num_colours << " files" << std::endl;
-  if (num_colours > max_files_at_once)
-  {
-    std::cout << "Warning: cloud has more unique colours than allowed for simultaneous files " << max_files_at_once << " so using multiple passes." << std::endl;
-  }
-  
-  int chunk_size = std::min(num_colours, max_files_at_once);
-
-  for (int batch = 0; batch < num_colours; batch+=max_files_at_once)
-  {
-    if (batch > 0)
+  // raysplit colour is more likely to be a mistake with many colours, whereas segmented forests can have many trees
+  const size_t max_total_files = seg_colour ? 1000000 : 5000;
+  // each colour's writer is created on first sight of that colour, so only one pass is needed, and the
+  // pool limits the number of files that are open at once
+  CloudWriterPool cells;
+  bool too_many_files = false;
+  std::vector<std::string> file_names;
+  auto per_chunk = [&cells, &cloud_name_stub, &too_many_files, &file_names, max_total_files, seg_colour](
+                     std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                     std::vector<double> &times, std::vector<RGBA> &colours) {
+    if (too_many_files)
     {
-      std::cout << "Running pass " << 1+batch/max_files_at_once << " / " << 1 + num_colours / max_files_at_once << std::endl;
+      return;
     }
-    std::vector<CloudWriter> cells(chunk_size);
-    std::vector<Cloud> chunks(chunk_size);
-
-    int batch_max = std::min(num_colours, batch + max_files_at_once);
-    if (num_colours > max_files_at_once)
+    for (size_t i = 0; i < ends.size(); i++)
     {
-      std::cout << "batch processing colours " << batch << ", to " << batch_max << std::endl;
-    }
-    // splitting performed per chunk
-    auto per_chunk = [&vox_map, &batch, &max_files_at_once, &chunk_size, &cells, &chunks, &cloud_name_stub, &num_colours, seg_colour](
-                      std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
-                      std::vector<double> &times, std::vector<RGBA> &colours) {
-      for (size_t i = 0; i < ends.size(); i++)
+      const RGBA &colour = colours[i];
+      // the alpha channel is not part of the colour, it only records whether the ray is bounded
+      const int64_t id = (int64_t(colour.red) << 16) | (int64_t(colour.green) << 8) | int64_t(colour.blue);
+      if (!cells.has(id))  // first time for this colour, so start writing to a new file
       {
-        RGBA colour = colours[i];
-        const auto &vox = vox_map.find(colour);
-        if (vox != vox_map.end())
+        if (cells.size() >= max_total_files)
         {
-          int index = vox->second - batch;
-          if (index < 0 || index >= max_files_at_once)
-          {
-            continue; // ignores as this ray will not go into this batch
-          }
-
-          if (cells[index].fileName().empty())  // first time in this cell, so start writing to a new file
-          {
-            std::stringstream name;
-            if (seg_colour)
-            {
-              name << cloud_name_stub << "_" << convertColourToInt(colour) << ".ply";
-            }
-            else
-            {
-              name << cloud_name_stub << "_" << (int)colour.red << "_" << (int)colour.green << "_" << (int)colour.blue << ".ply";
-            }
-            cells[index].begin(name.str());
-          }
-          chunks[index].addRay(starts[i], ends[i], times[i], colours[i]);
+          std::cerr << "Error: cloud has more colours than the maximum number of files: " << max_total_files
+                    << std::endl;
+          too_many_files = true;
+          return;
         }
-      }
-      for (int i = 0; i < chunk_size; i++)
-      {
-        if (chunks[i].ends.size() > 0)
+        std::stringstream name;
+        if (seg_colour)
+        {
+          name << cloud_name_stub << "_" << convertColourToInt(colour) << ".ply";
+        }
+        else
         {
-          cells[i].writeChunk(chunks[i]);
-          chunks[i].clear();
+          name << cloud_name_stub << "_" << (int)colour.red << "_" << (int)colour.green << "_" << (int)colour.blue
+               << ".ply";
         }
+        cells.create(id, name.str());
+        file_names.push_back(name.str());
       }
-    };
-    if (!Cloud::read(file_name, per_chunk))
-      return false;
-
-    for (int i = 0; i < chunk_size; i++)
+      cells.addRay(id, starts[i], ends[i], times[i], colour);
+    }
+    cells.flush();
+  };
+  const bool read_ok = Cloud::read(file_name, per_chunk);
+  const size_t num_files = cells.size();
+  const bool write_ok = cells.end();
+  if (!read_ok || too_many_files)
+  {
+    // don't leave a partial split behind
+    for (const auto &name : file_names)
     {
-      cells[i].end();  // has no effect on writers where begin has not been called
+      std::remove(name.c_str());
     }
+    return false;
   }
-  return true;
+  std::cout << "split into: " << num_files << " files" << std::endl;
+  return write_ok;
 }
 
 }  // namespace ray
@@ -6,6 +6,7 @@
 #ifndef RAYLIB_RAYSPLITTER_H
 #define RAYLIB_RAYSPLITTER_H
 
+#include <functional>
 #include <iostream>
 #include <limits>
 #include "raycloud.h"
@@ -13,7 +14,29 @@
 
 namespace ray
 {
+/// Split a file into @c in_name or @c out_name, where @c classify sets @c outside[i] for each ray i of a chunk.
+/// Each chunk is classified while the previous chunk is written out in the background.
+bool RAYLIB_EXPORT splitChunks(const std::string &file_name, const std::string &in_name, const std::string &out_name,
+                               const std::function<void(const Cloud &chunk, std::vector<uint8_t> &outside)> &classify);
+
+/// Split a file into @c in_name or @c out_name depending on the predicate @c is_outside(cloud, i).
+/// The predicate is inlined and evaluated in parallel over each chunk, so it must be safe to call concurrently.
+template <class IsOutside>
+bool splitIf(const std::string &file_name, const std::string &in_name, const std::string &out_name,
+             IsOutside is_outside)
+{
+  return splitChunks(file_name, in_name, out_name, [&is_outside](const Cloud &chunk, std::vector<uint8_t> &outside) {
+    const int count = static_cast<int>(chunk.ends.size());
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < count; i++)
+    {
+      outside[i] = is_outside(chunk, i);
+    }
+  });
+}
+
 /// Split a file into @c in_name or @c out_name depending on the function @c is_outside.
+/// The function is called serially, in ray order. Use splitIf for predicates that can be evaluated in parallel.
 bool RAYLIB_EXPORT split(const std::string &file_name, const std::string &in_name, const std::string &out_name,
                          std::function<bool(const Cloud &cloud, int i)> is_outside);
 
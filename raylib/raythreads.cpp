@@ -9,6 +9,8 @@
 
 #if RAYLIB_WITH_TBB
 #include <tbb/task_scheduler_init.h>
+#elif defined(_OPENMP)
+#include <omp.h>
 #endif  // RAYLIB_WITH_TBB
 
 using namespace ray;
@@ -24,6 +26,8 @@ int Threads::availableThreads()
 {
 #if RAYLIB_WITH_TBB
   return tbb::task_scheduler_init::default_num_threads();
+#elif defined(_OPENMP)
+  return omp_get_max_threads();
 #else   // RAYLIB_WITH_TBB
   return 1;  // Single threaded.
 #endif  // RAYLIB_WITH_TBB
@@ -32,7 +32,7 @@ public:
   static const int MaxRecommendedThreads = 8;
 
   /// Returns the number of available threads. When built with Intel TBB, this returns the number of available
-  /// processors. Without TBB, this returns 1.
+  /// processors. Otherwise it is the OpenMP thread count, or 1 without OpenMP.
   static int availableThreads();
 
   /// Query the recommended thread count. This is set at least two threads if available, prefering one less than the
@@ -0,0 +1,354 @@
+// Copyright (c) 2023
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raytiledcloud.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+
+namespace ray
+{
+void CloudTile::clear()
+{
+  cloud.clear();
+  ids.clear();
+  owned.clear();
+}
+
+TiledCloud::TiledCloud(double tile_width, double halo, size_t max_buffered_rays)
+  : tile_width_(tile_width)
+  , halo_(halo)
+  , max_buffered_rays_(max_buffered_rays)
+  , num_buffered_rays_(0)
+  , num_rays_(0)
+  , min_bound_(0, 0)
+  , dims_(0, 0)
+  , has_tiling_bound_(false)
+  , tiling_bound_(Eigen::Vector3d::Zero(), Eigen::Vector3d::Zero())
+  , has_tile_mask_(false)
+{}
+
+TiledCloud::~TiledCloud()
+{
+  removeTemporaries();
+}
+
+std::string TiledCloud::tileFileName(int x, int y) const
+{
+  std::stringstream name;
+  name << temp_stub_ << "_tile_" << x << "_" << y << ".tmp";
+  return name.str();
+}
+
+Eigen::Vector2i TiledCloud::tileIndex(const Eigen::Vector3d &point) const
+{
+  const Eigen::Vector2d pos = (Eigen::Vector2d(point[0], point[1]) - min_bound_) / tile_width_;
+  const Eigen::Vector2i index(static_cast<int>(std::floor(pos[0])), static_cast<int>(std::floor(pos[1])));
+  return index.cwiseMax(Eigen::Vector2i(0, 0)).cwiseMin(Eigen::Vector2i(dims_[0] - 1, dims_[1] - 1));
+}
+
+/// whether the horizontal projection of the segment @c start to @c end overlaps the rectangle @c box_min to @c box_max
+static bool segmentOverlapsRectangle(const Eigen::Vector3d &start, const Eigen::Vector3d &end,
+                                     const Eigen::Vector2d &box_min, const Eigen::Vector2d &box_max)
+{
+  double t0 = 0.0, t1 = 1.0;
+  for (int i = 0; i < 2; i++)
+  {
+    const double dir = end[i] - start[i];
+    if (dir == 0.0)
+    {
+      if (start[i] < box_min[i] || start[i] > box_max[i])
+      {
+        return false;
+      }
+      continue;
+    }
+    double ta = (box_min[i] - start[i]) / dir;
+    double tb = (box_max[i] - start[i]) / dir;
+    if (ta > tb)
+    {
+      std::swap(ta, tb);
+    }
+    t0 = std::max(t0, ta);
+    t1 = std::min(t1, tb);
+    if (t0 > t1)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool TiledCloud::load(const std::string &file_name, const std::string &temp_stub, bool include_unbounded,
+                      bool include_passing)
+{
+  removeTemporaries();
+  tiles_.clear();
+  dims_ = Eigen::Vector2i(0, 0);
+  temp_stub_ = temp_stub;
+  num_buffered_rays_ = 0;
+  num_rays_ = 0;
+
+  Cloud::Info info;
+  if (!Cloud::getInfo(file_name, info))
+  {
+    return false;
+  }
+  if ((include_unbounded ? info.num_rays : info.num_bounded) == 0)
+  {
+    num_rays_ = info.num_rays;
+    return true;
+  }
+  // rays_bound is the bound of all end points
+  const Cuboid &bound =
+    has_tiling_bound_ ? tiling_bound_ : (include_unbounded ? info.rays_bound : info.ends_bound);
+  const Eigen::Vector3d &min_bound = bound.min_bound_;
+  const Eigen::Vector3d &max_bound = bound.max_bound_;
+  min_bound_ = Eigen::Vector2d(min_bound[0], min_bound[1]);
+  for (int i = 0; i < 2; i++)
+  {
+    dims_[i] = std::max(1, static_cast<int>(std::ceil((max_bound[i] - min_bound[i]) / tile_width_)));
+  }
+  tiles_.resize(static_cast<size_t>(dims_[0]) * static_cast<size_t>(dims_[1]));
+  if (tiles_.size() > 1)
+  {
+    std::cout << "binning cloud into " << dims_[0] << " x " << dims_[1] << " tiles of width " << tile_width_
+              << " m, with a halo of " << halo_ << " m" << std::endl;
+  }
+
+  // whether the tile at x, y is binned into
+  const auto tile_active = [&](int x, int y) {
+    const size_t index = static_cast<size_t>(x) + static_cast<size_t>(dims_[0]) * static_cast<size_t>(y);
+    return !has_tile_mask_ || (index < tile_mask_.size() && tile_mask_[index]);
+  };
+  bool success = true;
+  auto bin_rays = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                      std::vector<double> &times, std::vector<RGBA> &colours) {
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+      const uint64_t id = num_rays_++;
+      if (colours[i].alpha == 0 && !include_unbounded)
+      {
+        continue;
+      }
+      const Eigen::Vector2d pos = (Eigen::Vector2d(ends[i][0], ends[i][1]) - min_bound_) / tile_width_;
+      const Eigen::Vector2d halo(halo_ / tile_width_, halo_ / tile_width_);
+      const Eigen::Vector2i own = tileIndex(ends[i]);
+      const Eigen::Vector2i max_index(dims_[0] - 1, dims_[1] - 1);
+      const Eigen::Vector2d low = pos - halo;
+      const Eigen::Vector2d high = pos + halo;
+      const Eigen::Vector2i index0 =
+        Eigen::Vector2i(static_cast<int>(std::floor(low[0])), static_cast<int>(std::floor(low[1])))
+          .cwiseMax(Eigen::Vector2i(0, 0));
+      const Eigen::Vector2i index1 =
+        Eigen::Vector2i(static_cast<int>(std::floor(high[0])), static_cast<int>(std::floor(high[1])))
+          .cwiseMin(max_index);
+
+      TileRay ray;
+      ray.start = starts[i];
+      ray.end = ends[i];
+      ray.time = times[i];
+      ray.colour = colours[i];
+      ray.id = id;
+      const Eigen::Vector2i end_min = index0.cwiseMin(own), end_max = index1.cwiseMax(own);
+      for (int x = end_min[0]; x <= end_max[0]; x++)
+      {
+        for (int y = end_min[1]; y <= end_max[1]; y++)
+        {
+          if (!tile_active(x, y))
+          {
+            continue;
+          }
+          ray.owned = x == own[0] && y == own[1] ? 1 : 0;
+          tiles_[x + dims_[0] * y].rays.push_back(ray);
+          num_buffered_rays_++;
+        }
+      }
+      if (include_passing)
+      {
+        // add the ray to the other tiles whose halo-padded area it passes through
+        const Eigen::Vector2d start = (Eigen::Vector2d(starts[i][0], starts[i][1]) - min_bound_) / tile_width_;
+        const Eigen::Vector2d low2 = start.cwiseMin(pos) - halo;
+        const Eigen::Vector2d high2 = start.cwiseMax(pos) + halo;
+        const Eigen::Vector2i pass_min =
+          Eigen::Vector2i(static_cast<int>(std::floor(low2[0])), static_cast<int>(std::floor(low2[1])))
+            .cwiseMax(Eigen::Vector2i(0, 0));
+        const Eigen::Vector2i pass_max =
+          Eigen::Vector2i(static_cast<int>(std::floor(high2[0])), static_cast<int>(std::floor(high2[1])))
+            .cwiseMin(max_index);
+        ray.owned = 0;
+        for (int x = pass_min[0]; x <= pass_max[0]; x++)
+        {
+          for (int y = pass_min[1]; y <= pass_max[1]; y++)
+          {
+            if ((x >= end_min[0] && x <= end_max[0] && y >= end_min[1] && y <= end_max[1]) || !tile_active(x, y))
+            {
+              continue;  // already added from its end point, or not binned into
+            }
+            const Eigen::Vector2d box_min = min_bound_ + tile_width_ * Eigen::Vector2d(x, y);
+            const Eigen::Vector2d box_max = box_min + Eigen::Vector2d(tile_width_, tile_width_);
+            const Eigen::Vector2d pad(halo_, halo_);
+            if (segmentOverlapsRectangle(starts[i], ends[i], box_min - pad, box_max + pad))
+            {
+              tiles_[x + dims_[0] * y].rays.push_back(ray);
+              num_buffered_rays_++;
+            }
+          }
+        }
+      }
+    }
+    // move the tiles out to disk once they exceed the memory limit
+    if (num_buffered_rays_ > max_buffered_rays_)
+    {
+      success &= spill();
+    }
+  };
+  if (!Cloud::read(file_name, bin_rays))
+  {
+    return false;
+  }
+  return success;
+}
+
+void TiledCloud::setTilingBound(const Cuboid &bound)
+{
+  tiling_bound_ = bound;
+  has_tiling_bound_ = true;
+}
+
+void TiledCloud::setTileMask(const std::vector<uint8_t> &mask)
+{
+  tile_mask_ = mask;
+  has_tile_mask_ = true;
+}
+
+std::vector<uint8_t> TiledCloud::occupiedTiles() const
+{
+  std::vector<uint8_t> occupied(tiles_.size());
+  for (size_t i = 0; i < tiles_.size(); i++)
+  {
+    occupied[i] = tiles_[i].spilled || !tiles_[i].rays.empty();
+  }
+  return occupied;
+}
+
+bool TiledCloud::spill()
+{
+  for (int y = 0; y < dims_[1]; y++)
+  {
+    for (int x = 0; x < dims_[0]; x++)
+    {
+      TileBuffer &tile = tiles_[x + dims_[0] * y];
+      if (tile.rays.empty())
+      {
+        continue;
+      }
+      // opening in append mode per spill, rather than keeping files open, avoids operating system file limits
+      std::ofstream ofs(tileFileName(x, y), std::ios::binary | std::ios::out | std::ios::app);
+      ofs.write(reinterpret_cast<const char *>(&tile.rays[0]), tile.rays.size() * sizeof(TileRay));
+      if (!ofs.good())
+      {
+        std::cerr << "Error: cannot write temporary tile file " << tileFileName(x, y) << std::endl;
+        return false;
+      }
+      tile.spilled = true;
+      tile.rays.clear();
+      tile.rays.shrink_to_fit();
+    }
+  }
+  num_buffered_rays_ = 0;
+  return true;
+}
+
+bool TiledCloud::forEachTile(std::function<void(CloudTile &tile)> process)
+{
+  CloudTile tile;
+  for (int y = 0; y < dims_[1]; y++)
+  {
+    for (int x = 0; x < dims_[0]; x++)
+    {
+      if (!extractTile(Eigen::Vector2i(x, y), tile))
+      {
+        return false;
+      }
+      if (tile.ids.empty())
+      {
+        continue;
+      }
+      process(tile);
+    }
+  }
+  num_buffered_rays_ = 0;
+  return true;
+}
+
+bool TiledCloud::extractTile(const Eigen::Vector2i &index, CloudTile &tile)
+{
+  tile.clear();
+  tile.index = index;
+  if (index[0] < 0 || index[1] < 0 || index[0] >= dims_[0] || index[1] >= dims_[1])
+  {
+    return true;
+  }
+  TileBuffer &buffer = tiles_[index[0] + dims_[0] * index[1]];
+  std::vector<TileRay> rays;
+  if (buffer.spilled)
+  {
+    const std::string name = tileFileName(index[0], index[1]);
+    std::ifstream ifs(name, std::ios::binary | std::ios::in);
+    ifs.seekg(0, ifs.end);
+    const size_t num_spilled = static_cast<size_t>(ifs.tellg()) / sizeof(TileRay);
+    ifs.seekg(0, ifs.beg);
+    rays.resize(num_spilled);
+    if (num_spilled > 0)
+    {
+      ifs.read(reinterpret_cast<char *>(&rays[0]), num_spilled * sizeof(TileRay));
+    }
+    if (!ifs.good())
+    {
+      std::cerr << "Error: cannot read temporary tile file " << name << std::endl;
+      return false;
+    }
+    ifs.close();
+    std::remove(name.c_str());
+    buffer.spilled = false;
+  }
+  // the in-memory rays come after the spilled ones in file order
+  rays.insert(rays.end(), buffer.rays.begin(), buffer.rays.end());
+  num_buffered_rays_ -= std::min(num_buffered_rays_, buffer.rays.size());
+  buffer.rays.clear();
+  buffer.rays.shrink_to_fit();
+
+  tile.cloud.reserve(rays.size());
+  tile.ids.reserve(rays.size());
+  tile.owned.reserve(rays.size());
+  for (const auto &ray : rays)
+  {
+    tile.cloud.addRay(ray.start, ray.end, ray.time, ray.colour);
+    tile.ids.push_back(ray.id);
+    tile.owned.push_back(ray.owned);
+  }
+  return true;
+}
+
+void TiledCloud::removeTemporaries()
+{
+  for (int y = 0; y < dims_[1]; y++)
+  {
+    for (int x = 0; x < dims_[0]; x++)
+    {
+      TileBuffer &buffer = tiles_[x + dims_[0] * y];
+      if (buffer.spilled)
+      {
+        std::remove(tileFileName(x, y).c_str());
+        buffer.spilled = false;
+      }
+    }
+  }
+}
+
+}  // namespace ray
@@ -0,0 +1,242 @@
+// Copyright (c) 2023
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYTILEDCLOUD_H
+#define RAYLIB_RAYTILEDCLOUD_H
+
+#include "raylib/raylibconfig.h"
+
+#include "raycloud.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+namespace ray
+{
+/// The rays of a single horizontal tile of a ray cloud, together with the rays in a halo around it. The halo
+/// rays are only present as neighbours, so that neighbourhood operations such as @c Cloud::getSurfels give the same
+/// result on the tile's own rays as they would on the full cloud.
+struct RAYLIB_EXPORT CloudTile
+{
+  Cloud cloud;
+  /// index of each ray within the source ray cloud file
+  std::vector<uint64_t> ids;
+  /// non-zero for rays belonging to this tile, zero for halo rays
+  std::vector<uint8_t> owned;
+  /// horizontal coordinate of the tile
+  Eigen::Vector2i index;
+
+  void clear();
+};
+
+/// Bins the bounded rays of a ray cloud file into a horizontal grid of square tiles with overlapping halos, on a
+/// single chunked read. Tiles are buffered in memory up to @c max_buffered_rays, beyond which they are spilled to
+/// temporary files, so the memory use is bounded by the tile size rather than the cloud size.
+/// Tiles are then visited one at a time by @c forEachTile.
+class RAYLIB_EXPORT TiledCloud
+{
+public:
+  /// @c tile_width and @c halo are in metres. A neighbourhood of points is complete when it fits within the @c halo
+  TiledCloud(double tile_width, double halo, size_t max_buffered_rays = 10000000);
+  ~TiledCloud();
+
+  /// Read @c file_name and bin its rays into tiles. Temporary files are named with the prefix @c temp_stub.
+  /// Unbounded rays are only binned when @c include_unbounded is set, in which case the tiles cover all end points.
+  /// When @c include_passing is set, rays that pass through a tile or its halo are also added to that tile as halo
+  /// rays, so that ray casting within a tile sees every ray that crosses it
+  bool load(const std::string &file_name, const std::string &temp_stub, bool include_unbounded = false,
+            bool include_passing = false);
+
+  /// Tile over @c bound on subsequent calls to @c load , rather than over the bound of the loaded file. This gives
+  /// several clouds the same tiles, so they can be processed together one tile at a time
+  void setTilingBound(const Cuboid &bound);
+
+  /// Only bin rays into the tiles with non-zero @c mask entries on subsequent calls to @c load , indexed by
+  /// x + y * tileDims()[0]. The mask is typically the @c occupiedTiles of another cloud with the same tiling bound
+  void setTileMask(const std::vector<uint8_t> &mask);
+
+  /// Non-zero for each tile that holds rays, indexed by x + y * tileDims()[0]
+  std::vector<uint8_t> occupiedTiles() const;
+
+  /// Calls @c process on each non-empty tile in turn. Rays within each tile are in file order.
+  /// Each tile is released once processed.
+  bool forEachTile(std::function<void(CloudTile &tile)> process);
+
+  /// Move the rays of the tile at @c index into @c tile , releasing them from the tiled cloud. Rays are in file order.
+  /// The tile can be empty
+  bool extractTile(const Eigen::Vector2i &index, CloudTile &tile);
+
+  /// The tile that owns the rays ending at @c point, points outside the tiled area belong to the nearest tile
+  Eigen::Vector2i tileIndex(const Eigen::Vector3d &point) const;
+
+  /// The number of rays in the loaded file, including unbounded rays
+  inline size_t rayCount() const { return num_rays_; }
+  /// The number of tiles, including empty ones
+  inline size_t tileCount() const { return tiles_.size(); }
+  /// The number of tiles along x and y
+  inline const Eigen::Vector2i &tileDims() const { return dims_; }
+
+private:
+  /// the storage format for a ray in the tile buffers and spill files
+  struct TileRay
+  {
+    Eigen::Vector3d start;
+    Eigen::Vector3d end;
+    double time;
+    RGBA colour;
+    uint8_t owned;
+    uint64_t id;
+  };
+  struct TileBuffer
+  {
+    std::vector<TileRay> rays;
+    bool spilled = false;
+  };
+  std::string tileFileName(int x, int y) const;
+  bool spill();
+  void removeTemporaries();
+
+  double tile_width_;
+  double halo_;
+  size_t max_buffered_rays_;
+  size_t num_buffered_rays_;
+  size_t num_rays_;
+  Eigen::Vector2d min_bound_;
+  Eigen::Vector2i dims_;
+  std::string temp_stub_;
+  std::vector<TileBuffer> tiles_;
+  bool has_tiling_bound_;
+  Cuboid tiling_bound_;
+  bool has_tile_mask_;
+  std::vector<uint8_t> tile_mask_;
+};
+
+/// A temporary file holding one fixed-size value per ray of a ray cloud file. Values can be written in any order,
+/// for example one tile at a time, and are read back sequentially in ray order, in step with @c Cloud::read.
+/// This allows tiled operations to reassemble their per-ray results without holding them in memory.
+template <class T>
+class RayValueFile
+{
+public:
+  ~RayValueFile() { close(); }
+
+  /// Create the zero-filled temporary file, with space for @c ray_count values
+  bool open(const std::string &file_name, size_t ray_count)
+  {
+    file_name_ = file_name;
+    file_.open(file_name, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+    if (file_.fail())
+    {
+      std::cerr << "Error: cannot open temporary file " << file_name << std::endl;
+      return false;
+    }
+    if (ray_count > 0)
+    {
+      file_.seekp(ray_count * sizeof(T) - 1);
+      file_.put(0);
+    }
+    ray_count_ = ray_count;
+    read_pos_ = 0;
+    pending_.clear();
+    return file_.good();
+  }
+
+  /// Write @c values at the ray indices @c ids. The ids of a spatial tile are scattered through the file, so writes
+  /// are buffered, and applied in id order one block of the file at a time. Returns false if the file could not be
+  /// updated.
+  bool write(const std::vector<uint64_t> &ids, const std::vector<T> &values)
+  {
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+      pending_.emplace_back(ids[i], values[i]);
+      if (pending_.size() >= max_pending_values && !flush())
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// Apply the buffered writes to the file. Each block of the file that they fall in is read, updated and written
+  /// back once. Returns false if the file could not be updated, discarding the buffered writes.
+  bool flush()
+  {
+    // stable, so that the latest write to an id is the one kept
+    std::stable_sort(pending_.begin(), pending_.end(),
+                     [](const std::pair<uint64_t, T> &a, const std::pair<uint64_t, T> &b) { return a.first < b.first; });
+    std::vector<T> block;
+    for (size_t i = 0; i < pending_.size();)
+    {
+      const uint64_t block_start = (pending_[i].first / block_values) * block_values;
+      const uint64_t block_end = std::min<uint64_t>(block_start + block_values, ray_count_);
+      block.resize(block_end - block_start);
+      file_.seekg(block_start * sizeof(T));
+      file_.read(reinterpret_cast<char *>(&block[0]), block.size() * sizeof(T));
+      for (; i < pending_.size() && pending_[i].first < block_end; i++)
+      {
+        block[pending_[i].first - block_start] = pending_[i].second;
+      }
+      file_.seekp(block_start * sizeof(T));
+      file_.write(reinterpret_cast<const char *>(&block[0]), block.size() * sizeof(T));
+      if (!file_)
+      {
+        std::cerr << "Error: cannot update temporary file " << file_name_ << std::endl;
+        pending_.clear();
+        return false;
+      }
+    }
+    pending_.clear();
+    return true;
+  }
+
+  /// Read the next @c count values in ray order into @c values . Returns false if the buffered writes could not be
+  /// applied or the values could not be read.
+  bool read(size_t count, std::vector<T> &values)
+  {
+    if (!pending_.empty() && !flush())
+    {
+      return false;
+    }
+    values.resize(count);
+    file_.seekg(read_pos_ * sizeof(T));
+    if (count > 0)
+    {
+      file_.read(reinterpret_cast<char *>(&values[0]), count * sizeof(T));
+    }
+    read_pos_ += count;
+    return file_.good();
+  }
+
+  /// Close and remove the temporary file
+  void close()
+  {
+    if (file_name_.empty())
+    {
+      return;
+    }
+    file_.close();
+    std::remove(file_name_.c_str());
+    file_name_.clear();
+    pending_.clear();
+  }
+
+private:
+  static constexpr size_t max_pending_values = 1 << 20;
+  static constexpr uint64_t block_values = 4096;
+  std::fstream file_;
+  std::string file_name_;
+  size_t read_pos_ = 0;
+  uint64_t ray_count_ = 0;
+  std::vector<std::pair<uint64_t, T>> pending_;
+};
+
+}  // namespace ray
+
+#endif  // RAYLIB_RAYTILEDCLOUD_H
@@ -8,6 +8,7 @@
 
 #include "raylib/raylibconfig.h"
 #include "rayrandom.h"
+#include "rayvoxelset.h"
 
 #include <Eigen/Dense>
 #include <algorithm>
@@ -15,6 +16,7 @@
 #include <chrono>
 #include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
@@ -110,16 +112,14 @@ public:
   }
 };
 
+/// Append to @c indices the first of @c points in each voxel that is not already in @c vox_set, adding the voxel to it
 inline void voxelSubsample(const std::vector<Eigen::Vector3d> &points, double voxel_width,
-                           std::vector<int64_t> &indices, std::set<Eigen::Vector3i, Vector3iLess> &vox_set)
+                           std::vector<int64_t> &indices, VoxelSet &vox_set)
 {
   for (int64_t i = 0; i < (int64_t)points.size(); i++)
   {
-    Eigen::Vector3i voxel(int(std::floor(points[i][0] / voxel_width)), int(std::floor(points[i][1] / voxel_width)),
-                          int(std::floor(points[i][2] / voxel_width)));
-    if (vox_set.find(voxel) == vox_set.end())
+    if (vox_set.insert(voxelIndex(points[i], voxel_width)))
     {
-      vox_set.insert(voxel);
       indices.push_back(i);
     }
   }
@@ -128,7 +128,7 @@ inline void voxelSubsample(const std::vector<Eigen::Vector3d> &points, double vo
 inline void voxelSubsample(const std::vector<Eigen::Vector3d> &points, double voxel_width,
                            std::vector<int64_t> &indices)
 {
-  std::set<Eigen::Vector3i, Vector3iLess> vox_set;
+  VoxelSet vox_set;
   voxelSubsample(points, voxel_width, indices, vox_set);
 }
 
@@ -269,6 +269,34 @@ inline void colourByTime(const std::vector<double> &values, std::vector<RGBA> &g
   redGreenBlueSpectrum(values, gradient, colour_repeat_period, replace_alpha);
 }
 
+/// An unsigned integer with the same order as @c time, so that times and other sort keys can be compared alike
+inline uint64_t timeSortKey(double time)
+{
+  uint64_t bits;
+  std::memcpy(&bits, &time, sizeof(bits));
+  const uint64_t sign_bit = uint64_t(1) << 63;
+  return (bits & sign_bit) ? ~bits : (bits | sign_bit);
+}
+
+/// The 3D Morton (Z-order) code of the non-negative voxel @c index , interleaving the lower 21 bits of each axis.
+/// Sorting by this code keeps nearby voxels close together in the order
+inline uint64_t mortonCode(const Eigen::Vector3i &index)
+{
+  uint64_t code = 0;
+  for (int i = 0; i < 3; i++)
+  {
+    // spread the bits of the coordinate out to every third bit
+    uint64_t x = static_cast<uint64_t>(index[i]) & 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffff;
+    x = (x | x << 16) & 0x1f0000ff0000ff;
+    x = (x | x << 8) & 0x100f00f00f00f00f;
+    x = (x | x << 4) & 0x10c30c30c30c30c3;
+    x = (x | x << 2) & 0x1249249249249249;
+    code |= x << i;
+  }
+  return code;
+}
+
 /// write a C++ data type straight to binary format
 template <typename T>
 void writePlainOldData(std::ofstream &out, const T &t)
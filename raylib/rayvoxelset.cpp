@@ -0,0 +1,92 @@
+// Copyright (c) 2023
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "rayvoxelset.h"
+#include "raythreads.h"
+
+#if RAYLIB_WITH_TBB
+#include <tbb/parallel_for.h>
+#endif  // RAYLIB_WITH_TBB
+
+namespace ray
+{
+void voxelSubsample(const std::vector<Eigen::Vector3d> &points, double voxel_width, std::vector<int64_t> &indices,
+                    std::vector<VoxelSet> &voxel_shards)
+{
+  if (voxel_shards.empty())
+  {
+    voxel_shards.resize(std::max(1, Threads::availableThreads()));
+  }
+  const int num_shards = static_cast<int>(voxel_shards.size());
+  const int count = static_cast<int>(points.size());
+
+  // 1. find the voxel of each point, and the shard that it belongs to. The high bits of the hash are used for the
+  // shard, as the low bits select the slot within each shard's hash table
+  std::vector<Eigen::Vector3i> voxels(points.size());
+  std::vector<int> shard_ids(points.size());
+  std::vector<uint8_t> keep(points.size(), 0);
+  const auto find_voxel = [&](int i) {
+    voxels[i] = voxelIndex(points[i], voxel_width);
+    shard_ids[i] = static_cast<int>((voxelHash(voxels[i]) >> 40) % static_cast<uint64_t>(num_shards));
+  };
+  // 2. bucket the points by shard, keeping their order within each shard. This is a counting sort on the shard ids
+  std::vector<int> shard_starts(num_shards + 1, 0);
+  std::vector<int> shard_points(points.size());
+  const auto bucket_points = [&]() {
+    for (int i = 0; i < count; i++)
+    {
+      shard_starts[shard_ids[i] + 1]++;
+    }
+    for (int shard = 0; shard < num_shards; shard++)
+    {
+      shard_starts[shard + 1] += shard_starts[shard];
+    }
+    std::vector<int> shard_ends(shard_starts.begin(), shard_starts.end() - 1);
+    for (int i = 0; i < count; i++)
+    {
+      shard_points[shard_ends[shard_ids[i]]++] = i;
+    }
+  };
+  // 3. each shard inserts its own points in order, so the first point in each voxel is kept
+  const auto insert_shard = [&](int shard) {
+    VoxelSet &voxel_set = voxel_shards[shard];
+    for (int j = shard_starts[shard]; j < shard_starts[shard + 1]; j++)
+    {
+      const int i = shard_points[j];
+      if (voxel_set.insert(voxels[i]))
+      {
+        keep[i] = 1;
+      }
+    }
+  };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for<int>(0, count, find_voxel);
+  bucket_points();
+  tbb::parallel_for<int>(0, num_shards, insert_shard);
+#else   // RAYLIB_WITH_TBB
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < count; i++)
+  {
+    find_voxel(i);
+  }
+  bucket_points();
+#pragma omp parallel for schedule(dynamic)
+  for (int shard = 0; shard < num_shards; shard++)
+  {
+    insert_shard(shard);
+  }
+#endif  // RAYLIB_WITH_TBB
+
+  // 4. gather the kept points in order
+  for (int i = 0; i < count; i++)
+  {
+    if (keep[i])
+    {
+      indices.push_back(i);
+    }
+  }
+}
+
+}  // namespace ray
@@ -0,0 +1,164 @@
+// Copyright (c) 2023
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYVOXELSET_H
+#define RAYLIB_RAYVOXELSET_H
+
+#include "raylib/raylibconfig.h"
+
+#include "rayhashmap.h"
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace ray
+{
+/// The integer coordinate of the voxel of width @c voxel_width containing @c point
+inline Eigen::Vector3i voxelIndex(const Eigen::Vector3d &point, double voxel_width)
+{
+  return Eigen::Vector3i(int(std::floor(point[0] / voxel_width)), int(std::floor(point[1] / voxel_width)),
+                         int(std::floor(point[2] / voxel_width)));
+}
+
+/// Hash of an integer voxel coordinate. Large odd multipliers spread neighbouring voxels across the hash range, and
+/// folding the high bits down gives good variation in the low bits
+inline uint64_t voxelHash(const Eigen::Vector3i &voxel)
+{
+  uint64_t h = static_cast<uint64_t>(static_cast<uint32_t>(voxel[0])) * 0x9E3779B97F4A7C15ull;
+  h ^= static_cast<uint64_t>(static_cast<uint32_t>(voxel[1])) * 0xC2B2AE3D27D4EB4Full;
+  h ^= static_cast<uint64_t>(static_cast<uint32_t>(voxel[2])) * 0x165667B19E3779F9ull;
+  return h ^ (h >> 32);
+}
+
+/// Hash function object for integer voxel coordinates
+struct VoxelHash
+{
+  inline size_t operator()(const Eigen::Vector3i &voxel) const { return static_cast<size_t>(voxelHash(voxel)); }
+};
+
+/// Map from integer voxel coordinates to values of type T, in an open-addressing hash table
+template <class T>
+using VoxelMap = HashMap<Eigen::Vector3i, T, VoxelHash>;
+
+/// Set of integer voxel coordinates, used to test whether a voxel has been visited before.
+/// When the voxel bounds are known in advance the set is a dense bitset, which needs one bit per voxel in the bounds.
+/// Otherwise (or for voxels outside the bounds) it is an open-addressing hash set.
+class VoxelSet
+{
+public:
+  /// An unbounded voxel set
+  VoxelSet() = default;
+  /// A voxel set that stores voxels between @c min_voxel and @c max_voxel inclusive in a bitset.
+  /// The bitset is not used if it would exceed @c max_bitset_bytes
+  VoxelSet(const Eigen::Vector3i &min_voxel, const Eigen::Vector3i &max_voxel, size_t max_bitset_bytes = 1 << 28)
+    : min_voxel_(min_voxel)
+  {
+    const Eigen::Vector3i dims = max_voxel - min_voxel + Eigen::Vector3i(1, 1, 1);
+    const double num_voxels =
+      static_cast<double>(dims[0]) * static_cast<double>(dims[1]) * static_cast<double>(dims[2]);
+    if (dims.minCoeff() > 0 && num_voxels <= 8.0 * static_cast<double>(max_bitset_bytes))
+    {
+      dims_ = dims;
+      bits_.resize((static_cast<size_t>(num_voxels) + 63) / 64, 0);
+    }
+  }
+
+  /// Add @c voxel to the set. Returns true if it was not already present
+  inline bool insert(const Eigen::Vector3i &voxel)
+  {
+    size_t bit;
+    if (bitIndex(voxel, bit))
+    {
+      uint64_t &word = bits_[bit >> 6];
+      const uint64_t mask = uint64_t(1) << (bit & 63);
+      if (word & mask)
+      {
+        return false;
+      }
+      word |= mask;
+      num_bits_set_++;
+      return true;
+    }
+    return hash_set_.insert(voxel, NoValue()).second;
+  }
+
+  /// Remove @c voxel from the set. Returns true if it was present
+  inline bool erase(const Eigen::Vector3i &voxel)
+  {
+    size_t bit;
+    if (bitIndex(voxel, bit))
+    {
+      uint64_t &word = bits_[bit >> 6];
+      const uint64_t mask = uint64_t(1) << (bit & 63);
+      if (!(word & mask))
+      {
+        return false;
+      }
+      word &= ~mask;
+      num_bits_set_--;
+      return true;
+    }
+    return hash_set_.erase(voxel);
+  }
+
+  /// Whether @c voxel is in the set
+  inline bool contains(const Eigen::Vector3i &voxel) const
+  {
+    size_t bit;
+    if (bitIndex(voxel, bit))
+    {
+      return (bits_[bit >> 6] >> (bit & 63)) & 1;
+    }
+    return hash_set_.find(voxel) != nullptr;
+  }
+
+  inline size_t size() const { return num_bits_set_ + hash_set_.size(); }
+  inline bool empty() const { return size() == 0; }
+  /// Remove all voxels, keeping the bounds
+  void clear()
+  {
+    std::fill(bits_.begin(), bits_.end(), 0);
+    num_bits_set_ = 0;
+    hash_set_.clear();
+  }
+
+private:
+  inline bool bitIndex(const Eigen::Vector3i &voxel, size_t &bit) const
+  {
+    if (bits_.empty())
+    {
+      return false;
+    }
+    const Eigen::Vector3i ind = voxel - min_voxel_;
+    if (ind[0] < 0 || ind[1] < 0 || ind[2] < 0 || ind[0] >= dims_[0] || ind[1] >= dims_[1] || ind[2] >= dims_[2])
+    {
+      return false;
+    }
+    bit = static_cast<size_t>(ind[0]) +
+          static_cast<size_t>(dims_[0]) * (static_cast<size_t>(ind[1]) + static_cast<size_t>(dims_[1]) * static_cast<size_t>(ind[2]));
+    return true;
+  }
+
+  Eigen::Vector3i min_voxel_ = Eigen::Vector3i::Zero();
+  Eigen::Vector3i dims_ = Eigen::Vector3i::Zero();
+  std::vector<uint64_t> bits_;
+  size_t num_bits_set_ = 0;
+  VoxelMap<NoValue> hash_set_;
+};
+
+/// Parallel form of voxelSubsample, for a voxel set that is split by voxel hash into @c voxel_shards, one per thread.
+/// Each thread visits the points of its own shard in order, so the result is identical to the serial form: the first
+/// point in each voxel is appended to @c indices, in order. If @c voxel_shards is empty it is sized to the number of
+/// available threads, and it should be kept between calls in the same way as a single voxel set.
+void RAYLIB_EXPORT voxelSubsample(const std::vector<Eigen::Vector3d> &points, double voxel_width,
+                                  std::vector<int64_t> &indices, std::vector<VoxelSet> &voxel_shards);
+
+}  // namespace ray
+
+#endif  // RAYLIB_RAYVOXELSET_H
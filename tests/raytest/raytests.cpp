@@ -5,11 +5,19 @@
 // Author: Thomas Lowe
 
 #include "raycloud.h"
+#include "raycloudwriter.h"
+#include "raymerger.h"
 #include "raymesh.h"
 #include "rayply.h"
 #include "rayforeststructure.h"
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <string>
 #include <vector>
 #include <gtest/gtest.h>
+#include <cstdio>
 #include <cstdlib>
 
 /// Raycloud testing framework. In each test, the statistics of the resulting clouds are compared to the statistics
@@ -59,6 +67,37 @@ namespace raytest
     }
   }
 
+  /// Sets the number of OpenMP threads used by subsequent commands.
+  void setThreadCount(int thread_count)
+  {
+    #ifdef _WIN32
+    _putenv_s("OMP_NUM_THREADS", std::to_string(thread_count).c_str());
+    #else
+    setenv("OMP_NUM_THREADS", std::to_string(thread_count).c_str(), 1);
+    #endif // _WIN32
+  }
+
+  /// Returns the contents of a file, for comparing outputs exactly.
+  std::string fileContents(const std::string &file_name)
+  {
+    std::ifstream file(file_name, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  }
+
+  /// Returns the number of rays whose colours differ between two clouds of the same rays.
+  size_t countColourDifferences(const ray::Cloud &cloud1, const ray::Cloud &cloud2)
+  {
+    EXPECT_EQ(cloud1.colours.size(), cloud2.colours.size());
+    size_t num_differences = 0;
+    for (size_t i = 0; i < std::min(cloud1.colours.size(), cloud2.colours.size()); i++)
+    {
+      const ray::RGBA &a = cloud1.colours[i], &b = cloud2.colours[i];
+      if (a.red != b.red || a.green != b.green || a.blue != b.blue || a.alpha != b.alpha)
+        num_differences++;
+    }
+    return num_differences;
+  }
+
   /// Creates two copies of the same room with a rotational difference, then aligns the first onto the second 
   TEST(Basic, RayAlign)
   {
@@ -78,6 +117,26 @@ namespace raytest
     ray::Cloud cloud;
     EXPECT_TRUE(cloud.load("room_coloured.ply"));
     compareMoments(cloud.getMoments(), {-0.108066, -0.0410134, 0.052168, 7.05134e-08, 8.45038e-08, 1.93877e-08, -0.276144, -0.0760758, 0.065631, 2.42455, 2.13738, 1.28226, 17.539, 10.1994, 0.497919, 0.496369, 0.490293, 0.987362, 0.248361, 0.203648, 0.385192, 0.111705});
+
+    // colouring in tiles should match the whole room, for each of the neighbourhood based colourings
+    for (const std::string type : { "shape", "normal", "branches", "time --lit" })
+    {
+      EXPECT_EQ(command("raycolour room.ply " + type), 0);
+      ray::Cloud whole;
+      EXPECT_TRUE(whole.load("room_coloured.ply"));
+      // exactly, when the halo reaches across the room
+      EXPECT_EQ(command("raycolour room.ply " + type + " --tile_width 10 --halo 30"), 0);
+      ray::Cloud tiled;
+      EXPECT_TRUE(tiled.load("room_coloured.ply"));
+      EXPECT_EQ(tiled.times, whole.times);
+      EXPECT_EQ(countColourDifferences(tiled, whole), 0u);
+      // and close to the tile edges only, for a small halo
+      EXPECT_EQ(command("raycolour room.ply " + type + " --tile_width 2 --halo 1"), 0);
+      ray::Cloud small_halo;
+      EXPECT_TRUE(small_halo.load("room_coloured.ply"));
+      EXPECT_EQ(small_halo.times, whole.times);
+      EXPECT_LT(countColourDifferences(small_halo, whole), whole.rayCount() / 100);
+    }
   }
   
   /// Creates two rooms, with different transformations, then combines them, and compares to the expected result.
@@ -91,6 +150,37 @@ namespace raytest
     ray::Cloud cloud;
     EXPECT_TRUE(cloud.load("room_combined.ply"));
     compareMoments(cloud.getMoments(), {-0.0867714, -0.0679941, 0.546619, 0.0215326, 0.0272819, 0.499969, -0.305657, -0.186353, 0.582642, 2.95777, 2.47531, 1.63323, 17.4967, 10.1789, 0.305355, 0.763356, 0.427376, 0.979005, 0.318409, 0.225661, 0.389366, 0.143369});
+    // combining in tiles should give the same result
+    const std::string untiled = fileContents("room_combined.ply");
+    EXPECT_EQ(command("./raycombine min room.ply room2.ply 1 rays --tile_width 2 --halo 2"), 0);
+    EXPECT_TRUE(fileContents("room_combined.ply") == untiled);
+    // as should updating room.ply with room2.ply, which re-combines only the tiles that room2.ply reaches
+    EXPECT_EQ(command("./raycombine min room.ply room2.ply 1 rays --update --tile_width 2 --halo 2"), 0);
+    EXPECT_TRUE(fileContents("room_combined.ply") == untiled);
+    // a time-ordered merge keeps every ray, sorted by time
+    EXPECT_EQ(command("./raycombine time room.ply room2.ply"), 0);
+    ray::Cloud room, time_cloud;
+    EXPECT_TRUE(room.load("room.ply"));
+    EXPECT_TRUE(time_cloud.load("room_combined.ply"));
+    EXPECT_EQ(time_cloud.ends.size(), 2 * room.ends.size());
+    EXPECT_TRUE(std::is_sorted(time_cloud.times.begin(), time_cloud.times.end()));
+    // an output that is also an input is only replaced once it has been read
+    EXPECT_EQ(copy("room2.ply room3.ply"), 0);
+    EXPECT_EQ(command("./raycombine all room3.ply room.ply --output room3.ply"), 0);
+    ray::Cloud replaced;
+    EXPECT_TRUE(replaced.load("room3.ply"));
+    EXPECT_EQ(replaced.ends.size(), 2 * room.ends.size());
+
+    // a 3-way merge of two changes to the room: one with half the room removed, one with a raised copy added
+    EXPECT_EQ(command("./raysplit room.ply plane 0,0.1,1.5"), 0);
+    EXPECT_EQ(copy("room.ply room_raised.ply"), 0);
+    EXPECT_EQ(command("./raytranslate room_raised.ply 0,0,1"), 0);
+    EXPECT_EQ(command("./raycombine all room.ply room_raised.ply --output room_added.ply"), 0);
+    EXPECT_EQ(command("./raycombine room.ply min room_outside.ply room_added.ply 1 rays"), 0);
+    ray::Cloud three_way;
+    EXPECT_TRUE(three_way.load("room_combined.ply"));
+    EXPECT_EQ(three_way.rayCount(), 35000u);
+    compareMoments(three_way.getMoments(), {-0.152414, -0.0416186, 1.05772, 0.719851, 0.538399, 0.0617663, -0.360413, -0.0862485, 1.08285, 2.73527, 2.31651, 1.29189, 17.5332, 10.2024, 0.304955, 0.761819, 0.429301, 0.981, 0.318999, 0.22576, 0.389991, 0.136525});
   }
   
   /// Creates a building with random seed 1, and compares to the expected results
@@ -112,6 +202,78 @@ namespace raytest
     // Below does not compare the time values (or the colour values, which are based on time here)
     // because spatial decimation does not constraint which time it picks points from.
     compareMoments(cloud.getMoments(), {-0.222571, 1.08156, 1.67264, 6.00755, 5.78731, 0.508713, -0.202668, 1.09517, 2.6238, 6.0285, 5.85715, 3.22093, 69.0574, 35.2775, 0.48969, 0.498403, 0.443549, 1, 0.379062, 0.366963, 0.389535, 0});
+
+    // decimating in tiles with a small memory limit must give the same result
+    EXPECT_EQ(command("raydecimate forest.ply 10 cm --max_memory 0.001"), 0);
+    ray::Cloud tiled_cloud;
+    EXPECT_TRUE(tiled_cloud.load("forest_decimated.ply"));
+    EXPECT_EQ(tiled_cloud.ends.size(), cloud.ends.size());
+    compareMoments(tiled_cloud.getMoments(), {-0.222571, 1.08156, 1.67264, 6.00755, 5.78731, 0.508713, -0.202668, 1.09517, 2.6238, 6.0285, 5.85715, 3.22093, 69.0574, 35.2775, 0.48969, 0.498403, 0.443549, 1, 0.379062, 0.366963, 0.389535, 0});
+  }
+
+  /// Checks that voxel subsampling with a VoxelSet matches that with an ordered std::set, both for the unbounded
+  /// (hash) and bounded (bitset) forms, and for voxel sets sharded over threads
+  TEST(Basic, VoxelSet)
+  {
+    // a small volume, so that many points share a voxel
+    std::vector<Eigen::Vector3d> points(5000);
+    for (auto &point : points)
+    {
+      point = Eigen::Vector3d(ray::random(-2.5, 2.5), ray::random(-2.5, 2.5), ray::random(0.0, 2.0));
+    }
+    const double voxel_width = 0.25;
+
+    std::vector<int64_t> reference;
+    std::set<Eigen::Vector3i, ray::Vector3iLess> ordered_set;
+    for (int64_t i = 0; i < (int64_t)points.size(); i++)
+    {
+      if (ordered_set.insert(ray::voxelIndex(points[i], voxel_width)).second)
+      {
+        reference.push_back(i);
+      }
+    }
+
+    std::vector<int64_t> hashed;
+    ray::VoxelSet hash_set;
+    ray::voxelSubsample(points, voxel_width, hashed, hash_set);
+
+    std::vector<int64_t> bitset;
+    ray::VoxelSet bit_set(ray::voxelIndex(Eigen::Vector3d(-2.5, -2.5, 0.0), voxel_width),
+                          ray::voxelIndex(Eigen::Vector3d(2.5, 2.5, 2.0), voxel_width));
+    ray::voxelSubsample(points, voxel_width, bitset, bit_set);
+
+    // the parallel form, with the voxels sharded over a fixed number of sets
+    std::vector<int64_t> sharded;
+    std::vector<ray::VoxelSet> shards(4);
+    ray::voxelSubsample(points, voxel_width, sharded, shards);
+
+    EXPECT_LT(reference.size(), points.size());
+    EXPECT_EQ(hashed, reference);
+    EXPECT_EQ(bitset, reference);
+    EXPECT_EQ(sharded, reference);
+    EXPECT_EQ(hash_set.size(), ordered_set.size());
+    EXPECT_EQ(bit_set.size(), ordered_set.size());
+    EXPECT_TRUE(hash_set.contains(ray::voxelIndex(points[0], voxel_width)));
+    EXPECT_FALSE(bit_set.contains(ray::voxelIndex(Eigen::Vector3d(0.0, 0.0, 100.0), voxel_width)));
+
+    // removal must leave the remaining voxels reachable
+    for (size_t i = 0; i < reference.size(); i += 2)
+    {
+      const Eigen::Vector3i voxel = ray::voxelIndex(points[reference[i]], voxel_width);
+      ordered_set.erase(voxel);
+      EXPECT_TRUE(hash_set.erase(voxel));
+      EXPECT_TRUE(bit_set.erase(voxel));
+    }
+    EXPECT_EQ(hash_set.size(), ordered_set.size());
+    EXPECT_EQ(bit_set.size(), ordered_set.size());
+    size_t num_mismatches = 0;
+    for (const auto &id : reference)
+    {
+      const Eigen::Vector3i voxel = ray::voxelIndex(points[id], voxel_width);
+      const bool present = ordered_set.count(voxel) > 0;
+      num_mismatches += (hash_set.contains(voxel) != present) + (bit_set.contains(voxel) != present);
+    }
+    EXPECT_EQ(num_mismatches, 0u);
   }
 
   /// Creates a room, and calls denoise using a fixed distance threshols, and compares to expected result
@@ -124,6 +286,26 @@ namespace raytest
     compareMoments(cloud.getMoments(), {-0.108066, -0.0410134, 0.052168, 8.67026e-08, 8.81787e-08, 2.24394e-08, -0.464107, -0.113806, 0.161496, 2.82122, 2.34281, 1.35279, 17.81, 10.2005, 0.297047, 0.758802, 0.440232, 0.975166, 0.317215, 0.226682, 0.390971, 0.155618});
   }
 
+  /// Creates a forest and renders it in each style, with one thread and with several, which should give the same image
+  TEST(Basic, RayRender)
+  {
+    EXPECT_EQ(command("raycreate forest 1"), 0);
+    for (const std::string style : { "ends", "starts", "mean", "sum", "rays", "height" })
+    {
+      for (const std::string view : { "top", "left" })
+      {
+        const std::string render = "rayrender forest.ply " + view + " " + style + " --pixel_width 0.05 --output ";
+        setThreadCount(1);
+        EXPECT_EQ(command(render + "forest_serial.hdr"), 0);
+        setThreadCount(4);
+        EXPECT_EQ(command(render + "forest_parallel.hdr"), 0);
+        const std::string serial = fileContents("forest_serial.hdr");
+        EXPECT_FALSE(serial.empty());
+        EXPECT_TRUE(serial == fileContents("forest_parallel.hdr")) << view << " " << style;
+      }
+    }
+  }
+
   /// Creates two rooms, the second is decimated and transformed, then rayrestore is called to apply this transformation to
   /// the first (high resolution) room
   TEST(Basic, RayRestore)
@@ -136,7 +318,12 @@ namespace raytest
     EXPECT_EQ(command("rayrestore room2_decimated.ply 10 cm room.ply"), 0);
     ray::Cloud cloud;
     EXPECT_TRUE(cloud.load("room_restored.ply"));
-    compareMoments(cloud.getMoments(), {2.07399, 0.575952, 3.05217, 7.85442e-08, 7.70963e-08, 1.93877e-08, 1.9391, 0.682169, 3.06563, 2.10068, 2.45642, 1.28226, 17.539, 10.1994, 0.304682, 0.761892, 0.429502, 0.987362, 0.318932, 0.225742, 0.389901, 0.111705});
+    const std::vector<double> moments = {2.07399, 0.575952, 3.05217, 7.85442e-08, 7.70963e-08, 1.93877e-08, 1.9391, 0.682169, 3.06563, 2.10068, 2.45642, 1.28226, 17.539, 10.1994, 0.304682, 0.761892, 0.429502, 0.987362, 0.318932, 0.225742, 0.389901, 0.111705};
+    compareMoments(cloud.getMoments(), moments);
+    // the streamed merge-join should restore the same cloud
+    EXPECT_EQ(command("rayrestore room2_decimated.ply 10 cm room.ply --stream"), 0);
+    EXPECT_TRUE(cloud.load("room_restored.ply"));
+    compareMoments(cloud.getMoments(), moments);
   }  
 
   /// Creates a forest and rotates it in all three axes, comparing to the expected result
@@ -157,8 +344,80 @@ namespace raytest
     ray::Cloud cloud;
     EXPECT_TRUE(cloud.load("room_smooth.ply"));
     compareMoments(cloud.getMoments(), {-0.108066, -0.0410134, 0.052168, 7.05134e-08, 8.45038e-08, 1.93877e-08, -0.27615, -0.0761079, 0.0656267, 2.42413, 2.13691, 1.28163, 17.539, 10.1994, 0.304682, 0.761892, 0.429502, 0.987362, 0.318932, 0.225742, 0.389901, 0.111705});
+    // smoothing in small tiles, with a halo of neighbouring points, should closely match smoothing the whole room
+    for (const std::string neighbours : { "16", "8" })
+    {
+      EXPECT_EQ(command("raysmooth room.ply --neighbours " + neighbours), 0);
+      ray::Cloud whole;
+      EXPECT_TRUE(whole.load("room_smooth.ply"));
+      EXPECT_EQ(command("raysmooth room.ply --tile_width 2 --halo 1 --neighbours " + neighbours), 0);
+      ray::Cloud tiled;
+      EXPECT_TRUE(tiled.load("room_smooth.ply"));
+      ASSERT_EQ(tiled.rayCount(), whole.rayCount());
+      EXPECT_EQ(tiled.times, whole.times);
+      double max_difference = 0.0;
+      for (size_t i = 0; i < tiled.rayCount(); i++)
+      {
+        max_difference = std::max(max_difference, (tiled.ends[i] - whole.ends[i]).norm());
+      }
+      EXPECT_LT(max_difference, 0.005);
+    }
   }  
 
+  /// Creates a room, sorts it spatially in several runs, then sorts it back into time order
+  TEST(Basic, RaySort)
+  {
+    EXPECT_EQ(command("raycreate room 1"), 0);
+    EXPECT_EQ(command("raysort room.ply morton --max_memory 0.001"), 0);
+    ray::Cloud cloud, morton_cloud;
+    EXPECT_TRUE(cloud.load("room.ply"));
+    EXPECT_TRUE(morton_cloud.load("room_sorted.ply"));
+    EXPECT_EQ(morton_cloud.rayCount(), cloud.rayCount());
+    // the end points must be in Morton order, over the same grid that raysort uses
+    ray::Cloud::Info info;
+    EXPECT_TRUE(ray::Cloud::getInfo("room.ply", info));
+    const Eigen::Vector3d min_bound = info.rays_bound.min_bound_;
+    const double cell_width = (info.rays_bound.max_bound_ - min_bound).maxCoeff() / double((1 << 21) - 1);
+    uint64_t last_code = 0;
+    size_t num_out_of_order = 0;
+    for (const auto &end : morton_cloud.ends)
+    {
+      const Eigen::Vector3d index = ((end - min_bound) / cell_width).array().max(0.0).min(double((1 << 21) - 1));
+      const uint64_t code = ray::mortonCode(index.cast<int>());
+      if (code < last_code)
+        num_out_of_order++;
+      last_code = code;
+    }
+    EXPECT_EQ(num_out_of_order, 0u);
+
+    // sorting back by time must restore every ray, with its start, end and colour
+    EXPECT_EQ(command("raysort room_sorted.ply time"), 0);
+    ray::Cloud sorted_cloud;
+    EXPECT_TRUE(sorted_cloud.load("room_sorted_sorted.ply"));
+    EXPECT_EQ(sorted_cloud.times, cloud.times);
+    EXPECT_EQ(sorted_cloud.starts, cloud.starts);
+    EXPECT_EQ(sorted_cloud.ends, cloud.ends);
+    EXPECT_EQ(countColourDifferences(sorted_cloud, cloud), 0u);
+
+    // hundreds of small runs are merged in more than one pass, giving the same result
+    EXPECT_TRUE(ray::Cloud::sortFile(
+      "room_sorted.ply", "room_many_runs.ply",
+      [](const Eigen::Vector3d &, const Eigen::Vector3d &, double time) { return ray::timeSortKey(time); }, 100));
+    ray::Cloud many_runs_cloud;
+    EXPECT_TRUE(many_runs_cloud.load("room_many_runs.ply"));
+    EXPECT_EQ(many_runs_cloud.times, cloud.times);
+    EXPECT_EQ(many_runs_cloud.ends, cloud.ends);
+    EXPECT_FALSE(std::ifstream("room_many_runs_run0.ply").good());
+    EXPECT_FALSE(std::ifstream("room_many_runs_run0_merge0.ply").good());
+
+    // a sort whose runs or output cannot be written fails, in memory and when spilling runs
+    const auto time_key = [](const Eigen::Vector3d &, const Eigen::Vector3d &, double time) {
+      return ray::timeSortKey(time);
+    };
+    EXPECT_FALSE(ray::Cloud::sortFile("room_sorted.ply", "missing_directory/room_sorted.ply", time_key));
+    EXPECT_FALSE(ray::Cloud::sortFile("room_sorted.ply", "missing_directory/room_sorted.ply", time_key, 100));
+  }
+
   /// Creates a room, then splits it around a plane, comparing agaisnt the expected result
   TEST(Basic, RaySplit)
   {
@@ -169,6 +428,163 @@ namespace raytest
     compareMoments(cloud.getMoments(), {-0.467731, 1.05075, 1.43662, 2.20441, 1.60162, 0.106775, -0.77974, 1.03139, 1.57353, 3.67521, 2.64766, 0.485084, 17.3995, 10.279, 0.311066, 0.759795, 0.425206, 0.951355, 0.321609, 0.226785, 0.39073, 0.215125});
   }  
 
+  /// Splits a forest around an undulating ground mesh, at zero, positive and negative offsets, comparing the inside
+  /// and outside ray counts to those of the previous, voxel grid based, classifier
+  TEST(Basic, RaySplitMesh)
+  {
+    EXPECT_EQ(command("raycreate forest 1"), 0);
+    ray::Mesh mesh;
+    const int num_cells = 48;
+    const double cell_width = 0.5, corner = -12.0;
+    for (int y = 0; y <= num_cells; y++)
+    {
+      for (int x = 0; x <= num_cells; x++)
+      {
+        const double px = corner + cell_width * x, py = corner + cell_width * y;
+        mesh.vertices().push_back(Eigen::Vector3d(px, py, 0.5 + 0.3 * std::sin(0.7 * px) + 0.2 * std::cos(0.9 * py)));
+      }
+    }
+    for (int y = 0; y < num_cells; y++)
+    {
+      for (int x = 0; x < num_cells; x++)
+      {
+        const int i = x + (num_cells + 1) * y;
+        mesh.indexList().push_back(Eigen::Vector3i(i, i + 1, i + num_cells + 2));
+        mesh.indexList().push_back(Eigen::Vector3i(i, i + num_cells + 2, i + num_cells + 1));
+      }
+    }
+    EXPECT_TRUE(ray::writePlyMesh("forest_ground.ply", mesh));
+
+    const std::vector<std::string> offsets = { "0", "0.3", "-0.3" };
+    const std::vector<std::pair<size_t, size_t>> expected_counts = { { 74468, 50899 }, { 73091, 52276 }, { 86043, 39324 } };
+    for (size_t i = 0; i < offsets.size(); i++)
+    {
+      EXPECT_EQ(command("raysplit forest.ply forest_ground.ply distance " + offsets[i]), 0);
+      ray::Cloud inside, outside;
+      EXPECT_TRUE(inside.load("forest_inside.ply", true, 1));
+      EXPECT_TRUE(outside.load("forest_outside.ply", true, 1));
+      EXPECT_EQ(inside.rayCount(), expected_counts[i].first);
+      EXPECT_EQ(outside.rayCount(), expected_counts[i].second);
+    }
+  }
+
+  /// Splits a forest around two tree structures, streaming it from file and in memory, which should give the same
+  /// result. Segments thinner than a negative offset enclose no points.
+  TEST(Basic, RaySplitTrees)
+  {
+    EXPECT_EQ(command("raycreate forest 1"), 0);
+    {
+      std::ofstream trees("forest_trees.txt");
+      trees << "# Tree file. test" << std::endl;
+      trees << "x,y,z,radius,parent_id" << std::endl;
+      trees << "-6.28885,1.0615,0,0.25,-1, -6.31486,1.08229,1,0.225,0, -6.2637,0.974607,2,0.2,1, "
+               "-6.38622,1.129,3,0.175,2, -6.33698,1.00837,4,0.15,3, -6.18972,1.05555,5,0.125,4, "
+               "-6.22156,1.05677,6,0.1,5, -6.26104,0.991625,7,0.075,6, -6.26188,1.13511,8,0.05,7, "
+               "-6.72319,1.37426,7.3,0.045,7, -7.18535,1.7569,7.6,0.03,9" << std::endl;
+      trees << "5.25177,9.09151,0,0.25,-1, 5.2946,9.17573,1,0.225,0, 5.23077,9.15169,2,0.2,1, "
+               "5.2407,9.17862,3,0.175,2, 5.32755,9.011,4,0.15,3, 5.17897,9.0349,5,0.125,4, "
+               "5.34487,9.07874,6,0.1,5, 5.2771,9.05171,7,0.075,6, 5.25322,9.06868,8,0.05,7, "
+               "4.59269,8.90732,5.3,0.045,5, 4.00641,8.77974,5.6,0.03,9" << std::endl;
+    }
+    ray::ForestStructure forest;
+    EXPECT_TRUE(forest.load("forest_trees.txt"));
+    ray::Cloud cloud;
+    EXPECT_TRUE(cloud.load("forest.ply"));
+
+    const std::vector<double> offsets = { 0.0, 0.2, -0.02, -0.1 };
+    std::vector<size_t> inside_counts;
+    for (const double offset : offsets)
+    {
+      ray::Cloud inside, outside;
+      forest.splitCloud(cloud, offset, inside, outside);
+      EXPECT_TRUE(forest.splitCloud("forest.ply", offset, "forest_inside.ply", "forest_outside.ply"));
+      ray::Cloud streamed_inside, streamed_outside;
+      EXPECT_TRUE(streamed_inside.load("forest_inside.ply", true, 0));
+      EXPECT_TRUE(streamed_outside.load("forest_outside.ply", true, 0));
+      EXPECT_EQ(streamed_inside.times, inside.times) << offset;
+      EXPECT_EQ(streamed_outside.times, outside.times) << offset;
+      EXPECT_EQ(inside.rayCount() + outside.rayCount(), cloud.rayCount());
+      inside_counts.push_back(inside.rayCount());
+    }
+    EXPECT_GT(inside_counts[0], 0u);
+    EXPECT_GT(inside_counts[1], inside_counts[0]);
+    EXPECT_LT(inside_counts[2], inside_counts[0]);
+    EXPECT_LT(inside_counts[3], inside_counts[2]);
+
+    // at an offset of -0.1 only the trunk segments of radius above 0.1 enclose points, and these end 5 m up
+    ray::Cloud inside, outside;
+    forest.splitCloud(cloud, -0.1, inside, outside);
+    for (size_t i = 0; i < inside.rayCount(); i++)
+    {
+      EXPECT_LT(inside.ends[i][2], 5.0 + 1e-6);
+    }
+  }
+
+  /// Splits a forest into more grid cells than the writer pool keeps open, checking that no rays are lost or misplaced
+  TEST(Basic, RaySplitGrid)
+  {
+    EXPECT_EQ(command("raycreate forest 1"), 0);
+    EXPECT_EQ(command("raysplit forest.ply grid 1,1,0"), 0);
+    size_t num_cells = 0, num_rays = 0, num_misplaced = 0;
+    const double eps = 1e-4;
+    for (int x = -30; x <= 30; x++)
+    {
+      for (int y = -30; y <= 30; y++)
+      {
+        const std::string name = "forest_" + std::to_string(x) + "_" + std::to_string(y) + ".ply";
+        if (!std::ifstream(name).good())
+          continue;
+        ray::Cloud cell;
+        EXPECT_TRUE(cell.load(name, true, 1));
+        num_cells++;
+        num_rays += cell.rayCount();
+        // each ray is clipped to its 1 m cell, centred on the cell index
+        const Eigen::Vector3d min_bound(x - 0.5 - eps, y - 0.5 - eps, std::numeric_limits<double>::lowest());
+        const Eigen::Vector3d max_bound(x + 0.5 + eps, y + 0.5 + eps, std::numeric_limits<double>::max());
+        for (size_t i = 0; i < cell.rayCount(); i++)
+        {
+          for (const auto &point : { cell.starts[i], cell.ends[i] })
+          {
+            if ((point.array() < min_bound.array()).any() || (point.array() > max_bound.array()).any())
+              num_misplaced++;
+          }
+        }
+      }
+    }
+    // the default pool keeps 256 files open, so the rest are suspended and resumed
+    EXPECT_GT(num_cells, 256u);
+    EXPECT_EQ(num_rays, 228613u);
+    EXPECT_EQ(num_misplaced, 0u);
+
+    // a small pool that flushes on every call, so each file is suspended and resumed between its writes
+    {
+      ray::CloudWriterPool pool(4, 0);
+      for (int round = 0; round < 5; round++)
+      {
+        for (int id = 0; id < 10; id++)
+        {
+          if (!pool.has(id))
+            pool.create(id, "pool_" + std::to_string(id) + ".ply");
+          const Eigen::Vector3d end(id, round, 0.0);
+          pool.addRay(id, end + Eigen::Vector3d(0, 0, 1), end, double(id * 10 + round), ray::RGBA::white());
+        }
+        EXPECT_TRUE(pool.flush());
+      }
+      EXPECT_TRUE(pool.end());
+    }
+    for (int id = 0; id < 10; id++)
+    {
+      ray::Cloud cloud;
+      EXPECT_TRUE(cloud.load("pool_" + std::to_string(id) + ".ply"));
+      EXPECT_EQ(cloud.rayCount(), 5u);
+      for (size_t round = 0; round < cloud.rayCount(); round++)
+      {
+        EXPECT_EQ(cloud.times[round], double(id * 10 + (int)round));
+        EXPECT_EQ(cloud.ends[round], Eigen::Vector3d(id, (double)round, 0.0));
+      }
+    }
+  }
+
   /// Creates a room and runs raytransients, comparing the identified transients ray cloud to the expected results
   TEST(Basic, RayTransients)
   {
@@ -177,6 +593,93 @@ namespace raytest
     ray::Cloud cloud;
     EXPECT_TRUE(cloud.load("room_transient.ply"));
     compareMoments(cloud.getMoments(), {-1.05406, -0.240721, -0.0629182, 5.05649e-08, 3.32941e-08, 2.54759e-08, 0.268724, -0.136746, -0.596782, 1.04798, 0.921776, 0.527205, 32.1452, 6.7491, 0.205871, 0.395641, 0.884296, 1, 0.225501, 0.296487, 0.153923, 0});
+    // filtering in tiles should give the same result
+    const std::string untiled_room = fileContents("room_transient.ply");
+    EXPECT_EQ(command("raytransients min room.ply 1 rays --tile_width 2 --halo 2"), 0);
+    EXPECT_TRUE(fileContents("room_transient.ply") == untiled_room);
+
+    // time windows need a time-sorted cloud, and reject any other without leaving partial output
+    EXPECT_EQ(command("raysort room.ply morton"), 0);
+    std::remove("room_sorted_transient.ply");
+    std::remove("room_sorted_fixed.ply");
+    EXPECT_NE(command("raytransients min room_sorted.ply 1 rays --window 10"), 0);
+    EXPECT_FALSE(std::ifstream("room_sorted_transient.ply").good());
+    EXPECT_FALSE(std::ifstream("room_sorted_fixed.ply").good());
+
+    // windows whose overlap spans the whole scan should find the same transients as the untiled filter
+    EXPECT_EQ(command("raysort room_sorted.ply time"), 0);
+    EXPECT_EQ(command("raytransients min room_sorted_sorted.ply 1 rays"), 0);
+    ray::Cloud untiled_cloud;
+    EXPECT_TRUE(untiled_cloud.load("room_sorted_sorted_transient.ply"));
+    for (const auto &window_args : { std::string("--window 1000"), std::string("--window 10 --overlap 50") })
+    {
+      EXPECT_EQ(command("raytransients min room_sorted_sorted.ply 1 rays " + window_args), 0);
+      ray::Cloud window_cloud;
+      EXPECT_TRUE(window_cloud.load("room_sorted_sorted_transient.ply"));
+      EXPECT_EQ(window_cloud.times, untiled_cloud.times);
+      EXPECT_EQ(window_cloud.ends, untiled_cloud.ends);
+    }
+
+    // the whole-cloud filter of a forest, where transients are sensitive to the voxel grid
+    EXPECT_EQ(command("raycreate forest 1"), 0);
+    EXPECT_EQ(command("raytransients min forest.ply 1 rays"), 0);
+    ray::Cloud forest;
+    EXPECT_TRUE(forest.load("forest_transient.ply"));
+    EXPECT_EQ(forest.rayCount(), 35323u);
+    compareMoments(forest.getMoments(), {-0.335463, 2.44926, 1.85009, 6.25569, 5.50206, 0.687295, -0.301898, 2.50358, 4.64139, 6.27429, 5.62896, 2.8247, 41.1898, 27.4674, 0.512782, 0.567323, 0.365137, 1, 0.351287, 0.365901, 0.38616, 0});
+    const std::string untiled_forest = fileContents("forest_transient.ply");
+    EXPECT_EQ(command("raytransients min forest.ply 1 rays --tile_width 3 --halo 2"), 0);
+    EXPECT_TRUE(fileContents("forest_transient.ply") == untiled_forest);
+
+    // the ray grid and the ellipsoid hierarchy should find the same transients
+    ray::Cloud forest_cloud;
+    EXPECT_TRUE(forest_cloud.load("forest.ply"));
+    ray::MergerConfig config;
+    config.num_rays_filter_threshold = 1;
+    config.merge_type = ray::MergeType::Mininum;
+    config.ray_query = ray::RayQuery::RayGrid;
+    ray::Merger grid_merger(config);
+    grid_merger.filter(forest_cloud);
+    config.ray_query = ray::RayQuery::EllipsoidBvh;
+    ray::Merger bvh_merger(config);
+    bvh_merger.filter(forest_cloud);
+    EXPECT_EQ(grid_merger.differenceCloud().rayCount(), 35323u);
+    EXPECT_EQ(bvh_merger.differenceCloud().rayCount(), grid_merger.differenceCloud().rayCount());
+    EXPECT_TRUE(bvh_merger.differenceCloud().times == grid_merger.differenceCloud().times);
+
+    // a ray whose line crosses an ellipsoid behind its start misses it, rather than passing through it
+    const Eigen::Matrix3f unit_sphere = Eigen::Matrix3f::Identity();
+    EXPECT_EQ(ray::intersectEllipsoid(Eigen::Vector3d::Zero(), unit_sphere, Eigen::Vector3d(2, 0, 0),
+                                      Eigen::Vector3d(5, 0, 0)), ray::IntersectResult::Miss);
+    EXPECT_EQ(ray::intersectEllipsoid(Eigen::Vector3d::Zero(), unit_sphere, Eigen::Vector3d(-5, 0, 0),
+                                      Eigen::Vector3d(5, 0, 0)), ray::IntersectResult::Passthrough);
+    ray::Cloud line_rays;
+    line_rays.addRay(Eigen::Vector3d(2, 0, 0), Eigen::Vector3d(5, 0, 0), 0.0, ray::RGBA::white());
+    line_rays.addRay(Eigen::Vector3d(-5, 0, 0), Eigen::Vector3d(5, 0, 0), 1.0, ray::RGBA::white());
+    std::vector<ray::IntersectResult> line_results;
+    ray::intersectEllipsoidBatch(Eigen::Vector3d::Zero(), unit_sphere, line_rays, { 0, 1 }, line_results);
+    EXPECT_EQ(line_results[0], ray::IntersectResult::Miss);
+    EXPECT_EQ(line_results[1], ray::IntersectResult::Passthrough);
+
+    // the compact ellipsoid positions keep their precision in a cloud many kilometres across
+    ray::Cloud wide_cloud = forest_cloud;
+    const Eigen::Vector3d far_offset(50000.0, -20000.0, 0.0);
+    for (size_t i = 0; i < forest_cloud.rayCount(); i++)
+    {
+      wide_cloud.addRay(forest_cloud.starts[i] + far_offset, forest_cloud.ends[i] + far_offset, forest_cloud.times[i],
+                        forest_cloud.colours[i]);
+    }
+    std::vector<ray::Ellipsoid> ellipsoids;
+    ray::generateEllipsoids(&ellipsoids, nullptr, nullptr, wide_cloud);
+    ray::EllipsoidStore store;
+    ray::generateEllipsoids(&store, nullptr, nullptr, wide_cloud);
+    EXPECT_GT(store.size(), forest_cloud.rayCount());
+    double max_error = 0.0;
+    for (size_t i = 0; i < store.size(); i++)
+    {
+      max_error = std::max(max_error, (store.position(i) - ellipsoids[store.ray_ids[i]].pos).norm());
+    }
+    EXPECT_LT(max_error, 1e-4);
   }  
 
   /// Creates a forest and translates it in all three axes, comparing to the expected result